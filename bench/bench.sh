@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# bench.sh - Benchmark the shell's hot paths (run by make bench)
+#
+# Every run happens in a fresh copy of etc/, home/ and proc/ under a
+# temporary directory, with generated inputs of fixed sizes, so results
+# only depend on the machine. Each timed startup is run BENCH_RUNS times
+# after a warm-up run and the median is reported.
+#
+#     BENCH_N      commands per launch benchmark (default 2000)
+#     BENCH_JOBS   background jobs in the job table benchmark (default 500)
+#     BENCH_RUNS   runs of each startup benchmark (default 5)
+#
+set -eu
+
+N=${BENCH_N:-2000}
+JOBS=${BENCH_JOBS:-500}
+RUNS=${BENCH_RUNS:-5}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BOX=$(mktemp -d "${TMPDIR:-/tmp}/tsh-bench.XXXXXX")
+trap 'rm -rf "$BOX"' EXIT
+
+# Build the shell and the driver the same way on every machine
+gcc -std=gnu11 -O2 -o "$BOX/tsh" "$SRC/tsh.c"
+gcc -std=gnu11 -O2 -o "$BOX/driver" "$SRC/bench/driver.c"
+cd "$BOX"
+mkdir -p etc home/root proc
+echo "root:bench:home/root" > etc/passwd
+touch home/root/.tsh_history
+export TSH_AUTH=root:bench
+
+# ms - Print the median time in ms of RUNS runs of a command (after one warm-up run)
+ms() {
+    "$@" > /dev/null
+    for _ in $(seq "$RUNS"); do
+        local start=$(date +%s%N)
+        "$@" > /dev/null
+        echo $(( ($(date +%s%N) - start) / 1000 ))
+    done | sort -n | awk '{ t[NR] = $1 } END { printf "%8.3fms\n", t[int((NR + 1) / 2)] / 1000 }'
+}
+
+echo "tsh benchmarks: $(git -C "$SRC" rev-parse --short HEAD 2>/dev/null || echo unknown)," \
+    "$(uname -sm), $(nproc) cpus, $(gcc -dumpfullversion)"
+echo
+
+echo "== Command launch ($N commands)"
+for flags in "-P none" "-P files" "-f -P none"; do
+    echo "-- tsh -p $flags"
+    rm -f home/root/.tsh_history
+    ./driver launch "$N" -- ./tsh -p $flags
+done
+echo
+
+echo "== init_history() against history file size (login and exit)"
+for lines in 0 1000 10000 35000; do
+    # Stay under the 1MB at which quit rewrites the file, so every run reads the same file
+    awk -v n="$lines" 'BEGIN { for (i = 1; i <= n; i++) printf "/bin/echo history line %d\n", i }' \
+        > home/root/.tsh_history
+    printf "%-24s %s\n" "$lines lines" "$(ms ./tsh -p -P none -c "")"
+done
+echo
+
+echo "== authenticate() against passwd size (login as the last user and exit)"
+for users in 10 1000 10000 100000; do
+    awk -v n="$users" 'BEGIN { print "root:bench:home/root"
+        for (i = 1; i <= n; i++) printf "user%d:password%d:home/root\n", i, i }' > etc/passwd
+    printf "%-24s %s\n" "$users users" "$(TSH_AUTH="user$users:password$users" ms ./tsh -p -P none -c "")"
+done
+echo "root:bench:home/root" > etc/passwd
+echo
+
+echo "== Job table ($JOBS background jobs)"
+for flags in "-P none" "-P files"; do
+    echo "-- tsh -p $flags"
+    ./driver jobs "$JOBS" -- ./tsh -p $flags
+done
+echo
+
+echo "== Session start (10000 users and 10000 lines of history: a new login against a request to a server)"
+awk 'BEGIN { print "root:bench:home/root"
+    for (i = 1; i <= 10000; i++) printf "user%d:password%d:home/root\n", i, i }' > etc/passwd
+awk 'BEGIN { for (i = 1; i <= 10000; i++) printf "/bin/echo history line %d\n", i }' > home/root/.tsh_history
+printf "%-24s %s\n" "tsh -c" "$(ms ./tsh -p -P none -c /bin/true)"
+./tsh -p -P none -S "$BOX/tsh.sock" > /dev/null &
+SERVER=$!
+while [ ! -S "$BOX/tsh.sock" ]; do sleep 0.01; done
+printf "%-24s %s\n" "tsh -C" "$(ms ./tsh -C "$BOX/tsh.sock" /bin/true)"
+kill -QUIT "$SERVER"
+wait "$SERVER" 2>/dev/null || true
+echo "root:bench:home/root" > etc/passwd
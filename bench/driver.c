@@ -0,0 +1,176 @@
+/*
+ * driver - Drive a tsh over pipes and time how long its commands take
+ *
+ * The shell is started with its stdin and stdout connected to pipes and
+ * is sent one command at a time, so each time is the delay a user sees
+ * from the end of the line to the command's output (launch, exec, exit
+ * and reap). The shell should be run with -p and logged in through
+ * TSH_AUTH, so nothing but the commands' output comes back.
+ *
+ *     driver launch N -- tsh args...   N commands one at a time, then N
+ *                                      commands sent in one go
+ *     driver jobs N -- tsh args...     N background jobs one at a time,
+ *                                      then one jobs command
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+
+FILE *to_shell;     /* the shell's stdin */
+FILE *from_shell;   /* the shell's stdout */
+pid_t shell_pid;    /* pid of the shell */
+
+/* now - Monotonic time in seconds */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* die - Print the message and exit */
+void die(char *msg) {
+    fprintf(stderr, "driver: %s\n", msg);
+    exit(1);
+}
+
+/* start_shell - Run argv with its stdin and stdout connected to the driver */
+void start_shell(char **argv) {
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        die("pipe failed");
+    }
+    if ((shell_pid = fork()) < 0) {
+        die("fork failed");
+    }
+    if (shell_pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        exit(1);
+    }
+    close(in[0]);
+    close(out[1]);
+    to_shell = fdopen(in[1], "w");
+    from_shell = fdopen(out[0], "r");
+}
+
+/* stop_shell - Close the shell's input and wait for it to exit */
+void stop_shell() {
+    fclose(to_shell);
+    fclose(from_shell);
+    waitpid(shell_pid, NULL, 0);
+}
+
+/* send - Send one line to the shell */
+void send(char *line) {
+    fputs(line, to_shell);
+    fflush(to_shell);
+}
+
+/* expect - Read lines from the shell until one starts with prefix */
+void expect(char *prefix, char *line, size_t size) {
+    while (fgets(line, size, from_shell) != NULL) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            return;
+        }
+    }
+    die("the shell exited early");
+}
+
+/* cmp_double - qsort comparison of doubles */
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* report - Print the p50, p99 and max of n times (sorts them) */
+void report(char *what, double *times, int n) {
+    qsort(times, n, sizeof(double), cmp_double);
+    printf("%-24s p50 %8.3fms  p99 %8.3fms  max %8.3fms  (n=%d)\n", what,
+        1e3 * times[n / 2], 1e3 * times[(int) (n * 0.99)], 1e3 * times[n - 1], n);
+}
+
+/* bench_launch - Time foreground commands one at a time and then in one go */
+void bench_launch(int n) {
+    char line[256], marker[32];
+    double *times = malloc(n * sizeof(double));
+
+    for (int i = 0; i < n; i++) {
+        sprintf(marker, "%d\n", i);
+        sprintf(line, "/bin/echo %d\n", i);
+        double start = now();
+        send(line);
+        expect(marker, line, sizeof(line));
+        times[i] = now() - start;
+    }
+    report("launch latency", times, n);
+
+    /* Send every command before reading any output */
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        fprintf(to_shell, "/bin/echo %d\n", i);
+    }
+    fflush(to_shell);
+    sprintf(marker, "%d\n", n - 1);
+    expect(marker, line, sizeof(line));
+    printf("%-24s %8.0f cmds/s\n", "launch throughput", n / (now() - start));
+    free(times);
+}
+
+/* bench_jobs - Time starting background jobs as the job table grows, and listing them */
+void bench_jobs(int n) {
+    char line[256];
+    double *times = malloc(n * sizeof(double));
+    pid_t *pids = malloc(n * sizeof(pid_t));
+
+    for (int i = 0; i < n; i++) {
+        double start = now();
+        send("/bin/sleep 600 &\n");
+        expect("", line, sizeof(line)); /* the shell prints "pid cmdline" */
+        times[i] = now() - start;
+        pids[i] = atoi(line);
+    }
+    report("background launch", times, n);
+
+    double start = now();
+    send("jobs\n/bin/echo jobs-done\n");
+    expect("jobs-done", line, sizeof(line));
+    printf("%-24s %8.3fms  (%d jobs)\n", "jobs listing", 1e3 * (now() - start), n);
+
+    /* Each job is in its own process group */
+    for (int i = 0; i < n; i++) {
+        if (pids[i] > 0) {
+            kill(-pids[i], SIGKILL);
+        }
+    }
+    free(times);
+    free(pids);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 5 || strcmp(argv[3], "--") != 0 || atoi(argv[2]) < 1) {
+        die("usage: driver launch|jobs N -- tsh args...");
+    }
+    int n = atoi(argv[2]);
+
+    start_shell(argv + 4);
+    if (strcmp(argv[1], "launch") == 0) {
+        bench_launch(n);
+    } else if (strcmp(argv[1], "jobs") == 0) {
+        bench_jobs(n);
+    } else {
+        die("unknown benchmark");
+    }
+    stop_shell();
+    exit(0);
+}
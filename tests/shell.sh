@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# shell.sh - Check what the shell prints for a set of command lines (run by make test)
+#
+# Each case is one or more lines given to the shell, the output it must
+# print and optionally more flags for the shell. The pid at the start of
+# the line printed for a background job is replaced with <pid>.
+# The shell runs in a fresh copy of etc/, home/ and proc/ under a
+# temporary directory, so the cases do not depend on the checkout.
+#
+set -eu
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BOX=$(mktemp -d "${TMPDIR:-/tmp}/tsh-test.XXXXXX")
+trap 'rm -rf "$BOX"' EXIT
+
+gcc -std=gnu11 -o "$BOX/tsh" "$SRC/tsh.c"
+cd "$BOX"
+mkdir -p etc home/root proc
+echo "root:test:home/root" > etc/passwd
+touch home/root/.tsh_history
+export TSH_AUTH=root:test
+
+failed=0
+
+# check - Run the lines in $1 (with the flags in $3) and compare what they print with $2
+check() {
+    local got
+    got=$(printf '%s\n' "$1" | ./tsh -p ${3:-} 2>&1 | sed -E 's/^[0-9]+ (.* &)$/<pid> \1/')
+    if [ "$got" != "$2" ]; then
+        printf 'FAIL: %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$got"
+        failed=1
+    fi
+}
+
+check 'printf "<%s>" "" $HOME' "<></root>"
+check "printf \"<%s>\" '' x" "<><x>"
+check 'E=; printf "<%s>" $E x' "<x>"
+check 'V=A=1
+$V' "A=1: Command not found."
+check 'PATH=/nonexistent ls' "ls: Command not found."
+check 'X="a b" env | grep ^X=' "X=a b"
+
+# Pipelines and redirections
+check '/bin/echo a b c | wc -w' "3"
+check '/bin/echo b a | tr " " "\n" | sort | head -n 1' "a"
+check 'echo a | wc -c' "2"
+check 'jobs | wc -c' "jobs: Built-in commands cannot be part of a pipeline."
+check '/bin/echo hi > out
+echo more >> out
+cat < out' "hi
+more"
+check 'ls /nonexistent 2> err
+wc -l < err' "1"
+check 'ls /nonexistent 2>&1 | wc -l' "1"
+check 'cat < /nonexistent' "cat: Could not redirect: No such file or directory"
+
+# Lists and $?
+check 'false; echo $?' "1"
+check 'sh -c "exit 3"; echo $?' "3"
+check 'true && echo yes || echo no' "yes"
+check 'false && echo yes || echo no' "no"
+check 'nonexistent; echo $?' "nonexistent: Command not found.
+127"
+check '/nonexistent || echo $?' "/nonexistent: Command not found.
+127" -f
+check 'touch plain
+./plain; echo $?' "./plain: Command not found.
+126" -f
+
+# parallel
+check 'parallel -j 1 /bin/echo x{} ::: a b c' "xa
+xb
+xc"
+check 'parallel -j 1 /bin/false ::: a b; echo $?' "parallel: 2 of 2 commands failed.
+1"
+check "parallel /bin/echo$(printf ' w%.0s' $(seq 126)) ::: a" "parallel: Command too long."
+
+# wait
+check 'sh -c "exit 3" &
+wait %1; echo $?' '<pid> sh -c "exit 3" &
+3'
+check 'sh -c "sleep 0.2; exit 4" &
+sh -c "exit 5" &
+wait -n; echo $?
+wait -n; echo $?
+wait -n; echo $?' '<pid> sh -c "sleep 0.2; exit 4" &
+<pid> sh -c "exit 5" &
+5
+4
+127'
+check 'wait %7; echo $?' "wait: %7: no such job
+127"
+
+# output and tail
+check 'CAPTURE=1
+sh -c "echo one; echo two; echo three >&2" &
+wait
+output %1
+tail -n 1 %1
+tail %1' '<pid> sh -c "echo one; echo two; echo three >&2" &
+one
+two
+three
+Usage: tail [-f] %jid
+one
+two
+three'
+check 'output %1' "output: %1: no such job"
+check '/bin/true &
+wait
+output %1' '<pid> /bin/true &
+output: %1: the output of this job was not captured'
+
+# Arguments too long for the fixed buffers
+check "output %$(printf '1%.0s' $(seq 3000))" "output: %$(printf '1%.0s' $(seq 99)): no such job"
+check "tail %$(printf '1%.0s' $(seq 3000))" "tail: %$(printf '1%.0s' $(seq 99)): no such job"
+check "wait %$(printf '1%.0s' $(seq 3000))" "wait: %$(printf '1%.0s' $(seq 99)): no such job"
+check "hash $(printf 'x%.0s' $(seq 3000))" "hash: $(printf 'x%.0s' $(seq 100)): not found"
+check "/bin$(printf '/%.0s' $(seq 3000))true && echo ok" "ok"
+
+if [ "$failed" -eq 0 ]; then
+    echo "All shell tests passed"
+fi
+exit "$failed"
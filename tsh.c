@@ -3,6 +3,7 @@
  * 
  * <Dhruv Srikanth dhruvsrikanth>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,19 +16,84 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <dirent.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024  /* max line size */
 #define MAXARGS     128  /* max args on a command line */
-#define MAXJOBS      16  /* max jobs at any point in time */
-#define MAXJID    1<<16  /* max job ID */
-#define MAXHISTORY  10   /* max history size */
+#define MAXREDIRS    16  /* max redirections on a command line */
+#define MAXUSERNAME 255  /* max length of a user name or password given to adduser */
+#define MINJOBS      16  /* initial capacity of the job table (it grows as needed) */
+#define MAXJID (1 << 16) /* max job ID */
+#define MAXHISTORY  10   /* default history size (set HISTSIZE to change it) */
+#define MINHISTBUF 4096  /* initial size of the history string arena */
+#define HISTFLUSH     1  /* default seconds between history file writes (set HISTFLUSH to change it) */
+#define MAXHISTFILE (1 << 20) /* history file size above which quit trims it (to half of it, or HISTFILESIZE lines) */
+#define MINGRAMS   4096  /* initial number of slots in the history search index */
+#define MINSTATS     64  /* initial number of buckets in the stat table */
+#define MINHASH      64  /* initial number of buckets in the command hash table */
+#define MINUSERS     64  /* initial number of buckets in the user table */
+#define MINVARS      64  /* initial number of buckets in the variable table */
+#define INPUTBUF  65536  /* size of the blocks input is read in */
+#define DIRCACHE     64  /* buckets in the directory cache (and listings kept between prompts) */
+#define MAXBRACE (1 << 20) /* max words a brace range like {1..10} expands to */
+#define PARSECACHE  256  /* lines kept in the parse cache (and buckets in it) */
+#define HISTSUB      16  /* buckets per power of two in a latency histogram (values about 6% apart) */
+#define NLIMITS       3  /* resource limits ulimit can put on the jobs */
+#define MAXDONE      64  /* finished background jobs whose status wait can still return */
+#define CAPTURESIZE 65536 /* bytes of output kept in memory for each captured job (CAPTURE) */
 #define MKDIR_MODE  0700 /* mkdir mode */
 #define EXIT_SUCCESS 0   /* exit success */
 #define EXIT_FAILURE 1   /* exit failure */
 #define LOGIN_SUCCESS 0  /* login success */
 #define LOGIN_FAILURE 1  /* login failure */
 
+/* Proc backends */
+#define PROC_FILES 0 /* write proc/PID/status files */
+#define PROC_NONE  1 /* keep the stat table in memory only */
+#define PROC_SHM   2 /* keep a table of stat structs in shared memory */
+#define MINSHM    64 /* initial number of records in the shared proc table */
+#define SHMRETRIES 1000 /* reads of a shared proc record before it is taken as left half written */
+#define SHM_MAGIC 0x70687374 /* marks a shared proc table ("tshp") */
+
+/* History file fsync policies (HISTFSYNC) */
+#define HISTFSYNC_NEVER 0 /* leave it to the kernel */
+#define HISTFSYNC_FLUSH 1 /* after every write */
+#define HISTFSYNC_EXIT  2 /* once, when the shell exits */
+
+/* How a command of a list is joined to the next one */
+#define LIST_END 0 /* it is the last command */
+#define LIST_SEQ 1 /* ; */
+#define LIST_BG  2 /* & */
+#define LIST_AND 3 /* && */
+#define LIST_OR  4 /* || */
+
+/* Stages of the shell timed by tracing (-T or TSH_TRACE) */
+#define TRACE_EVAL    0  /* a whole line, from reading it to the next prompt */
+#define TRACE_PARSE   1  /* parseline (or finding the line in the parse cache) */
+#define TRACE_EXPAND  2  /* expanding the words of a command */
+#define TRACE_BUILTIN 3  /* running a built-in command */
+#define TRACE_LAUNCH  4  /* starting one stage of a pipeline (posix_spawn or fork) */
+#define TRACE_WAIT    5  /* waitfg, from the launch until the job leaves the foreground */
+#define TRACE_WAKEUP  6  /* from a SIGCHLD arriving until the main loop handles it */
+#define TRACE_REAP    7  /* reap_children */
+#define TRACE_JOB     8  /* a job, from its launch until its last stage is reaped */
+#define TRACE_FLUSH   9  /* writing the dirty proc entries */
+#define TRACE_HISTORY 10 /* writing the buffered history */
+#define NTRACE        11
+
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
@@ -48,17 +114,55 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int use_fork = 0;           /* if true, launch commands with fork() instead of posix_spawn() */
+int proc_mode = PROC_FILES; /* where the stat table is written to */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+char pipe_token[] = "|";    /* marks the end of a pipeline stage in argv */
+char redir_token[] = "<>";  /* comes before the operator and file of a redirection in argv */
+char semi_token[] = ";";    /* ends a command of a list that runs in the foreground */
+char bg_token[] = "&";      /* ends a command of a list that runs in the background */
+char and_token[] = "&&";    /* ends a command of a list whose next command runs if it succeeds */
+char or_token[] = "||";     /* ends a command of a list whose next command runs if it fails */
 char *username;             /* The name of the user currently logged into the shell */
 char *home;                 /* The home directory of the user currently logged into the shell */
+char shell_dir[PATH_MAX];   /* The directory the shell was started in, which holds etc/, home/ and proc/ */
+int last_status;            /* Exit status of the last command ($?) */
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    char *cmdline;          /* command line (owned by the job) */
+    pid_t *pids;            /* pid of each stage of the pipeline (0 once it has exited) */
+    int npids;              /* number of stages */
+    int nalive;             /* number of stages that have not exited */
+    int pids_cap;           /* number of slots in pids */
+    struct timespec start;  /* when the job was started (CLOCK_MONOTONIC) */
+    struct rusage usage;    /* resources used by the stages that have exited */
+    int status;             /* wait status of the last stage once it has exited */
+    bool timed;             /* print the resources used when the job finishes */
+    bool in_parallel;       /* started by the running parallel command */
+    char *cgroup;           /* path of the job's cgroup leaf (NULL if it has none) */
+    int client;             /* connection of the server request this job answers (-1 if none) */
+    struct capture_t *capture; /* the output kept by the shell (NULL if it is not captured) */
+    struct job_t *next;     /* next record on the free list */
+};
+struct pidslot_t {          /* An entry in the pid index of the job table */
+    pid_t pid;              /* pid of the job (0 if the slot is empty) */
+    struct job_t *job;      /* job with that pid */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct jobtable_t {             /* The job table */
+    int count;                  /* number of jobs in the table */
+    int npids;                  /* number of pids in the pid index */
+    struct job_t *fg;           /* the foreground job (NULL if there is none) */
+    int nbg;                    /* number of jobs in the BG state */
+    struct job_t **byjid;       /* jid -> job, indexed directly by jid */
+    int jid_cap;                /* number of slots in byjid */
+    struct pidslot_t *bypid;    /* pid -> job, open addressing with linear probing */
+    int pid_cap;                /* number of slots in bypid (always a power of 2) */
+    struct job_t *free;         /* job records that are not in use */
+};
+struct jobtable_t jobs;     /* The job list */
 
 struct stat_t {
     char name[MAXLINE];     /* name of the command */
@@ -68,12 +172,315 @@ struct stat_t {
     pid_t sid;              /* session id */
     char state[MAXLINE];    /* state of the process */
     char uname[MAXLINE];    /* user name */
+    struct timespec start;  /* when the process was started (CLOCK_REALTIME) */
+    struct rusage usage;    /* resources used, as of the last time it stopped */
+};
+struct proc_t {                 /* An entry in the stat table */
+    struct stat_t stat;         /* the details of the process */
+    bool live;                  /* false once the process is gone */
+    bool on_disk;               /* true once proc/PID/status (or a shared record) has been written */
+    int slot;                   /* record in the shared proc table (-P shm) */
+    int stat_fd;                /* /proc/<pid>/stat of the process while top samples it (-1 if not open) */
+    unsigned long ticks;        /* CPU time of the process at the last sample (clock ticks) */
+    bool sampled;               /* ticks is from a sample of this top, not from the start of the process */
+    bool dirty;                 /* true while the entry is on the dirty list */
+    struct proc_t *next;        /* next entry in the same bucket */
+    struct proc_t *next_dirty;  /* next entry on the dirty list */
+};
+struct stattable_t {            /* The stat table */
+    int count;                  /* number of entries */
+    struct proc_t **buckets;    /* pid -> entry, chained */
+    int nbuckets;               /* number of buckets (always a power of 2) */
+    struct proc_t *dirty;       /* entries whose proc/PID/status is out of date */
+};
+struct stattable_t stats;       /* The stat table */
+
+struct shmhead_t {              /* The header of a shared proc table */
+    unsigned int magic;         /* SHM_MAGIC */
+    unsigned int recsize;       /* size of a record, so readers can check the layout */
+    int capacity;               /* number of records after the header */
+    pid_t shell;                /* pid of the shell that writes the table */
+};
+struct shmrec_t {               /* A record of a shared proc table */
+    unsigned int seq;           /* odd while the record is being written */
+    struct stat_t stat;         /* the process (pid 0 if the record is free) */
+};
+struct shmtable_t {             /* The shared proc table this shell writes (-P shm) */
+    char name[32];              /* name of the shared memory object */
+    int fd;                     /* the shared memory object */
+    struct shmhead_t *head;     /* the mapping (the records follow the header) */
+    int used;                   /* records handed out so far */
+    int *free;                  /* records that were handed out and freed again */
+    int nfree;                  /* number of entries in free */
+};
+struct shmtable_t shmtable;     /* The shared proc table */
+
+struct hashent_t {              /* An entry in the command hash table */
+    char *name;                 /* command name as typed */
+    char *path;                 /* where the command was found in PATH */
+    int hits;                   /* number of times the entry was used */
+    struct hashent_t *next;     /* next entry in the same bucket */
+};
+struct cmdhash_t {              /* The command hash table */
+    int count;                  /* number of entries */
+    struct hashent_t **buckets; /* name -> entry, chained */
+    int nbuckets;               /* number of buckets (always a power of 2) */
+    char *path;                 /* value of PATH when the entries were found */
+    long hits;                  /* lookups answered from the table */
+    long misses;                /* lookups that had to search PATH */
+};
+struct cmdhash_t cmdhash;       /* The command hash table */
+
+struct var_t {                  /* A shell variable */
+    char *entry;                /* "name=value", as it is passed to commands */
+    size_t name_len;            /* length of the name (the value starts after the =) */
+    bool exported;              /* passed to commands in their environment */
+    struct var_t *next;         /* next variable in the same bucket */
+};
+struct vartable_t {             /* The shell variables, with the environment it was started with */
+    int count;                  /* number of variables */
+    struct var_t **buckets;     /* name -> variable, chained */
+    int nbuckets;               /* number of buckets (always a power of 2) */
+    char **envp;                /* the entries of the exported variables, NULL terminated */
+    int envc;                   /* number of entries in envp */
+    int env_cap;                /* slots in envp */
+    bool env_changed;           /* envp is out of date */
+};
+struct vartable_t vars;         /* The shell variables */
+
+struct histent_t {          /* An entry in the history ring */
+    size_t off;             /* offset of the command in the arena */
+    size_t len;             /* length of the command */
+};
+struct user_t {                 /* An entry in the user table */
+    char *name;                 /* user name */
+    char *password;             /* password */
+    char *home;                 /* user directory */
+    struct user_t *next;        /* next entry in the same bucket */
+};
+struct usertable_t {            /* The user table, built from etc/passwd */
+    int count;                  /* number of entries */
+    struct user_t **buckets;    /* name -> entry, chained */
+    int nbuckets;               /* number of buckets (always a power of 2) */
+    struct timespec mtime;      /* mtime of etc/passwd when the table was built */
+    off_t size;                 /* size of etc/passwd when the table was built */
+    ino_t ino;                  /* inode of etc/passwd when the table was built */
+};
+struct usertable_t users;       /* The user table */
+
+struct input_t {                /* A source of command lines */
+    int fd;                     /* file the lines are read from (-1 for a string) */
+    char *buf;                  /* data read but not used yet */
+    size_t off;                 /* start of the unused data in buf */
+    size_t len;                 /* end of the data in buf */
+    size_t cap;                 /* size of buf */
+    bool eof;                   /* true once fd has no more data */
+};
+struct input_t input;           /* Where command lines are read from */
+
+struct dirname_t {              /* An entry of a cached directory listing */
+    char *name;                 /* name of the entry */
+    unsigned char type;         /* d_type (DT_UNKNOWN if the file system does not say) */
+};
+struct dircache_t {             /* A cached directory listing */
+    char *path;                 /* directory that was read */
+    dev_t dev;                  /* device of the directory when it was read */
+    ino_t ino;                  /* inode of the directory when it was read */
+    struct timespec mtime;      /* mtime of the directory when it was read */
+    bool racy;                  /* changed too close to the read to trust mtime */
+    struct dirname_t *ents;     /* the entries (without . and ..) sorted by name */
+    int count;                  /* number of entries */
+    char *names;                /* holds the names of the entries */
+    struct dircache_t *next;    /* next listing in the same bucket */
+};
+struct dircachetable_t {        /* Directory listings read by globbing */
+    struct dircache_t *buckets[DIRCACHE]; /* path -> listing, chained */
+    int count;                  /* number of listings */
+};
+struct dircachetable_t dircache; /* The directory cache */
+
+struct redir_t {                /* A redirection of a command */
+    int fd;                     /* the fd that is redirected */
+    char *path;                 /* file to open (NULL for n>&m) */
+    int flags;                  /* open flags for path */
+    int from;                   /* fd to copy for n>&m */
+};
+
+struct cmdnode_t {              /* A command of a list */
+    char **argv;                /* its words, NULL terminated */
+    int op;                     /* LIST_END, LIST_SEQ, LIST_BG, LIST_AND or LIST_OR */
+};
+
+struct parsed_t {               /* A line in the parse cache */
+    char *line;                 /* the line */
+    size_t len;                 /* length of the line */
+    unsigned int hash;          /* str_hash of the line */
+    char **argv;                /* what parseline built, pointing into words (and at the tokens) */
+    int argc;                   /* entries in argv */
+    char *words;                /* the words parseline wrote */
+    char *quoted;               /* their quote mask */
+    int busy;                   /* evals running the line, which keep it from being evicted */
+    struct parsed_t *next;      /* next line in the same bucket */
+    struct parsed_t *newer;     /* next line used more recently */
+    struct parsed_t *older;     /* next line used less recently */
+};
+struct parsecache_t {           /* The parse cache */
+    struct parsed_t *buckets[PARSECACHE]; /* line -> parsed line, chained */
+    struct parsed_t *newest;    /* the line used most recently */
+    struct parsed_t *oldest;    /* the line used least recently, evicted first */
+    int count;                  /* number of lines */
+};
+struct parsecache_t parsecache; /* The parse cache */
+
+struct args_t {                 /* An argument list built by expansion */
+    char **argv;                /* the arguments (each one malloced), NULL terminated */
+    int argc;                   /* number of arguments */
+    int cap;                    /* slots in argv */
+    bool nomem;                 /* an allocation failed */
+    int assigns[MAXARGS];       /* number of VAR=value words typed before the command of each stage */
 };
 
-char history[MAXHISTORY][MAXLINE];  /* The history list */
+struct parallel_t {             /* The running parallel command */
+    bool active;                /* true while parallel is running */
+    bool interrupted;           /* ctrl-c was typed, so start no more commands */
+    int running;                /* commands started and not reaped yet */
+    int failed;                 /* commands that could not start or did not exit with 0 */
+};
+struct parallel_t parallel;     /* The running parallel command */
+
+struct sleep_t {                /* A built-in command waiting in the shell (sleep, top) */
+    bool active;                /* true while it is waiting */
+    bool interrupted;           /* ctrl-c was typed, so stop waiting */
+};
+struct sleep_t sleeping;        /* The built-in command that is waiting */
+
+struct capture_t {              /* The output of a background job kept by the shell (CAPTURE) */
+    int fd;                     /* read end of the job's output pipe (-1 once every writer has closed it) */
+    char *buf;                  /* ring of the last bytes of output */
+    size_t cap;                 /* size of buf (it grows up to CAPTURESIZE) */
+    size_t len;                 /* bytes in buf */
+    size_t start;               /* offset of the oldest byte in buf */
+    unsigned long long total;   /* bytes the job has printed */
+    int spill;                  /* unlinked file the bytes that leave the ring go to (-1 if none) */
+    bool spilling;              /* false once a write to the spill file has failed */
+    off_t spilled;              /* bytes in the spill file */
+    bool echo;                  /* the job is in the foreground, so new output is also copied to the terminal */
+    unsigned long long shown;   /* bytes of output already copied to the terminal */
+};
+int capture_epfd = -1;          /* epoll set of the pipes of the captured jobs (-1 until the first one) */
+
+struct done_t {                 /* A background job that has finished */
+    pid_t pid;                  /* pid of the job */
+    int jid;                    /* job ID it had */
+    int status;                 /* wait status of its last stage */
+    char *cmdline;              /* its command line */
+    bool waited;                /* its status has been returned by wait */
+    struct capture_t *capture;  /* its output (NULL if it was not captured) */
+};
+struct donequeue_t {            /* The background jobs that have finished, oldest first */
+    struct done_t ring[MAXDONE]; /* completion n is in ring[n % MAXDONE] */
+    unsigned long total;        /* completions so far */
+    unsigned long notified;     /* completions printed by notify_done so far */
+    int unwaited;               /* completions in the ring not returned by wait */
+};
+struct donequeue_t done;        /* The completion queue */
+
+struct limit_t {                /* A resource limit put on every job (ulimit) */
+    int resource;               /* the RLIMIT_ constant */
+    char option;                /* the option of ulimit that sets it */
+    const char *name;           /* what ulimit calls it */
+    rlim_t unit;                /* bytes (or seconds) in one unit of ulimit */
+    bool set;                   /* the jobs get this limit (otherwise they get the shell's own) */
+    rlim_t value;               /* the limit */
+};
+struct limit_t limits[NLIMITS] = { /* The resource limits of the jobs */
+    {RLIMIT_CPU, 't', "cpu time (seconds)", 1, false, 0},
+    {RLIMIT_AS, 'v', "virtual memory (kbytes)", 1024, false, 0},
+    {RLIMIT_NOFILE, 'n', "open files", 1, false, 0},
+};
+
+struct jobcgroup_t {            /* Where jobs are put in cgroup v2 */
+    char *parent;               /* the cgroup each job gets a leaf in (NULL if jobs stay in the shell's) */
+    char cpu_max[32];           /* written to the cpu.max of each leaf ("" to leave it alone) */
+    char memory_max[32];        /* written to the memory.max of each leaf ("" to leave it alone) */
+    int seq;                    /* number of the last leaf made */
+    int procs_fd;               /* cgroup.procs of the leaf of the job being launched (-1 if none) */
+};
+struct jobcgroup_t jobcgroup = {NULL, "", "", 0, -1}; /* Where jobs are put in cgroup v2 */
+
+struct server_t {               /* The session server (-S) */
+    int fd;                     /* the listening socket (-1 if the shell is not a server) */
+    char *path;                 /* where the socket is */
+    int saved[3];               /* the shell's own stdin, stdout and stderr */
+    int client;                 /* connection of the request being run (-1 if none) */
+    bool defer;                 /* the request is one command, so its job answers it when it ends */
+    bool subshell;              /* this process is a copy of the server running one request */
+};
+struct server_t server = {-1, NULL, {-1, -1, -1}, -1, false, false}; /* The session server */
+
+struct latency_t {              /* A latency histogram of one stage */
+    unsigned long count;        /* number of times recorded */
+    unsigned long long sum;     /* total of the times (ns) */
+    unsigned long long max;     /* longest time (ns) */
+    unsigned long buckets[64 * HISTSUB]; /* times counted by log-linear bucket (see latency_bucket) */
+};
+struct trace_t {                /* The tracer */
+    bool on;                    /* the stages are being timed */
+    pid_t pid;                  /* pid of the shell (the pid and thread of its events) */
+    FILE *events;               /* where the Chrome trace events go (NULL if nowhere) */
+    struct timespec epoch;      /* when tracing started (the 0 of the event times) */
+    struct latency_t stages[NTRACE]; /* histogram of each stage */
+};
+struct trace_t trace;           /* The tracer */
+const char *trace_names[NTRACE] = {"eval", "parse", "expand", "builtin", "launch", "wait", "wakeup", "reap", "job", "flush", "history"};
+struct timespec sigchld_at;     /* when the first SIGCHLD that has not been handled arrived (when tracing) */
+
+struct history_t {          /* The history list */
+    struct histent_t *ents; /* ring of entries, oldest at head */
+    int size;               /* maximum number of entries (HISTSIZE) */
+    int head;               /* slot of the oldest entry */
+    int count;              /* number of entries */
+    char *buf;              /* circular string arena holding the commands */
+    size_t buf_size;        /* size of the arena */
+    size_t tail;            /* offset in the arena where the next command goes */
+};
+struct history_t history;           /* The history list */
+struct histfile_t {         /* The writer for the history file */
+    char *path;             /* path of .tsh_history */
+    int fd;                 /* kept open with O_APPEND (-1 if it could not be opened) */
+    char *buf;              /* commands not written yet, one per line */
+    size_t len;             /* bytes in buf */
+    size_t cap;             /* size of buf */
+    int interval;           /* seconds buffered commands may wait (HISTFLUSH) */
+    time_t last_flush;      /* when buf was last written */
+    int fsync_mode;         /* HISTFSYNC_NEVER, HISTFSYNC_FLUSH or HISTFSYNC_EXIT */
+};
+struct histfile_t histfile;         /* The writer for the history file */
+struct posting_t {          /* The commands of the history a trigram appears in */
+    unsigned int gram;      /* the three bytes of the trigram (0 for an empty slot) */
+    int *lines;             /* the commands (indexes into histindex.lines) in increasing order */
+    int count;              /* number of commands */
+    int cap;                /* slots in lines */
+};
+struct histindex_t {        /* The search index of the whole history file */
+    bool built;             /* the history file has been read into the index */
+    char *text;             /* every command, each one ending with a \0 */
+    size_t len;             /* bytes used in text */
+    size_t cap;             /* size of text */
+    size_t *lines;          /* offset of each command in text, oldest first */
+    int nlines;             /* number of commands */
+    int lines_cap;          /* slots in lines */
+    struct posting_t *grams; /* trigram -> commands, open addressing with linear probing */
+    int ngrams;             /* number of trigrams */
+    int grams_cap;          /* slots in grams (always a power of 2) */
+};
+struct histindex_t histindex;       /* The history search index */
 volatile int session_id;            /* The session id of the shell */
-volatile sig_atomic_t pid_buf;      /* pid dummy variable that is signal safe */
-volatile sig_atomic_t fg_pid;       /* pid of the foreground process */
+int sig_pipe[2];                    /* self-pipe the signal handlers write to */
+volatile sig_atomic_t got_sigchld;  /* set by sigchld_handler */
+volatile sig_atomic_t got_sigint;   /* set by sigint_handler */
+volatile sig_atomic_t got_sigtstp;  /* set by sigtstp_handler */
+volatile sig_atomic_t got_sigio;    /* set by sigio_handler */
 /* End global variables */
 
 
@@ -83,66 +490,302 @@ volatile sig_atomic_t fg_pid;       /* pid of the foreground process */
 void usage(void);
 
 /* Here are the functions that you will implement */
+/* Input functions */
+void open_input(struct input_t *in, int fd);
+void string_input(struct input_t *in, char *str);
+char *read_line(struct input_t *in);
+bool input_pending(struct input_t *in);
+
 /* User authentication functions */
-char *login();
+char *login(struct input_t *in);
 void authenticate(const char *username, const char *password, bool *authenticated);
-void add_user(char *user_name, char *pwd);
+void do_adduser(char **argv);
+size_t add_user(char *user_name, char *pwd, FILE *passwd);
 bool user_exists(char *user_name);
 
+/* User table functions */
+void initusers(struct usertable_t *users);
+void clearusers(struct usertable_t *users);
+bool load_users(struct usertable_t *users);
+bool read_users(struct usertable_t *users, FILE *fp);
+struct user_t *find_user(struct usertable_t *users, const char *name);
+bool insert_user(struct usertable_t *users, const char *name, const char *password, const char *home);
+
 /* Exit functions */
 void quit(int sig);
 void logout(int sig);
 
 /* Command evaluation functions */
 void eval(char *cmdline);
-int parseline(const char *cmdline, char **argv); 
+void run_list(char *cmdline, char **argv, char *words, char *quoted);
+void eval_cmd(char *cmdline, char **argv, char *words, char *quoted, int bg);
+char *cmd_text(char **argv, int bg);
+void eval_argv(char *cmdline, char **argv, const int *typed_assigns, int bg);
+int parseline(const char *cmdline, char *words, char *quoted, char **argv); 
+int split_pipeline(char **argv, char ***stages);
+int split_redirs(char **argv, struct redir_t *redirs);
+bool redirect_shell(struct redir_t *redirs, int nredirs, int *saved);
+void restore_shell(struct redir_t *redirs, int nredirs, int *saved);
 int builtin_cmd(char **argv);
+bool external_builtin(char **argv);
 void exec_builtin(char **argv);
 
 
 /* Job helper functions */
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct jobtable_t *jobs);
+bool growjobs(struct jobtable_t *jobs, int npids);
+int maxjid(struct jobtable_t *jobs); 
+int addjob(struct jobtable_t *jobs, pid_t *pids, int npids, int state, char *cmdline);
+int deletejob(struct jobtable_t *jobs, pid_t pid); 
+void removejob(struct jobtable_t *jobs, struct job_t *job);
+int stage_exited(struct jobtable_t *jobs, struct job_t *job, pid_t pid);
+void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state);
+pid_t fgpid(struct jobtable_t *jobs);
+struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct jobtable_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
-bool are_open_jobs(struct job_t *jobs);
+void listjobs(struct jobtable_t *jobs, bool details);
+bool are_open_jobs(struct jobtable_t *jobs);
+static unsigned int pid_hash(pid_t pid, int cap);
+int pidslot_find(struct jobtable_t *jobs, pid_t pid);
+void pidslot_insert(struct jobtable_t *jobs, pid_t pid, struct job_t *job);
+void pidslot_remove(struct jobtable_t *jobs, int slot);
+
+/* Job completion functions */
+void queue_done(struct job_t *job);
+struct done_t *find_done(pid_t pid, int jid, bool waited);
+struct done_t *next_done(pid_t *pids, int npids);
+int take_done(struct done_t *d);
+void notify_done();
+void print_done(struct done_t *d);
+void do_wait(char **argv);
+bool job_target(const char *cmd, const char *arg, bool waited, pid_t *pid);
+
+/* Output capture functions */
+struct capture_t *open_capture(bool spill, int *out);
+void free_capture(struct capture_t *capture);
+void drain_captures();
+void drain_capture(struct capture_t *capture);
+void append_capture(struct capture_t *capture, const char *data, size_t len);
+void spill_capture(struct capture_t *capture, const char *data, size_t len);
+void print_capture(struct capture_t *capture, unsigned long long from);
+void echo_capture(struct capture_t *capture, bool on);
+struct capture_t *find_capture(pid_t pid);
+struct capture_t *capture_arg(const char *cmd, const char *arg, pid_t *pid);
+void do_output(char **argv);
+void do_tail(char **argv);
 
 /* History functions */
 void init_history();
-void show_history();
+void load_history();
+void reload_history();
+const char *history_tail(const char *data, size_t size, int n);
+void alloc_history(int size);
+bool grow_history(size_t need);
+void show_history(int n);
 int history_length();
+char *history_entry(int n);
 void add_to_history(char *cmd);
+void append_history(const char *cmd, size_t len);
 void write_to_history(char *cmd);
+void open_history_file();
+void flush_history_file();
+void lock_history_file();
+void idle_history_file();
+void close_history_file();
 void run_nth_history(char *cmd);
 void reset_history();
 
+/* History search functions */
+void do_history(char **argv);
+bool build_history_index();
+bool index_command(const char *cmd, size_t len);
+bool add_posting(unsigned int gram, int line);
+struct posting_t *find_posting(unsigned int gram);
+struct posting_t *rarest_posting(const char *text, size_t len, bool *absent);
+bool history_matches(int line, const char *text, size_t len, bool prefix);
+int find_history(const char *text, bool prefix, int before);
+void grep_history(const char *text);
+void run_history_search(char *cmd);
+
+/* Parse cache functions */
+struct parsed_t *find_parsed(const char *line, size_t len, unsigned int hash);
+void cache_parsed(const char *line, size_t len, unsigned int hash, char *words, char *quoted, char **argv);
+void unlink_parsed(struct parsed_t *parsed);
+
+/* Process launch functions */
+pid_t launch_cmd(char **argv, char **envp, const char *search, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask);
+pid_t spawn_cmd(char *path, char **argv, char **envp, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask);
+pid_t fork_cmd(char *path, char **argv, char **envp, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask);
+
+/* Job limit functions */
+void init_limits();
+bool jobs_confined();
+void confine_child();
+void do_ulimit(char **argv);
+bool parse_limit(struct limit_t *limit, const char *arg);
+void print_limit(struct limit_t *limit);
+void do_cgroup(char **argv);
+bool set_cgroup_parent(const char *dir);
+bool open_job_cgroup(char **cgroup);
+void close_job_cgroup(char *cgroup, bool keep);
+void remove_job_cgroup(char *cgroup);
+bool write_cgroup_file(const char *dir, const char *file, const char *value);
+
+/* Command hash functions */
+static unsigned int str_hash(const char *str);
+void initcmdhash(struct cmdhash_t *hash);
+void clearcmdhash(struct cmdhash_t *hash);
+struct hashent_t *find_hashed(struct cmdhash_t *hash, const char *name);
+char *search_path(const char *name, const char *dir);
+char *hash_cmd(struct cmdhash_t *hash, const char *name);
+void unhash_cmd(struct cmdhash_t *hash, const char *name);
+void do_hash(char **argv);
+
+/* Variable functions */
+void initvars(struct vartable_t *vars);
+struct var_t *find_var(struct vartable_t *vars, const char *name, size_t len);
+const char *get_var(const char *name);
+bool set_var(struct vartable_t *vars, const char *name, size_t len, const char *value, bool export);
+void unset_var(struct vartable_t *vars, const char *name);
+char **env_array(struct vartable_t *vars);
+size_t var_name_len(const char *str);
+size_t assignment_len(const char *word);
+char **cmd_env(char **assigns, int nassigns);
+void do_export(char **argv);
+void do_unset(char **argv);
+
+/* Expansion functions */
+bool needs_expansion(char **argv, char *words, char *quoted);
+bool expand_argv(char **argv, char *words, char *quoted, struct args_t *args);
+void add_arg(struct args_t *args, char *arg);
+void add_copy(struct args_t *args, const char *arg);
+void free_args(struct args_t *args);
+bool expand_vars(const char *word, const char *quoted, char **new_word, char **new_quoted);
+size_t var_ref(const char *word, const char *quoted, const char **value);
+void expand_braces(const char *word, const char *quoted, struct args_t *args);
+void brace_word(const char *word, const char *quoted, size_t open, const char *alt, const char *alt_quoted, size_t alt_len, size_t close, struct args_t *args);
+bool brace_range(const char *word, const char *quoted, size_t len, long *from, long *to);
+bool has_glob(const char *word, const char *quoted, size_t len);
+void glob_word(const char *word, const char *quoted, struct args_t *args);
+void glob_path(char *path, size_t plen, const char *pat, const char *quoted, struct args_t *args);
+bool glob_match(const char *pat, const char *quoted, size_t len, const char *name);
+size_t match_one(const char *pat, const char *quoted, size_t len, size_t i, char c);
+struct dircache_t *read_dir(const char *path);
+bool is_dir(struct dirname_t *ent, const char *path);
+int cmp_dirname(const void *a, const void *b);
+void trim_dircache();
+
+/* Parallel functions */
+void do_parallel(char **argv);
+bool launch_parallel(char **cmd, char *input);
+void interrupt_parallel();
+
+/* Tracing functions */
+void init_trace(const char *events_path);
+void close_trace();
+void trace_start(struct timespec *start);
+void trace_end(int stage, struct timespec *start);
+void trace_job(struct job_t *job);
+unsigned long long record_latency(int stage, struct timespec *start);
+void trace_event(const char *name, struct timespec *start, unsigned long long ns, pid_t tid, const char *cmd);
+static int latency_bucket(unsigned long long ns);
+unsigned long long latency_percentile(struct latency_t *lat, double p);
+char *format_ns(char *buf, unsigned long long ns);
+void print_trace();
+void do_stats(char **argv);
+
+/* Resource accounting functions */
+double elapsed_since(struct timespec *start);
+void add_usage(struct rusage *sum, struct rusage *usage);
+void print_usage(double real, struct rusage *usage);
+void time_builtin(char **argv);
+
+/* Simple built-in functions */
+void do_cd(char **argv);
+void do_pwd(char **argv);
+void do_echo(char **argv);
+void do_printf(char **argv);
+const char *print_escape(const char *c);
+void do_test(char **argv);
+int test_expr(char **args, int n);
+bool test_int(const char *str, long long *n);
+void do_sleep(char **argv);
+
+/* Process view functions */
+void do_ps(char **argv);
+void do_top(char **argv);
+void print_top(double interval);
+bool sample_proc(struct proc_t *proc, unsigned long *ticks, long *rss);
+void close_samples();
+
 /* State manipulation functions */
 void do_bgfg(char **argv);
-void waitfg(pid_t pid, sigset_t *prev_one);
+void waitfg(pid_t pgid);
 int bg_to_state(int bg);
 
 /* Stat functions */
 void shell_stat(struct stat_t *stat);
-void get_stat(struct stat_t *stat, pid_t pid, char *cmd, int process_state); 
+void get_stat(struct stat_t *stat, pid_t pid, pid_t pgid, char *cmd, int process_state); 
 void determine_stat_state(struct stat_t *stat, int process_state);
 
+/* Stat table functions */
+void initstats(struct stattable_t *stats);
+struct proc_t *find_stat(struct stattable_t *stats, pid_t pid);
+void add_stat(struct stattable_t *stats, struct stat_t *stat);
+void edit_stat(struct stattable_t *stats, pid_t pid, char *new_state);
+void edit_stat_usage(struct stattable_t *stats, pid_t pid, struct rusage *usage);
+void remove_stat(struct stattable_t *stats, pid_t pid);
+void edit_job_stats(struct stattable_t *stats, struct job_t *job, char *new_state);
+void remove_job_stats(struct stattable_t *stats, struct job_t *job);
+void mark_dirty(struct stattable_t *stats, struct proc_t *proc);
+void flush_stats(struct stattable_t *stats);
+
 /* Proc functions */
 void create_proc_entry(struct stat_t *stat);
 void write_proc_entry(struct stat_t *stat);
 void read_proc_entry(struct stat_t *stat, pid_t pid);
-void edit_proc_entry(pid_t pid, char *new_state);
 void remove_proc_entry(pid_t pid);
 void remove_proc_entries();
+void remove_stale_proc_entries();
+
+/* Shared proc table functions */
+void open_shm_table();
+void close_shm_table();
+struct shmrec_t *shm_record(struct shmhead_t *head, int slot);
+int shm_add(struct stat_t *stat);
+void shm_write(int slot, struct stat_t *stat);
+void shm_remove(int slot);
+bool shm_read(struct shmrec_t *rec, struct stat_t *stat);
+void ps_main(int argc, char **argv);
+void ps_table(pid_t shell);
+
+/* Server functions */
+void open_server(const char *path);
+void close_server();
+pid_t fork_request(char *cmdline);
+void serve_next();
+bool request_pending();
+void accept_request();
+bool recv_request(int fd, char *line, int *fds);
+void run_request(int fd, char *line, int *fds);
+void reply_request(int fd, int status);
+void client_main(int argc, char **argv);
+
+/* Event loop functions */
+void init_signal_pipe();
+void notify_signal(volatile sig_atomic_t *flag);
+void wait_for_input(struct input_t *in);
+void wait_for_signal();
+bool sleep_shell(struct timespec *start, double seconds);
+void handle_signals();
+void reap_children();
 
 /* Signal handler functions */
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
+void sigio_handler(int sig);
 void sigint_handler(int sig);
 void sigquit_handler(int sig);
 typedef void handler_t(int);
@@ -159,10 +802,12 @@ void app_error(char *msg);
 void reset_state_error(char *msg);
 void user_error(char *msg);
 void sigsafe_error(char *msg);
+int exit_status(int status);
 
 /* Additional helper functions */
 bool isnum(char *str);
-void strrevr(char *str, const int length);
+char *shell_file(char *path, const char *name);
+bool write_all(int fd, const char *buf, size_t len);
 
 /*****************
  * Main function
@@ -173,15 +818,30 @@ void strrevr(char *str, const int length);
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
     int emit_prompt = 1; /* emit prompt (default) */
+    int batch = 0;       /* running -c or a script, so output is only flushed when needed */
+    char *command = NULL; /* the commands given with -c */
+    char *socket_path = NULL; /* the socket given with -S */
+
+    /* Run as the tsh-ps reader of the shared proc tables */
+    const char *name = strrchr(argv[0], '/');
+    if (strcmp((name != NULL) ? name + 1 : argv[0], "tsh-ps") == 0) {
+        ps_main(argc, argv);
+    }
+
+    /* Send a command line to a server (before stderr is changed, so the command gets the real one) */
+    if (argc > 1 && strcmp(argv[1], "-C") == 0) {
+        client_main(argc, argv);
+    }
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    bool tracing = false; /* -T was given */
+    while ((c = getopt(argc, argv, "hvpfTP:c:S:")) != EOF) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -192,26 +852,97 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 'f':             /* launch commands with fork() */
+                use_fork = 1;
+                break;
+            case 'T':             /* time the stages of the shell */
+                tracing = true;
+                break;
+            case 'c':             /* run the given commands and exit */
+                command = optarg;
+                break;
+            case 'S':             /* serve requests on a socket */
+                socket_path = optarg;
+                break;
+            case 'P':             /* choose where proc entries are written */
+                if (strcmp(optarg, "files") == 0) {
+                    proc_mode = PROC_FILES;
+                } else if (strcmp(optarg, "none") == 0) {
+                    proc_mode = PROC_NONE;
+                } else if (strcmp(optarg, "shm") == 0) {
+                    proc_mode = PROC_SHM;
+                } else {
+                    usage();
+                }
+                break;
             default:
                 usage();
         }
     }
 
-    /* Install the signal handlers */
+    /* etc/, home/ and proc/ are under the directory the shell starts in */
+    if (getcwd(shell_dir, sizeof(shell_dir)) == NULL) {
+        unix_error("Could not get the current directory");
+    }
+
+    /* Read the commands from -c, a script file or stdin */
+    struct input_t terminal; /* for a login prompt without TSH_AUTH */
+    if (socket_path != NULL && (command != NULL || optind < argc)) {
+        usage();
+    }
+    if (command != NULL) {
+        string_input(&input, command);
+        batch = 1;
+    } else if (optind < argc) {
+        int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            sprintf(sbuf, "Could not open %.100s", argv[optind]);
+            unix_error(sbuf);
+        }
+        open_input(&input, fd);
+        batch = 1;
+    } else {
+        open_input(&input, STDIN_FILENO);
+    }
+    if (batch) {
+        emit_prompt = 0;
+        open_input(&terminal, STDIN_FILENO);
+        setvbuf(stdout, NULL, _IOFBF, INPUTBUF);
+    }
+
+    /* Install the signal handlers (they only write to the self-pipe) */
+    init_signal_pipe();
 
     /* These are the ones you will need to implement */
     Signal(SIGINT,  sigint_handler);   /* ctrl-c */
     Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
     Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    Signal(SIGIO,   sigio_handler);    /* Output from a captured job */
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* Initialize the variables, the job list, the stat table, the command hash table and the user table */
+    initvars(&vars);
+    initjobs(&jobs);
+    initstats(&stats);
+    initcmdhash(&cmdhash);
+    initusers(&users);
+    if (proc_mode == PROC_SHM) {
+        open_shm_table();
+    }
+
+    /* TSH_CGROUP, TSH_CPU_MAX and TSH_MEMORY_MAX put each job in a cgroup of its own */
+    init_limits();
+
+    /* TSH_TRACE also writes the trace events to the file it names */
+    const char *trace_path = get_var("TSH_TRACE");
+    if (tracing || (trace_path != NULL && *trace_path != '\0')) {
+        init_trace(trace_path);
+    }
 
     /* Have a user log into the shell */
-    username = login();
+    username = login(batch ? &terminal : &input);
 
     /* Initialize the history of commands used previously by the user */
     init_history();
@@ -219,11 +950,35 @@ int main(int argc, char **argv) {
     /* Create entry proc/PID/status for shell */
     struct stat_t stat;
     shell_stat(&stat);
-    create_proc_entry(&stat);
+    add_stat(&stats, &stat);
+
+    /* A server takes its command lines from the socket instead */
+    if (socket_path != NULL) {
+        open_server(socket_path);
+        emit_prompt = 0;
+    }
     
     /* Execute the shell's read/eval loop */
     bool just_logged_in = true;
     while (1) {
+        /* Write out the proc entries that changed since the last prompt */
+        flush_stats(&stats);
+
+        /* Write out the buffered history if no more input is waiting */
+        idle_history_file();
+
+        /* Keep the directory cache from growing without bound */
+        trim_dircache();
+
+        /* A server runs the next request instead of reading a line */
+        if (server.fd >= 0) {
+            serve_next();
+            continue;
+        }
+
+        /* Report the background jobs that have finished (NOTIFY) */
+        notify_done();
+
         /* Read command line */
         if (emit_prompt) {
             if (just_logged_in) {
@@ -234,19 +989,20 @@ int main(int argc, char **argv) {
             fflush(stdout);
         }
 
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && (ferror(stdin))) {
-            app_error("fgets error");
-        }
-        
-        if (feof(stdin)) { /* End of file (ctrl-d) */
-            fflush(stdout);
-            exit(0);
+        /* Handle signals while waiting for the next command */
+        wait_for_input(&input);
+        if ((cmdline = read_line(&input)) == NULL) { /* End of file (ctrl-d) */
+            quit(LOGIN_SUCCESS);
         }
 
         /* Evaluate the command line */
+        struct timespec start;
+        trace_start(&start);
         eval(cmdline);
-        fflush(stdout);
-        fflush(stdout);
+        trace_end(TRACE_EVAL, &start);
+        if (!batch) {
+            fflush(stdout);
+        }
     } 
 
     free(username);
@@ -260,6 +1016,113 @@ int main(int argc, char **argv) {
  * End of main function
  *****************/
 
+/*****************
+ * Input functions
+ *****************/
+
+/*
+ * Command lines are read with read() in blocks of INPUTBUF bytes and
+ * split at the newlines in the buffer, instead of going through stdio
+ * one line at a time. The login prompt reads from the same buffer, so
+ * the two never lose each other's input.
+ */
+
+/* open_input - Read lines from the file descriptor fd */
+void open_input(struct input_t *in, int fd) {
+    in->fd = fd;
+    in->off = 0;
+    in->len = 0;
+    in->cap = INPUTBUF;
+    in->eof = false;
+    if ((in->buf = malloc(in->cap)) == NULL) {
+        unix_error("Could not allocate the input buffer");
+    }
+}
+
+/* string_input - Read lines from the string str (used for -c) */
+void string_input(struct input_t *in, char *str) {
+    in->fd = -1;
+    in->buf = str;
+    in->off = 0;
+    in->len = strlen(str);
+    in->cap = in->len + 1; /* room for the null terminator of the last line */
+    in->eof = true;
+}
+
+/*
+ * read_line - Return the next line of input, NULL at the end of the input
+ *
+ * The line is left where it is in the input buffer with its newline
+ * replaced by a null terminator, so it is only valid until the next
+ * call. The buffer grows to hold a line of any length.
+ */
+char *read_line(struct input_t *in) {
+    char *nl;
+    while ((nl = memchr(in->buf + in->off, '\n', in->len - in->off)) == NULL) {
+        if (in->eof) {
+            if (in->off == in->len) {
+                return NULL;
+            }
+            /* The last line has no newline, so terminate it after its end */
+            nl = in->buf + in->len;
+            break;
+        }
+
+        /* Keep the start of the line and read another block after it */
+        if (in->off > 0) {
+            memmove(in->buf, in->buf + in->off, in->len - in->off);
+            in->len -= in->off;
+            in->off = 0;
+        } else if (in->len == in->cap) {
+            char *buf = realloc(in->buf, 2 * in->cap);
+            if (buf == NULL) {
+                unix_error("Could not grow the input buffer");
+            }
+            in->buf = buf;
+            in->cap *= 2;
+        }
+
+        ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            app_error("read error");
+        }
+        if (n == 0) {
+            in->eof = true;
+            if (in->len == in->cap) {
+                /* Make room for the null terminator of the last line */
+                char *buf = realloc(in->buf, in->cap + 1);
+                if (buf == NULL) {
+                    unix_error("Could not grow the input buffer");
+                }
+                in->buf = buf;
+                in->cap++;
+            }
+        }
+        in->len += n;
+    }
+
+    char *line = in->buf + in->off;
+    *nl = '\0';
+    in->off = (nl < in->buf + in->len) ? nl - in->buf + 1 : in->len;
+    return line;
+}
+
+/* input_pending - Check if another line can be read without waiting */
+bool input_pending(struct input_t *in) {
+    if (memchr(in->buf + in->off, '\n', in->len - in->off) != NULL || in->eof) {
+        return true;
+    }
+    struct pollfd pfd = {in->fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*****************
+ * End of input functions
+ *****************/
+
 /*****************
  * User authentication functions
  *****************/
@@ -271,22 +1134,46 @@ int main(int argc, char **argv) {
  *
  * This function returns a string of the username that is logged in
  */
-char *login() {
+char *login(struct input_t *in) {
 
     bool authenticated = false;
+
+    /* Scripts and cron jobs log in with TSH_AUTH=user:password instead of the prompt */
+    const char *auth = get_var("TSH_AUTH");
+    if (auth != NULL) {
+        const char *colon = strchr(auth, ':');
+        char *username = strndup(auth, (colon != NULL) ? colon - auth : strlen(auth));
+        authenticate(username, (colon != NULL) ? colon + 1 : "", &authenticated);
+        if (!authenticated) {
+            app_error("User Authentication failed for TSH_AUTH.");
+        }
+        return username;
+    }
+
+    char *line;
     while (1) {
         /* Get the user's details */ 
         printf("username: ");
+        fflush(stdout);
         char *username = malloc(sizeof(char) * MAXLINE);
-        scanf("%s", username);
+        username[0] = '\0';
+        if ((line = read_line(in)) == NULL) {
+            quit(LOGIN_FAILURE);
+        }
+        sscanf(line, "%1023s", username);
 
         if (strcmp(username, "quit") == 0) {
             quit(LOGIN_FAILURE);
         }
         
         printf("password: ");
+        fflush(stdout);
         char *password = malloc(sizeof(char) * MAXLINE);
-        scanf("%s", password);
+        password[0] = '\0';
+        if ((line = read_line(in)) == NULL) {
+            quit(LOGIN_FAILURE);
+        }
+        sscanf(line, "%1023s", password);
 
         /* Authenticate the validity of the user's entered details */
         authenticate(username, password, &authenticated);
@@ -307,132 +1194,293 @@ char *login() {
 
 /* Authentication function for verifying username and password in /etc/passwd */ 
 void authenticate(const char *username, const char *password, bool *authenticated) {
-    /* Open the file */
+    /* Make sure the user table matches etc/passwd */
+    if (!load_users(&users)) {
+        return;
+    }
+
+    struct user_t *user = find_user(&users, username);
+    if (user != NULL && strcmp(user->password, password) == 0) {
+        *authenticated = true;
+
+        /* Get the home directory of the shell for the user logged in */
+        home = strdup(user->home);
+    }
+}
+
+/*
+ * do_adduser - Execute the builtin adduser command
+ *
+ * Any number of user name and password pairs can be given. etc/passwd
+ * is opened once and every new user is appended to it in one go.
+ */
+void do_adduser(char **argv) {
+    /* Only allow the root user to add new users */
+    if (strcmp(username, "root") != 0) {
+        user_error("root privileges required to run adduser.");
+        return;
+    }
+
+    /* Write to etc/passwd file */
+    char passwd_path[PATH_MAX];
+    shell_file(passwd_path, "etc/passwd");
     FILE *fp;
-    fp = fopen("etc/passwd", "r");
-    if (fp == NULL) {
+    fp = fopen(passwd_path, "a+");
+    if (fp == NULL || flock(fileno(fp), LOCK_EX) < 0) {
         reset_state_error("Could not open etc/passwd file.");
-        fclose(fp);
+        if (fp != NULL) {
+            fclose(fp);
+        }
         return;
     }
 
-    /* Read the file one line at a time comparing username and password */
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+    /*
+     * Make sure the user table matches etc/passwd. Other sessions wait
+     * for the lock (released by fclose) before adding users, so the
+     * checks for existing users also see the ones they have added.
+     */
+    if (!read_users(&users, fp) || fseek(fp, 0, SEEK_END) < 0) {
+        fclose(fp);
+        return;
+    }
 
-    while ((read = getline(&line, &len, fp)) != -1) {
-        char *token = strtok(line, ":");
-        if (strcmp(token, username) == 0) {
-            token = strtok(NULL, ":");
-            if (strcmp(token, password) == 0) {
-                *authenticated = true;
-
-                token = strtok(NULL, ":");
-                /* Get the home directory of the shell for the user logged in */
-                home = malloc(sizeof(char) * (strlen(token) + 1));
-                /* Remove newline character at the end */
-                token[strlen(token) - 1] = '\0';
-                strcpy(home, token);
-                break;
-            }
+    size_t written = 0;
+    int i = 1;
+    do {
+        written += add_user(argv[i], (argv[i] != NULL) ? argv[i + 1] : NULL, fp);
+        if (argv[i] == NULL || argv[i + 1] == NULL) {
+            break;
         }
+        i += 2;
+    } while (argv[i] != NULL);
+
+    if (fclose(fp) != 0) {
+        reset_state_error("Could not write to etc/passwd file.");
     }
 
-    /* Free memory not used after this */
-    free(line);
-    fclose(fp);
+    /*
+     * The new users are already in the table. If nobody else wrote to
+     * etc/passwd in the meantime, the table is still up to date.
+     */
+    struct stat sb;
+    if (stat(passwd_path, &sb) == 0 && sb.st_ino == users.ino && sb.st_size == users.size + (off_t) written) {
+        users.mtime = sb.st_mtim;
+        users.size = sb.st_size;
+    }
 }
 
-/* add_user - Add user to the system */
-void add_user(char *user_name, char *pwd) {
+/* add_user - Add user to the system, returns the number of bytes added to etc/passwd */
+size_t add_user(char *user_name, char *pwd, FILE *passwd) {
     /* Check if username and password are valid */
     if (user_name == NULL || pwd == NULL || strlen(user_name) == 0 || strlen(pwd) == 0) {
-        sprintf(sbuf, "Invalid username (%s) or password(%s) provided.", user_name, pwd);
+        sprintf(sbuf, "Invalid username (%.100s) or password(%.100s) provided.", user_name, pwd);
         user_error(sbuf);
-        return;
+        return 0;
     }
 
-    /* Only allow the root user to add new users */
-    if (strcmp(username, "root") != 0) {
-        user_error("root privileges required to run adduser.");
-        return;
+    /* The name ends up in paths and both end up in fixed-size proc entries */
+    if (strlen(user_name) > MAXUSERNAME || strlen(pwd) > MAXUSERNAME) {
+        sprintf(sbuf, "Username (%.100s) or password too long.", user_name);
+        user_error(sbuf);
+        return 0;
     }
 
     /* Check if user already exists */
-    if (user_exists(user_name)) {
-        sprintf(sbuf, "User %s may already exist.", user_name);
+    if (find_user(&users, user_name) != NULL) {
+        sprintf(sbuf, "User %.100s may already exist.", user_name);
         user_error(sbuf);
-        return;
+        return 0;
     }
 
 
     /* Create new user directory */
+    char path[PATH_MAX];
     sprintf(sbuf, "home/%s", user_name);
-    if (mkdir(sbuf, MKDIR_MODE) == -1) {
+    if (mkdir(shell_file(path, sbuf), MKDIR_MODE) == -1) {
         reset_state_error("Could not create user directory.");
     }
 
     /* Create .tsh_history file */
     sprintf(sbuf, "home/%s/.tsh_history", user_name);
     FILE *fp;
-    fp = fopen(sbuf, "w");
+    fp = fopen(shell_file(path, sbuf), "w");
     if (fp == NULL) {
         reset_state_error("Could not create .tsh_history file.");
+    } else {
+        fclose(fp);
     }
-    fclose(fp);
 
     
     /* Write to etc/passwd file */
-    fp = fopen("etc/passwd", "a");
-    if (fp == NULL) {
-        reset_state_error("Could not open etc/passwd file.");
-        fclose(fp);
-        return;
-    }
-
     sprintf(sbuf, "home/%s", user_name);
-    const size_t written = fprintf(fp, "%s:%s:%s\n", user_name, pwd, sbuf);
+    const size_t written = fprintf(passwd, "%s:%s:%s\n", user_name, pwd, sbuf);
     if (written != strlen(user_name) + strlen(pwd) + strlen(sbuf) + 3) {
         reset_state_error("Could not write to etc/passwd file.");
+        return 0;
     }
 
-
-    fclose(fp);
+    insert_user(&users, user_name, pwd, sbuf);
+    return written;
 }
 
 /* user_exitsts - check if a user exists in etc/passwd */
 bool user_exists(char *user_name) {
+    return load_users(&users) && find_user(&users, user_name) != NULL;
+}
+
+/*****************
+ * End of user authentication functions
+ *****************/
+
+/*****************
+ * User table functions
+ *****************/
+
+/*
+ * The user table is a hash table from user name to the fields of its
+ * line in etc/passwd. It is built the first time it is needed and only
+ * rebuilt when the mtime, size or inode of etc/passwd changes, so a
+ * login or a check for an existing user does not read the file again.
+ */
+
+/* initusers - Initialize the user table */
+void initusers(struct usertable_t *users) {
+    users->count = 0;
+    users->size = -1; /* never matches, so the first lookup loads the table */
+    users->ino = 0;
+    users->nbuckets = MINUSERS;
+    users->buckets = calloc(users->nbuckets, sizeof(struct user_t *));
+    if (users->buckets == NULL) {
+        unix_error("Could not allocate the user table");
+    }
+}
+
+/* clearusers - Remove every entry from the user table */
+void clearusers(struct usertable_t *users) {
+    for (int i = 0; i < users->nbuckets; i++) {
+        while (users->buckets[i] != NULL) {
+            struct user_t *user = users->buckets[i];
+            users->buckets[i] = user->next;
+            free(user->name);
+            free(user);
+        }
+    }
+    users->count = 0;
+}
+
+/* load_users - Rebuild the user table if etc/passwd has changed, false if it cannot be read */
+bool load_users(struct usertable_t *users) {
     /* Open the file */
+    char path[PATH_MAX];
     FILE *fp;
-    fp = fopen("etc/passwd", "r");
-    if (fp == NULL) {
+    fp = fopen(shell_file(path, "etc/passwd"), "r");
+    if (fp == NULL || flock(fileno(fp), LOCK_SH) < 0) {
+        reset_state_error("Could not open etc/passwd file.");
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+
+    const bool ok = read_users(users, fp);
+    fclose(fp);
+    return ok;
+}
+
+/* read_users - Rebuild the user table from an open (and locked) etc/passwd if it has changed */
+bool read_users(struct usertable_t *users, FILE *fp) {
+    struct stat sb;
+    if (fstat(fileno(fp), &sb) < 0) {
         reset_state_error("Could not open etc/passwd file.");
-        fclose(fp);
         return false;
     }
 
-    /* Read the file one line at a time comparing username */
+    if (sb.st_size == users->size && sb.st_ino == users->ino
+        && sb.st_mtim.tv_sec == users->mtime.tv_sec && sb.st_mtim.tv_nsec == users->mtime.tv_nsec) {
+        return true;
+    }
+
+    /* Read the file one line at a time adding each user */
+    clearusers(users);
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
     while ((read = getline(&line, &len, fp)) != -1) {
-        char *token = strtok(line, ":");
-        if (strcmp(token, user_name) == 0) {
-            free(line);
-            fclose(fp);
-            return true;
+        if (line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+        char *name = strtok(line, ":");
+        char *password = strtok(NULL, ":");
+        char *dir = strtok(NULL, ":");
+        if (name != NULL && password != NULL && dir != NULL && find_user(users, name) == NULL) {
+            insert_user(users, name, password, dir);
         }
     }
 
     /* Free memory not used after this */
     free(line);
-    fclose(fp);
-    return false;
+
+    users->mtime = sb.st_mtim;
+    users->size = sb.st_size;
+    users->ino = sb.st_ino;
+    return true;
+}
+
+/* find_user - Find the entry of a user in the user table, NULL if there is none */
+struct user_t *find_user(struct usertable_t *users, const char *name) {
+    struct user_t *user = users->buckets[str_hash(name) & (users->nbuckets - 1)];
+    while (user != NULL && strcmp(user->name, name) != 0) {
+        user = user->next;
+    }
+    return user;
+}
+
+/* insert_user - Add a user to the user table */
+bool insert_user(struct usertable_t *users, const char *name, const char *password, const char *home) {
+    /* Keep the chains short */
+    if (users->count >= users->nbuckets) {
+        int nbuckets = 2 * users->nbuckets;
+        struct user_t **buckets = calloc(nbuckets, sizeof(struct user_t *));
+        if (buckets != NULL) {
+            for (int i = 0; i < users->nbuckets; i++) {
+                while (users->buckets[i] != NULL) {
+                    struct user_t *u = users->buckets[i];
+                    users->buckets[i] = u->next;
+                    unsigned int b = str_hash(u->name) & (nbuckets - 1);
+                    u->next = buckets[b];
+                    buckets[b] = u;
+                }
+            }
+            free(users->buckets);
+            users->buckets = buckets;
+            users->nbuckets = nbuckets;
+        }
+    }
+
+    /* The three fields share one allocation */
+    const size_t name_len = strlen(name) + 1;
+    const size_t password_len = strlen(password) + 1;
+    struct user_t *user = malloc(sizeof(struct user_t));
+    char *fields = malloc(name_len + password_len + strlen(home) + 1);
+    if (user == NULL || fields == NULL) {
+        free(user);
+        free(fields);
+        reset_state_error("Could not allocate user table entry.");
+        return false;
+    }
+    user->name = strcpy(fields, name);
+    user->password = strcpy(fields + name_len, password);
+    user->home = strcpy(fields + name_len + password_len, home);
+
+    unsigned int b = str_hash(name) & (users->nbuckets - 1);
+    user->next = users->buckets[b];
+    users->buckets[b] = user;
+    users->count++;
+    return true;
 }
 
 /*****************
- * End of user authentication functions
+ * End of user table functions
  *****************/
 
 /*****************
@@ -442,12 +1490,27 @@ bool user_exists(char *user_name) {
 /* quit - Quit the shell */
 void quit(int sig) {
     if (sig == LOGIN_SUCCESS) {
-        /* Reset the history */
-        reset_history();
+        /* Write out the buffered history and trim the file if it has grown too big */
+        close_history_file();
+        struct stat sb;
+        if (stat(histfile.path, &sb) == 0 && sb.st_size > MAXHISTFILE) {
+            reset_history();
+        }
     }
 
-    /* Remove all proc entries */
-    remove_proc_entries();
+    /* Print the latency histograms and finish the trace events */
+    close_trace();
+
+    /* Stop taking requests */
+    close_server();
+
+    /* Remove the proc entries of this session and of sessions that are gone */
+    if (proc_mode == PROC_FILES) {
+        remove_proc_entries();
+        remove_stale_proc_entries();
+    } else if (proc_mode == PROC_SHM) {
+        close_shm_table();
+    }
 
     /* Free memory not used after this */
     free(home);
@@ -458,11 +1521,12 @@ void quit(int sig) {
 /* logout - Logout of the shell */
 void logout(int sig) {
     /* Check if any jobs are remaining */
-    if (are_open_jobs(jobs)) {
+    if (are_open_jobs(&jobs)) {
         user_error("There are suspended jobs.");
     } else {
         /* Remove session proc entry */
-        remove_proc_entry(session_id);
+        remove_stat(&stats, session_id);
+        flush_stats(&stats);
 
         quit(sig);
     }
@@ -480,83 +1544,456 @@ void logout(int sig) {
  * eval - Evaluate the command line that the user has just typed in
  * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
+ * then execute it immediately. Otherwise, spawn a child process (see
+ * launch_cmd) and run the job in the context of the child. If the job is running in
  * the foreground, wait for it to terminate and then return.  Note:
  * each child process must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
 */
 void eval(char *cmdline) {
-    char *argv[MAXARGS]; /* Argument list execve() */
-    char buf[MAXARGS];   /* Holds modified command line */
-    int bg;              /* Should the job run in bg or fg? */
-    pid_t pid;           /* Process id */
+    char *argv_buf[MAXARGS];  /* Argument list of ordinary lines */
+    char words_buf[MAXLINE];  /* Holds the words of ordinary lines */
+    char quoted_buf[MAXLINE]; /* Which characters of the words were quoted */
+    struct timespec start;
+    trace_start(&start);
+    const size_t len = strlen(cmdline);
+    const unsigned int hash = str_hash(cmdline);
+
+    /*
+     * A line that was parsed before only needs its own copy of the argv
+     * (which running it changes); the words are shared with the cache.
+     * Otherwise each character of a line adds at most two entries to argv
+     * and two bytes to the words (a redirection adds its operator as a
+     * word of its own), so only very long lines use the heap.
+     */
+    struct parsed_t *parsed = find_parsed(cmdline, len, hash);
+    const size_t size = (parsed != NULL) ? (size_t) parsed->argc + 1 : 2 * len + 2;
+    char **argv = (size <= MAXARGS) ? argv_buf : malloc(size * sizeof(char *));
+    char *words = (parsed != NULL) ? parsed->words : (size <= MAXLINE) ? words_buf : malloc(size);
+    char *quoted = (parsed != NULL) ? parsed->quoted : (size <= MAXLINE) ? quoted_buf : malloc(size);
+
+    bool run = false; /* the line was parsed and is not empty */
+    if (argv == NULL || words == NULL || quoted == NULL) {
+        reset_state_error("Command line is too long.");
+    } else if (parsed != NULL) {
+        memcpy(argv, parsed->argv, size * sizeof(char *));
+        run = true;
+    } else if (parseline(cmdline, words, quoted, argv) < 0) {
+        user_error("Unmatched quote.");
+    } else if (argv[0] != NULL) { /* Ignore empty lines */
+        cache_parsed(cmdline, len, hash, words, quoted, argv);
+        run = true;
+    }
+    trace_end(TRACE_PARSE, &start);
 
-    /* Parse the command line */
-    strcpy(buf, cmdline);
-    bg = parseline(buf, argv);
+    if (run) {
+        if (parsed != NULL) {
+            parsed->busy++;
+        }
 
-    if (argv[0] == NULL) {
-        return;   /* Ignore empty lines */
+        /* Add command to history and .tsh_history */
+        write_to_history(cmdline);
+        run_list(cmdline, argv, words, quoted);
+        if (parsed != NULL) {
+            parsed->busy--;
+        }
     }
 
-    /* Signal handling */
-    sigset_t mask_all, prev_one, mask_one; /* Sets of signal sets */
-    sigfillset(&mask_all); /* Fill the mask with all signals */
-    sigemptyset(&mask_one); /* Empty the mask */
-    sigaddset(&mask_one, SIGCHLD); /* Add SIGCHLD to the mask */    
-
-    /* Add command to history and .tsh_history */
-    write_to_history(buf);
+    if (argv != argv_buf) {
+        free(argv);
+    }
+    if (parsed == NULL && words != words_buf) {
+        free(words);
+    }
+    if (parsed == NULL && quoted != quoted_buf) {
+        free(quoted);
+    }
+}
 
-    /* Fork child process as job if the command is not a built-in command */
-    if (!builtin_cmd(argv)) {
-        /* Block SIGCHLD */
-        sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+/*
+ * run_list - Run the commands of a line that are joined by ;, &, && and ||
+ *
+ * The separators parseline left in argv are replaced by NULL, which
+ * turns the line into a list of commands, each with the operator that
+ * joins it to the next one. The whole list is checked before anything
+ * runs. Each command is then expanded just before it runs, so it sees
+ * the variables and the directory the commands before it left behind.
+ * A command after && only runs if the status ($?) is 0 and one after
+ * || only if it is not, so a || b && c is (a || b) && c as in other
+ * shells. A command killed with ctrl-c ends the list.
+ */
+void run_list(char *cmdline, char **argv, char *words, char *quoted) {
+    struct cmdnode_t nodes_buf[MAXARGS]; /* The commands of ordinary lines */
+    int nnodes = 1;
+    for (int i = 0; argv[i] != NULL; i++) {
+        nnodes += (argv[i] == semi_token || argv[i] == bg_token || argv[i] == and_token || argv[i] == or_token);
+    }
+    struct cmdnode_t *nodes = (nnodes <= MAXARGS) ? nodes_buf : malloc(nnodes * sizeof(struct cmdnode_t));
+    if (nodes == NULL) {
+        reset_state_error("Command line is too long.");
+        return;
+    }
 
-        /* Fork the child */
-        if ((pid = fork()) == 0) {   /* Child runs user job */
-            /* Unblock SIGCHLD */
-            sigprocmask(SIG_SETMASK, &prev_one, NULL);
+    /* Build the list */
+    nnodes = 0;
+    nodes[0].argv = argv;
+    for (int i = 0; ; i++) {
+        const int op = (argv[i] == NULL) ? LIST_END : (argv[i] == semi_token) ? LIST_SEQ :
+            (argv[i] == bg_token) ? LIST_BG : (argv[i] == and_token) ? LIST_AND :
+            (argv[i] == or_token) ? LIST_OR : -1;
+        if (op < 0) {
+            continue;
+        }
 
-            /* Write to proc/PID/status */
-            struct stat_t stat;
-            get_stat(&stat, getpid(), argv[0], bg_to_state(bg));
-            create_proc_entry(&stat);
-            
-            /* Put the shell in another group  */
-            if (setpgid(0, 0) == -1) {
-                reset_state_error("Could not set process group ID.");
+        struct cmdnode_t *node = &nodes[nnodes];
+        const bool empty = (node->argv == &argv[i]);
+        if (empty && op != LIST_END) {
+            sprintf(sbuf, "Syntax error near %s", argv[i]);
+            user_error(sbuf);
+            goto done;
+        }
+        if (empty) {
+            /* Nothing after a final ; or & */
+            if (nnodes > 0 && (nodes[nnodes - 1].op == LIST_AND || nodes[nnodes - 1].op == LIST_OR)) {
+                sprintf(sbuf, "Syntax error near %s", (nodes[nnodes - 1].op == LIST_AND) ? and_token : or_token);
+                user_error(sbuf);
+                goto done;
             }
-            
-            if (!bg) {
-                fg_pid = 0;
+            break;
+        }
+        node->op = op;
+        nnodes++;
+        if (op == LIST_END) {
+            break;
+        }
+        argv[i] = NULL;
+        nodes[nnodes].argv = &argv[i + 1];
+    }
+
+    /* A server request that is a list (or parallel) could block, so it runs in a copy of the server */
+    if (server.client >= 0 && !server.subshell && (nnodes > 1 || strcmp(nodes[0].argv[0], "parallel") == 0)
+            && fork_request(cmdline) != 0) {
+        goto done;
+    }
+
+    /* Run it */
+    for (int i = 0; i < nnodes; i++) {
+        const int prev = (i > 0) ? nodes[i - 1].op : LIST_SEQ;
+        if ((prev == LIST_AND && last_status != 0) || (prev == LIST_OR && last_status == 0)) {
+            continue;
+        }
+
+        /* A command of a longer list is shown by jobs as its own words */
+        const int bg = (nodes[i].op == LIST_BG);
+
+        /* A server request that is one command is answered by its job, so the server does not wait for it */
+        server.defer = (server.client >= 0 && !server.subshell && nnodes == 1 && !bg);
+        char *text = (nnodes == 1) ? cmdline : cmd_text(nodes[i].argv, bg);
+        if (text == NULL) {
+            reset_state_error("Command line is too long.");
+            break;
+        }
+        eval_cmd(text, nodes[i].argv, words, quoted, bg);
+        if (text != cmdline) {
+            free(text);
+        }
+        if (last_status == 128 + SIGINT) {
+            break;
+        }
+    }
+
+done:
+    if (nodes != nodes_buf) {
+        free(nodes);
+    }
+}
+
+/* eval_cmd - Expand the words of one command of a list and run it */
+void eval_cmd(char *cmdline, char **argv, char *words, char *quoted, int bg) {
+    struct args_t args;
+    struct timespec start;
+    if (!needs_expansion(argv, words, quoted)) {
+        eval_argv(cmdline, argv, NULL, bg);
+        return;
+    }
+
+    trace_start(&start);
+    bool expanded = expand_argv(argv, words, quoted, &args);
+    trace_end(TRACE_EXPAND, &start);
+    if (expanded) {
+        eval_argv(cmdline, args.argv, args.assigns, bg);
+        free_args(&args);
+    } else {
+        reset_state_error("Could not expand the command line.");
+    }
+}
+
+/* cmd_text - Join the words of a command (as they were typed) into a malloced string */
+char *cmd_text(char **argv, int bg) {
+    size_t len = 3;
+    for (int i = 0; argv[i] != NULL; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    char *text = malloc(len);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    char *out = text;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i] == redir_token) {
+            continue; /* the operator that follows is shown instead */
+        }
+        if (out != text) {
+            *out++ = ' ';
+        }
+        out = stpcpy(out, argv[i]);
+    }
+    strcpy(out, bg ? " &" : "");
+    return text;
+}
+
+/*
+ * eval_argv - Run one command of a line once it has been split into words and expanded
+ *
+ * typed_assigns gives the number of VAR=value words that were typed
+ * before the command of each stage, so a word that only looks like an
+ * assignment after expansion is not taken as one. If it is NULL the
+ * words are as typed and the assignments are found from them.
+ */
+void eval_argv(char *cmdline, char **argv, const int *typed_assigns, int bg) {
+    char **stages[MAXARGS];  /* argv of each stage of the pipeline */
+    pid_t pids[MAXARGS];     /* pid of each stage that was started */
+    char *names[MAXARGS];    /* command of each stage that was started */
+    int nstages;             /* Number of stages in the pipeline */
+    int npids = 0;           /* Number of stages that were started */
+    pid_t pid;               /* Process id */
+    pid_t pgid = 0;          /* Process group of the job (pid of the first stage) */
+
+    /* The children start with no signals blocked */
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+
+    /* time runs the rest of the line and reports the resources it used */
+    bool timed = false;
+    if (strcmp(argv[0], "time") == 0) {
+        timed = true;
+        argv++;
+        if (argv[0] == NULL) {
+            user_error("time: missing command");
+            return;
+        }
+    }
+
+    /* Split the command line into the stages of a pipeline */
+    int npipes = 0;
+    int nredirs = 0;
+    for (int i = 0; argv[i] != NULL; i++) {
+        npipes += (argv[i] == pipe_token);
+        nredirs += (argv[i] == redir_token);
+    }
+    if (npipes >= MAXARGS) {
+        user_error("Too many commands in pipeline.");
+        return;
+    }
+    if (nredirs > MAXREDIRS) {
+        user_error("Too many redirections.");
+        return;
+    }
+    if ((nstages = split_pipeline(argv, stages)) < 0) {
+        user_error("Invalid null command in pipeline.");
+        return;
+    }
+
+    /* Take the redirections of each stage out of its argv */
+    struct redir_t redirs[MAXREDIRS];
+    int first_redir[MAXARGS + 1]; /* the redirections of stage i start at first_redir[i] */
+    first_redir[0] = 0;
+    for (int i = 0; i < nstages; i++) {
+        int n = split_redirs(stages[i], redirs + first_redir[i]);
+        if (n < 0) {
+            user_error("Invalid redirection.");
+            return;
+        }
+        first_redir[i + 1] = first_redir[i] + n;
+    }
+
+    /* Take the VAR=value words off the front of each stage */
+    char **assigns[MAXARGS];  /* the assignments of each stage */
+    int nassigns[MAXARGS];    /* number of assignments of each stage */
+    for (int i = 0; i < nstages; i++) {
+        assigns[i] = stages[i];
+        const int typed = (typed_assigns != NULL) ? typed_assigns[i] : INT_MAX;
+        for (nassigns[i] = 0; nassigns[i] < typed && stages[i][0] != NULL && assignment_len(stages[i][0]) > 0; nassigns[i]++) {
+            stages[i]++;
+        }
+        if (stages[i][0] == NULL && (nstages > 1 || nassigns[i] == 0)) {
+            user_error("Invalid null command.");
+            return;
+        }
+    }
+
+    /* sleep as a server request is run as a program, so it does not hold up the server */
+    const bool as_job = bg || (server.defer && strcmp(stages[0][0] != NULL ? stages[0][0] : "", "sleep") == 0);
+    if (nstages == 1 && (stages[0][0] == NULL || (builtin_cmd(stages[0]) && !(as_job && external_builtin(stages[0]))))) {
+        /* If the command is a built-in command, execute it immediately in the foreground */
+        int saved[MAXREDIRS];
+        if (!redirect_shell(redirs, first_redir[1], saved)) {
+            return;
+        }
+
+        /* Assignments on their own or before a built-in command set shell variables */
+        for (int k = 0; k < nassigns[0]; k++) {
+            size_t len = assignment_len(assigns[0][k]);
+            if (!set_var(&vars, assigns[0][k], len, assigns[0][k] + len + 1, false)) {
+                reset_state_error("Could not set variable.");
             }
+        }
 
-            /* Execute the command */
-            if (execve(argv[0], argv, environ) < 0) {
-                printf("%s: Command not found.\n", argv[0]);
-                exit(EXIT_SUCCESS);
+        last_status = 0; /* the commands that have a status of their own set it */
+        struct timespec start;
+        trace_start(&start);
+        if (stages[0][0] == NULL) {
+            /* Nothing to run */
+        } else if (timed) {
+            time_builtin(stages[0]);
+        } else {
+            exec_builtin(stages[0]);
+        }
+        trace_end(TRACE_BUILTIN, &start);
+        restore_shell(redirs, first_redir[1], saved);
+        return;
+    }
+    for (int i = 0; i < nstages; i++) {
+        if (builtin_cmd(stages[i]) && !external_builtin(stages[i])) {
+            sprintf(sbuf, "%.100s: Built-in commands cannot be part of a pipeline.", stages[i][0]);
+            user_error(sbuf);
+            return;
+        }
+    }
+
+    /* Write out what the shell has printed so far before the job starts printing */
+    fflush(stdout);
+
+    /* Run the job of a deferred server request in the background */
+    const bool deferred = server.defer;
+    server.defer = false;
+    if (deferred) {
+        bg = 1;
+    }
+
+    /* The output of a background job goes to a capture if CAPTURE is set */
+    struct capture_t *capture = NULL;
+    int job_out = STDOUT_FILENO;    /* stdout of the last stage */
+    int job_err = STDERR_FILENO;    /* stderr of every stage */
+    const char *capture_mode = get_var("CAPTURE");
+    if (bg && !deferred && capture_mode != NULL && *capture_mode != '\0') {
+        if ((capture = open_capture(strcmp(capture_mode, "spill") == 0, &job_out)) == NULL) {
+            return;
+        }
+        job_err = job_out;
+    }
+
+    /* The job gets a cgroup leaf of its own if jobs are put in cgroups */
+    char *cgroup;
+    if (!open_job_cgroup(&cgroup)) {
+        if (capture != NULL) {
+            close(job_out);
+            free_capture(capture);
+        }
+        return;
+    }
+
+    /*
+     * Children are only reaped by handle_signals in the main loop, so
+     * none of them can be reaped before the job has been added below.
+     */
+    /* Launch every stage in the process group of the first one, connected by pipes */
+    int in = STDIN_FILENO;
+    for (int i = 0; i < nstages; i++) {
+        int fds[2] = {-1, job_out};
+        if (i < nstages - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+            reset_state_error("Could not create pipe.");
+            break;
+        }
+
+        /* The environment is only copied for a stage that has assignments of its own */
+        char **envp = (nassigns[i] > 0) ? cmd_env(assigns[i], nassigns[i]) : env_array(&vars);
+        int nr = first_redir[i + 1] - first_redir[i];
+
+        /* PATH=dirs before a command is also where the command is looked for */
+        const char *search = NULL;
+        for (int k = 0; k < nassigns[i]; k++) {
+            if (strncmp(assigns[i][k], "PATH=", 5) == 0) {
+                search = assigns[i][k] + 5;
+            }
+        }
+        struct timespec start;
+        trace_start(&start);
+        if (envp == NULL) {
+            reset_state_error("Could not build the environment.");
+        } else if ((pid = launch_cmd(stages[i], envp, search, redirs + first_redir[i], nr, pgid, in, fds[1], job_err, &child_mask)) > 0) {
+            trace_end(TRACE_LAUNCH, &start);
+            names[npids] = stages[i][0];
+            pids[npids++] = pid;
+            if (pgid == 0) {
+                pgid = pid;
             }
         }
+        if (nassigns[i] > 0) {
+            free(envp);
+        }
 
-        /* Block all signals */
-        sigprocmask(SIG_BLOCK, &mask_all, NULL);
-        /* Add job */
-        addjob(jobs, pid, bg_to_state(bg), cmdline);
-        /* Unblock SIGCHLD */
-        sigprocmask(SIG_SETMASK, &prev_one, NULL);
+        /* The children hold their own copies of the pipe ends */
+        if (in != STDIN_FILENO) {
+            close(in);
+        }
+        if (fds[1] != STDOUT_FILENO && fds[1] != job_out) {
+            close(fds[1]);
+        }
+        in = fds[0];
+    }
+    if (in > STDIN_FILENO) {
+        close(in);
+    }
+    if (capture != NULL) {
+        close(job_out);
+    }
+    close_job_cgroup(cgroup, npids > 0);
 
-        /* Parent waits for foreground job to terminate */
-        if (!bg) {
-            waitfg(pid, &prev_one);
-        } else {
-            printf("%d %s", pid, cmdline);
+    if (npids == 0) {
+        free_capture(capture);
+        last_status = 127;
+        return;
+    }
+
+    /* Add job */
+    if (addjob(&jobs, pids, npids, bg_to_state(bg), cmdline)) {
+        getjobpid(&jobs, pgid)->timed = timed;
+        getjobpid(&jobs, pgid)->cgroup = cgroup;
+        getjobpid(&jobs, pgid)->capture = capture;
+        if (deferred) {
+            /* The job answers the request when it ends */
+            getjobpid(&jobs, pgid)->client = server.client;
+            server.client = -1;
         }
+    }
+    /* Add to the stat table (the parent does this so the children can exec right away) */
+    struct stat_t stat;
+    for (int i = 0; i < npids; i++) {
+        get_stat(&stat, pids[i], pgid, names[i], bg_to_state(bg));
+        add_stat(&stats, &stat);
+    }
+
+    /* Parent waits for foreground job to terminate (reap_children sets its status) */
+    if (!bg) {
+        waitfg(pgid);
     } else {
-        /* If the command is a built-in command, execute it immediately in the foreground */
-        exec_builtin(argv);
+        last_status = 0;
+        if (!deferred) {
+            printf("%d %s\n", pgid, cmdline);
+        }
     }
     return;
 }
@@ -564,60 +2001,236 @@ void eval(char *cmdline) {
 /* 
  * parseline - Parse the command line and build the argv array.
  * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+ * The line is read once and left as it is: each word is written to
+ * words, which needs room for strlen(cmdline) + 1 bytes, and argv points
+ * at them. quoted (the same size as words) is set to 1 for each
+ * character that was quoted or escaped, so expansion leaves them alone,
+ * and at the NUL that ends a word to 1 if any of it was quoted. Characters enclosed in single quotes are taken as they are.
+ * Within double quotes a backslash only escapes " \ $ and `, and an
+ * unescaped $ is left unquoted so variables are still expanded. Outside
+ * of quotes a backslash escapes any character. An unquoted | ends the
+ * current stage of a pipeline and is stored in argv as pipe_token, and
+ * the list separators ;, &, && and || are stored as semi_token,
+ * bg_token, and_token and or_token (see run_list). A redirection ([n]<,
+ * [n]>, [n]>> or [n]>&m) is stored as redir_token followed by the
+ * operator as a word of its own, and the file name is the next word.
+ * Return the number of entries in argv, or -1 if a quote is not closed.
  */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
+int parseline(const char *cmdline, char *words, char *quoted, char **argv) {
+    const char *c = cmdline;    /* ptr that traverses command line */
+    char *out = words;          /* where the next character of a word goes */
+    int argc = 0;               /* number of args */
+    bool was_quoted;            /* the word being read has a quote in it */
+
+    /* Build the argv list */
+    while (1) {
+        while (isspace((unsigned char) *c)) { /* ignore spaces */
+            c++;
+        }
+        if (*c == '\0') {
+            break;
+        }
+
+        /* Separators of lists and pipelines */
+        char *token = (c[0] == '|' && c[1] == '|') ? or_token : (c[0] == '&' && c[1] == '&') ? and_token :
+            (*c == '|') ? pipe_token : (*c == ';') ? semi_token : (*c == '&') ? bg_token : NULL;
+        if (token != NULL) {
+            argv[argc++] = token;
+            c += strlen(token);
+            continue;
+        }
+
+        const char *op = c; /* a redirection starts with an optional fd number */
+        while (isdigit((unsigned char) *op)) {
+            op++;
+        }
+        if (*op == '<' || *op == '>') {
+            argv[argc++] = redir_token;
+            argv[argc++] = out;
+            const char *end = op + 1;
+            if (*op == '>' && *end == '>') {
+                end++;
+            }
+            if (*end == '&' && isdigit((unsigned char) end[1])) {
+                for (end++; isdigit((unsigned char) *end); end++);
+            }
+            memcpy(out, c, end - c);
+            memset(quoted + (out - words), 0, end - c + 1);
+            out += end - c;
+            *out++ = '\0';
+            c = end;
+            continue;
+        }
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) { /* ignore leading spaces */
-        buf++;
+        argv[argc++] = out;
+        was_quoted = false;
+        while (*c != '\0' && strchr("|&;<>", *c) == NULL && !isspace((unsigned char) *c)) {
+            was_quoted |= (*c == '\'' || *c == '"' || *c == '\\');
+            if (*c == '\'') {
+                const char *end = strchr(c + 1, '\'');
+                if (end == NULL) { /* unterminated quote */
+                    return -1;
+                }
+                memcpy(out, c + 1, end - c - 1);
+                memset(quoted + (out - words), 1, end - c - 1);
+                out += end - c - 1;
+                c = end + 1;
+            } else if (*c == '"') {
+                for (c++; *c != '"'; c++) {
+                    if (*c == '\0') { /* unterminated quote */
+                        return -1;
+                    }
+                    bool escaped = (*c == '\\' && c[1] != '\0' && strchr("\"\\$`", c[1]) != NULL);
+                    if (escaped) {
+                        c++;
+                    }
+                    quoted[out - words] = (*c != '$' || escaped); /* a $ is still expanded */
+                    *out++ = *c;
+                }
+                c++;
+            } else if (*c == '\\' && c[1] != '\0') {
+                quoted[out - words] = 1;
+                *out++ = c[1];
+                c += 2;
+            } else {
+                quoted[out - words] = 0;
+                *out++ = *c++;
+            }
+        }
+        quoted[out - words] = was_quoted; /* so a quoted empty word ("") is kept by expansion */
+        *out++ = '\0';
     }
+    
+    argv[argc] = NULL;
+    return argc;
+}
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
-    } else {
-	    delim = strchr(buf, ' ');
+/*
+ * split_pipeline - Split the argv built by parseline at each pipe_token
+ *
+ * stages[i] is set to the argv of the i-th stage and the pipe tokens are
+ * replaced with NULL. Returns the number of stages, or -1 if a stage is empty.
+ */
+int split_pipeline(char **argv, char ***stages) {
+    int nstages = 0;
+    stages[nstages++] = argv;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i] == pipe_token) {
+            argv[i] = NULL;
+            if (stages[nstages - 1] == &argv[i]) {
+                return -1;
+            }
+            stages[nstages++] = &argv[i + 1];
+        }
+    }
+    if (stages[nstages - 1][0] == NULL) {
+        return -1;
     }
+    return nstages;
+}
+
+/*
+ * split_redirs - Take the redirections out of the argv of a stage
+ *
+ * The redirections are stored in redirs in the order they were typed.
+ * The other words are moved to the front by swapping, so the words of
+ * the redirections stay after the NULL that ends the new argv (and can
+ * still be freed by free_args). The NULL takes the place of one of the
+ * redir_tokens, which are not freed. Returns the number of
+ * redirections, or -1 if one is not valid.
+ */
+int split_redirs(char **argv, struct redir_t *redirs) {
+    int n = 0;
+    int argc = 0;
+    int i;
+    for (i = 0; argv[i] != NULL; i++) {
+        if (argv[i] != redir_token) {
+            char *word = argv[i];
+            argv[i] = argv[argc];
+            argv[argc++] = word;
+            continue;
+        }
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-	    while (*buf && (*buf == ' ')) { /* ignore spaces */
-	       buf++;
+        char *op = argv[++i];
+        struct redir_t *redir = &redirs[n++];
+        redir->fd = isdigit((unsigned char) op[0]) ? (int) strtol(op, &op, 10) : -1;
+        if (*op++ == '<') {
+            redir->flags = O_RDONLY;
+            redir->fd = (redir->fd < 0) ? STDIN_FILENO : redir->fd;
+        } else if (*op == '>') {
+            redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+            redir->fd = (redir->fd < 0) ? STDOUT_FILENO : redir->fd;
+            op++;
+        } else {
+            redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+            redir->fd = (redir->fd < 0) ? STDOUT_FILENO : redir->fd;
+        }
+        if (redir->fd > 9) {
+            return -1;
         }
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
+        if (*op == '&') {
+            redir->path = NULL;
+            redir->from = atoi(op + 1);
         } else {
-            delim = strchr(buf, ' ');
+            redir->path = argv[i + 1];
+            if (redir->path == NULL || redir->path == redir_token) {
+                return -1;
+            }
+            i++;
         }
     }
-    
-    argv[argc] = NULL;
-    
-    if (argc == 0) {  /* ignore blank line */
-        return 1;
+    for (int j = argc; j < i; j++) {
+        if (argv[j] == redir_token) {
+            argv[j] = argv[argc];
+            break;
+        }
     }
+    argv[argc] = NULL;
+    return n;
+}
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	    argv[--argc] = NULL;
+/*
+ * redirect_shell - Apply the redirections of a built-in command to the shell
+ *
+ * The fds that are replaced are saved in saved for restore_shell. If a
+ * file cannot be opened, the redirections done so far are undone and
+ * false is returned.
+ */
+bool redirect_shell(struct redir_t *redirs, int nredirs, int *saved) {
+    fflush(stdout);
+    for (int i = 0; i < nredirs; i++) {
+        struct redir_t *redir = &redirs[i];
+        saved[i] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10); /* -1 if fd was not open */
+
+        int fd = (redir->path != NULL) ? open(redir->path, redir->flags | O_CLOEXEC, 0666) : redir->from;
+        if (fd < 0 || dup2(fd, redir->fd) < 0) {
+            sprintf(sbuf, "%.100s: %s", (redir->path != NULL) ? redir->path : "redirection", strerror(errno));
+            if (fd >= 0 && redir->path != NULL) {
+                close(fd);
+            }
+            restore_shell(redirs, i + 1, saved);
+            user_error(sbuf);
+            return false;
+        }
+        if (redir->path != NULL) {
+            close(fd);
+        }
     }
+    return true;
+}
 
-    return bg;
+/* restore_shell - Put back the fds saved by redirect_shell, last one first */
+void restore_shell(struct redir_t *redirs, int nredirs, int *saved) {
+    fflush(stdout);
+    for (int i = nredirs - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], redirs[i].fd);
+            close(saved[i]);
+        } else {
+            close(redirs[i].fd);
+        }
+    }
 }
 
 /* 
@@ -626,16 +2239,30 @@ int parseline(const char *cmdline, char **argv) {
  */
 int builtin_cmd(char **argv) {
     /* Built-in commands */
-    const int n_builtins = 7;
-    const char *builtins[] = {"quit", "logout", "history", "bg", "fg", "jobs", "adduser"};
+    const int n_builtins = 27;
+    const char *builtins[] = {"quit", "logout", "history", "bg", "fg", "jobs", "adduser", "hash", "parallel", "ps", "top", "export", "unset",
+        "cd", "pwd", "echo", "printf", "test", "[", "true", "false", "sleep", "stats",
+        "ulimit", "cgroup", "wait", "output"};
     for (int i = 0; i < n_builtins; i++) {
         if (strcmp(argv[0], builtins[i]) == 0) {
             return 1;
         }
     }
     
-    /* Check for !N command */
-    if (argv[0][0] == '!') {
+    /* tail is only built in for the output of a job (tail [-f] %jid) */
+    if (strcmp(argv[0], "tail") == 0) {
+        int last = 0;
+        while (argv[last + 1] != NULL) {
+            last++;
+        }
+        return last > 0 && argv[last][0] == '%';
+    }
+
+    /* Check for !N, !prefix and !?text commands */
+    if (argv[0][0] == '!' && argv[0][1] != '\0') {
+        if (!isdigit((unsigned char) argv[0][1])) {
+            return 1;
+        }
         for (int i = 1; i < strlen(argv[0]); i++) {
             if (!isdigit(argv[0][i])) {
                 return 0;
@@ -647,26 +2274,90 @@ int builtin_cmd(char **argv) {
     return 0;     /* not a builtin command */
 }
 
+/*
+ * external_builtin - Check if a built-in command also exists as a program
+ *
+ * These run in the shell on their own, but in a pipeline or in the
+ * background the program is run instead, since a built-in command can
+ * be neither.
+ */
+bool external_builtin(char **argv) {
+    const int n_external = 7;
+    const char *external[] = {"echo", "printf", "test", "[", "true", "false", "sleep"};
+    for (int i = 0; i < n_external; i++) {
+        if (strcmp(argv[0], external[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* 
  * exec_builtin - Execute the built-in command
  */
 void exec_builtin(char **argv) {
-    if (strcmp(argv[0], "quit") == 0) {
+    if (server.client >= 0 && (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "logout") == 0 ||
+            (!server.subshell && (strcmp(argv[0], "wait") == 0 || strcmp(argv[0], "top") == 0)))) {
+        sprintf(sbuf, "%s: Not available to server requests.", argv[0]);
+        user_error(sbuf);
+    } else if (strcmp(argv[0], "quit") == 0) {
         quit(LOGIN_SUCCESS);
     } else if (strcmp(argv[0], "logout") == 0) {
         logout(LOGIN_SUCCESS);
     } else if (strcmp(argv[0], "history") == 0) {
-        show_history();
-    } else if (argv[0][0] == '!') {
+        do_history(argv);
+    } else if (argv[0][0] == '!' && isdigit((unsigned char) argv[0][1])) {
         run_nth_history(argv[0]);
+    } else if (argv[0][0] == '!') {
+        run_history_search(argv[0]);
     } else if (strcmp(argv[0], "bg") == 0) {
         do_bgfg(argv);
     } else if (strcmp(argv[0], "fg") == 0) {
         do_bgfg(argv);
     } else if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
+        listjobs(&jobs, argv[1] != NULL && strcmp(argv[1], "-l") == 0);
     } else if (strcmp(argv[0], "adduser") == 0) {
-        add_user(argv[1], argv[2]);
+        do_adduser(argv);
+    } else if (strcmp(argv[0], "hash") == 0) {
+        do_hash(argv);
+    } else if (strcmp(argv[0], "parallel") == 0) {
+        do_parallel(argv);
+    } else if (strcmp(argv[0], "ps") == 0) {
+        do_ps(argv);
+    } else if (strcmp(argv[0], "top") == 0) {
+        do_top(argv);
+    } else if (strcmp(argv[0], "export") == 0) {
+        do_export(argv);
+    } else if (strcmp(argv[0], "unset") == 0) {
+        do_unset(argv);
+    } else if (strcmp(argv[0], "cd") == 0) {
+        do_cd(argv);
+    } else if (strcmp(argv[0], "pwd") == 0) {
+        do_pwd(argv);
+    } else if (strcmp(argv[0], "echo") == 0) {
+        do_echo(argv);
+    } else if (strcmp(argv[0], "printf") == 0) {
+        do_printf(argv);
+    } else if (strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0) {
+        do_test(argv);
+    } else if (strcmp(argv[0], "true") == 0) {
+        last_status = 0;
+    } else if (strcmp(argv[0], "false") == 0) {
+        last_status = 1;
+    } else if (strcmp(argv[0], "sleep") == 0) {
+        do_sleep(argv);
+    } else if (strcmp(argv[0], "stats") == 0) {
+        do_stats(argv);
+    } else if (strcmp(argv[0], "ulimit") == 0) {
+        do_ulimit(argv);
+    } else if (strcmp(argv[0], "cgroup") == 0) {
+        do_cgroup(argv);
+    } else if (strcmp(argv[0], "wait") == 0) {
+        do_wait(argv);
+    } else if (strcmp(argv[0], "output") == 0) {
+        do_output(argv);
+    } else if (strcmp(argv[0], "tail") == 0) {
+        do_tail(argv);
     }
 }
 
@@ -675,766 +2366,5866 @@ void exec_builtin(char **argv) {
  * ****************/
 
 /*****************
- * State manipulation functions
+ * Parse cache functions
  * ****************/
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * The parse cache keeps what parseline built for the last PARSECACHE
+ * lines, so a line that is run again (a repeated line of a script, or
+ * !N) is not lexed or parsed again. Parsing only depends on the text of
+ * the line; everything that depends on the state of the shell
+ * (variables, the current directory, the files a word matches) is done
+ * by expansion as each command runs, from the words and quote mask
+ * kept here. The lines are kept on a list from the most to the least
+ * recently used, and the least recently used one that is not running
+ * is evicted to make room.
  */
-void do_bgfg(char **argv) {
-    int pid_or_jid = atoi(argv[1]);
-    struct job_t *job_to_modify; 
-    /* Determine whether it is a jid or pid */
-    /* Since the jid is limited to the size of the jobs list */
-    /* we check if there is a valid pid to jid conversion */
-    int jid = pid2jid(pid_or_jid);
-    if (jid == 0) {
-        /* It is a pid */
-        job_to_modify = getjobpid(jobs, pid_or_jid);
-    } else {
-        /* It is a jid */
-        job_to_modify = getjobjid(jobs, jid);
+
+/* find_parsed - Find a line in the parse cache and mark it as the most recently used, NULL if it is not there */
+struct parsed_t *find_parsed(const char *line, size_t len, unsigned int hash) {
+    struct parsed_t *parsed = parsecache.buckets[hash % PARSECACHE];
+    while (parsed != NULL && (parsed->hash != hash || parsed->len != len || memcmp(parsed->line, line, len) != 0)) {
+        parsed = parsed->next;
+    }
+    if (parsed == NULL || parsed == parsecache.newest) {
+        return parsed;
     }
-    pid_or_jid = (jid == 0) ? pid_or_jid : jid;
 
-    /* Check if the job exists */
-    if (job_to_modify == NULL) {
-        sprintf(sbuf, "Job (%%%d) does not exist.", pid_or_jid);
-        user_error(sbuf);
+    /* Move it to the front of the list */
+    unlink_parsed(parsed);
+    parsed->older = parsecache.newest;
+    parsed->newer = NULL;
+    parsecache.newest->newer = parsed;
+    parsecache.newest = parsed;
+    return parsed;
+}
+
+/*
+ * cache_parsed - Add a line parseline has just parsed to the parse cache
+ *
+ * The line, its argv, its words and their quote mask are copied into
+ * a single allocation, with the pointers into words moved to the copy.
+ * Very long lines are not kept.
+ */
+void cache_parsed(const char *line, size_t len, unsigned int hash, char *words, char *quoted, char **argv) {
+    if (len >= MAXLINE) {
         return;
     }
 
-    /* 
-    * Jobs states: FG (foreground), BG (background), ST (stopped)
-    * Job state transitions and enabling actions:
-    *     FG -> ST  : ctrl-z
-    *     ST -> FG  : fg command
-    *     ST -> BG  : bg command
-    *     BG -> FG  : fg command
-    * At most 1 job can be in the FG state.
-    */
-
-    /* Check if the job is in the foreground */
-    if (job_to_modify->state == FG) {
-        /* If the job is in the background, the user must first stop the job */
-        if (strcmp(argv[0], "bg") == 0) {
-            sprintf(sbuf, "Job (%%%d) must be stopped before moving it to the background.", pid_or_jid);
-            user_error(sbuf);
-            return;
-        } else {
-            /* If the job is in the foreground, we can't change it */
-            sprintf(sbuf, "Job (%%%d) is already in the foreground.", pid_or_jid);
-            user_error(sbuf);
+    /* Make room by evicting the least recently used line that is not running */
+    if (parsecache.count >= PARSECACHE) {
+        struct parsed_t *victim = parsecache.oldest;
+        while (victim != NULL && victim->busy > 0) {
+            victim = victim->newer;
+        }
+        if (victim == NULL) {
             return;
         }
-        return;
+        unlink_parsed(victim);
+        struct parsed_t **link = &parsecache.buckets[victim->hash % PARSECACHE];
+        while (*link != victim) {
+            link = &(*link)->next;
+        }
+        *link = victim->next;
+        parsecache.count--;
+        free(victim);
     }
 
-    /* Check if the job is in the background */
-    if (job_to_modify->state == BG) {
-        if (strcmp(argv[0], "bg") == 0) {
-            /* If the job is in the background and the user wants to put it in the background, we can't change it */
-            sprintf(sbuf, "Job (%%%d) is already in the background.", pid_or_jid);
-            user_error(sbuf);
+    /* The words end after the last one that is not a token */
+    int argc = 0;
+    size_t used = 0;
+    for (; argv[argc] != NULL; argc++) {
+        if (argv[argc] >= words && argv[argc] < words + 2 * len + 2) {
+            size_t end = argv[argc] - words + strlen(argv[argc]) + 1;
+            used = (end > used) ? end : used;
+        }
+    }
+
+    struct parsed_t *parsed = malloc(sizeof(struct parsed_t) + (argc + 1) * sizeof(char *) + len + 1 + 2 * used);
+    if (parsed == NULL) {
+        return; /* the line is just parsed again next time */
+    }
+    parsed->argv = (char **) (parsed + 1);
+    parsed->line = (char *) (parsed->argv + argc + 1);
+    parsed->words = parsed->line + len + 1;
+    parsed->quoted = parsed->words + used;
+    memcpy(parsed->line, line, len + 1);
+    memcpy(parsed->words, words, used);
+    memcpy(parsed->quoted, quoted, used);
+    for (int i = 0; i <= argc; i++) {
+        const bool word = (argv[i] >= words && argv[i] < words + 2 * len + 2);
+        parsed->argv[i] = word ? parsed->words + (argv[i] - words) : argv[i];
+    }
+    parsed->len = len;
+    parsed->hash = hash;
+    parsed->argc = argc;
+    parsed->busy = 0;
+
+    unsigned int b = hash % PARSECACHE;
+    parsed->next = parsecache.buckets[b];
+    parsecache.buckets[b] = parsed;
+    parsed->older = parsecache.newest;
+    parsed->newer = NULL;
+    if (parsecache.newest != NULL) {
+        parsecache.newest->newer = parsed;
+    } else {
+        parsecache.oldest = parsed;
+    }
+    parsecache.newest = parsed;
+    parsecache.count++;
+}
+
+/* unlink_parsed - Take a line off the list of the parse cache */
+void unlink_parsed(struct parsed_t *parsed) {
+    if (parsed->newer != NULL) {
+        parsed->newer->older = parsed->older;
+    } else {
+        parsecache.newest = parsed->older;
+    }
+    if (parsed->older != NULL) {
+        parsed->older->newer = parsed->newer;
+    } else {
+        parsecache.oldest = parsed->newer;
+    }
+}
+
+/*****************
+ * End of parse cache functions
+ * ****************/
+
+/*****************
+ * Process launch functions
+ * ****************/
+
+/*
+ * launch_cmd - Start argv[0] as a child in process group pgid
+ *
+ * A pgid of 0 puts the child in a new group of its own. The child reads
+ * from in, writes to out and err and starts with the signal mask child_mask.
+ * The redirections are then applied in the child in the order given,
+ * and the command runs with the environment envp. Commands without a /
+ * are found through the command hash table, or if search is not NULL
+ * by searching the directories in it (the PATH given to the command).
+ * Returns the pid of the child, or -1 if the command could not be started.
+ */
+pid_t launch_cmd(char **argv, char **envp, const char *search, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask) {
+    char *found = NULL; /* the path found in search, which is not hashed */
+    char *path;
+    pid_t pid;
+
+    if (search != NULL && strchr(argv[0], '/') == NULL) {
+        path = found = search_path(argv[0], search);
+    } else {
+        path = hash_cmd(&cmdhash, argv[0]);
+    }
+    const bool hashed = (path != NULL && found == NULL && path != argv[0]); /* path came from the hash table */
+    if (path == NULL) {
+        printf("%s: Command not found.\n", argv[0]);
+        return -1;
+    }
+
+    /* posix_spawn cannot set limits or a cgroup for the child, so those jobs are forked */
+    if (use_fork || jobs_confined()) {
+        /* A forked child cannot tell the shell that exec failed, so a stale hashed path is checked here */
+        if (hashed && access(path, X_OK) < 0) {
+            unhash_cmd(&cmdhash, argv[0]);
+            if ((path = hash_cmd(&cmdhash, argv[0])) == NULL) {
+                printf("%s: Command not found.\n", argv[0]);
+                return -1;
+            }
+        }
+        pid = fork_cmd(path, argv, envp, redirs, nredirs, pgid, in, out, err, child_mask);
+        free(found);
+        return pid;
+    }
+
+    pid = spawn_cmd(path, argv, envp, redirs, nredirs, pgid, in, out, err, child_mask);
+    if (pid < 0 && nredirs > 0 && access(path, X_OK) == 0) {
+        /* posix_spawn gives the same errors for a redirection that failed */
+        printf("%s: Could not redirect: %s\n", argv[0], strerror(errno));
+        free(found);
+        return -1;
+    }
+    free(found);
+
+    /* A hashed path that no longer works is forgotten and PATH is searched again */
+    if (pid < 0 && hashed) {
+        unhash_cmd(&cmdhash, argv[0]);
+        if ((path = hash_cmd(&cmdhash, argv[0])) != NULL) {
+            pid = spawn_cmd(path, argv, envp, redirs, nredirs, pgid, in, out, err, child_mask);
+        }
+    }
+
+    if (pid < 0) {
+        printf("%s: Command not found.\n", argv[0]);
+    }
+    return pid;
+}
+
+/*
+ * spawn_cmd - Start a child with posix_spawn
+ *
+ * posix_spawn does not copy the shell's page tables, so the cost of
+ * launching a command does not grow with the size of the shell. The
+ * process group is set by the spawn attributes, which is the same as
+ * the child calling setpgid(0, pgid) before exec.
+ */
+pid_t spawn_cmd(char *path, char **argv, char **envp, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int rc;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, child_mask);
+
+    /* Pipe ends are close-on-exec, so only the dup2'd copies reach the command */
+    posix_spawn_file_actions_init(&actions);
+    if (in != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (out != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+    if (err != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+    }
+
+    /* The files are opened by the child, so the shell never touches the data */
+    for (int i = 0; i < nredirs; i++) {
+        if (redirs[i].path != NULL) {
+            posix_spawn_file_actions_addopen(&actions, redirs[i].fd, redirs[i].path, redirs[i].flags, 0666);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, redirs[i].from, redirs[i].fd);
+        }
+    }
+
+    rc = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+/* fork_cmd - Start a child with fork and execve */
+pid_t fork_cmd(char *path, char **argv, char **envp, struct redir_t *redirs, int nredirs, pid_t pgid, int in, int out, int err, sigset_t *child_mask) {
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {   /* Child runs user job */
+        /* Restore the signal mask */
+        sigprocmask(SIG_SETMASK, child_mask, NULL);
+
+        /* Put the child in the process group of the job */
+        if (setpgid(0, pgid) == -1) {
+            reset_state_error("Could not set process group ID.");
+        }
+
+        /* Move it to the job's cgroup and set its limits */
+        confine_child();
+
+        /* Connect the child to the pipeline */
+        if (in != STDIN_FILENO) {
+            dup2(in, STDIN_FILENO);
+        }
+        if (out != STDOUT_FILENO) {
+            dup2(out, STDOUT_FILENO);
+        }
+        if (err != STDERR_FILENO) {
+            dup2(err, STDERR_FILENO);
+        }
+
+        /* Apply the redirections */
+        for (int i = 0; i < nredirs; i++) {
+            int fd = (redirs[i].path != NULL) ? open(redirs[i].path, redirs[i].flags, 0666) : redirs[i].from;
+            if (fd < 0 || dup2(fd, redirs[i].fd) < 0) {
+                printf("%s: %s\n", (redirs[i].path != NULL) ? redirs[i].path : argv[0], strerror(errno));
+                fflush(stdout);
+                _exit(EXIT_FAILURE);
+            }
+            if (redirs[i].path != NULL && fd != redirs[i].fd) {
+                close(fd);
+            }
+        }
+
+        /* Execute the command */
+        if (execve(path, argv, envp) < 0) {
+            /* _exit, so the child does not also write out the shell's buffered trace events */
+            const int status = (errno == ENOENT) ? 127 : 126;
+            printf("%s: Command not found.\n", argv[0]);
+            fflush(stdout);
+            _exit(status);
+        }
+    }
+
+    if (pid < 0) {
+        reset_state_error("Could not fork child process.");
+        return -1;
+    }
+
+    /* Also set the group here so the parent never sees the child in the shell's group */
+    setpgid(pid, (pgid == 0) ? pid : pgid);
+    return pid;
+}
+
+/*****************
+ * End of process launch functions
+ * ****************/
+
+/*****************
+ * Job limit functions
+ * ****************/
+
+/*
+ * Jobs can be kept from taking over the machine in two ways. ulimit
+ * sets resource limits that each process of a job gets with setrlimit
+ * before it execs, so a limit only applies to the jobs and never to the
+ * shell itself. With TSH_CGROUP (or the cgroup command) naming a cgroup
+ * v2 directory the shell may write to, each job is also put in a leaf
+ * cgroup of its own under it, with cpu.max and memory.max set from
+ * TSH_CPU_MAX and TSH_MEMORY_MAX (or cgroup -c and -m), so a fan-out of
+ * jobs is limited as a whole rather than one process at a time. Each
+ * process joins the leaf before it execs, and the leaf is removed once
+ * the job has been reaped. Neither can be done through posix_spawn, so
+ * jobs that have either are started with fork.
+ */
+
+/* init_limits - Put jobs in cgroups as TSH_CGROUP, TSH_CPU_MAX and TSH_MEMORY_MAX say */
+void init_limits() {
+    const char *cpu_max = get_var("TSH_CPU_MAX");
+    const char *memory_max = get_var("TSH_MEMORY_MAX");
+    const char *parent = get_var("TSH_CGROUP");
+    snprintf(jobcgroup.cpu_max, sizeof(jobcgroup.cpu_max), "%s", (cpu_max != NULL) ? cpu_max : "");
+    snprintf(jobcgroup.memory_max, sizeof(jobcgroup.memory_max), "%s", (memory_max != NULL) ? memory_max : "");
+    if (parent != NULL && *parent != '\0') {
+        set_cgroup_parent(parent);
+    }
+}
+
+/* jobs_confined - Check if the jobs have limits or cgroups the child has to set up itself */
+bool jobs_confined() {
+    if (jobcgroup.procs_fd >= 0) {
+        return true;
+    }
+    for (int i = 0; i < NLIMITS; i++) {
+        if (limits[i].set) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* confine_child - Move a forked child to the job's cgroup and set its limits before it execs */
+void confine_child() {
+    /* Writing 0 to cgroup.procs moves the process that writes it */
+    if (jobcgroup.procs_fd >= 0 && write(jobcgroup.procs_fd, "0", 1) < 0) {
+        printf("Could not join the job's cgroup: %s\n", strerror(errno));
+        fflush(stdout);
+        _exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < NLIMITS; i++) {
+        struct rlimit rl = {limits[i].value, limits[i].value};
+        if (limits[i].set && setrlimit(limits[i].resource, &rl) < 0) {
+            printf("Could not set the %s limit: %s\n", limits[i].name, strerror(errno));
+            fflush(stdout);
+            _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * do_ulimit - Execute the builtin ulimit command
+ *
+ *     ulimit                        list the limits of the jobs
+ *     ulimit -t|-v|-n               print one limit
+ *     ulimit -t|-v|-n N|unlimited   set (or remove) a limit, for each option given
+ *
+ * -t is CPU time in seconds, -v virtual memory in kbytes and -n open
+ * files. A job without a limit of its own gets the shell's.
+ */
+void do_ulimit(char **argv) {
+    if (argv[1] == NULL || (strcmp(argv[1], "-a") == 0 && argv[2] == NULL)) {
+        for (int i = 0; i < NLIMITS; i++) {
+            print_limit(&limits[i]);
+        }
+        return;
+    }
+
+    for (int k = 1; argv[k] != NULL; k++) {
+        struct limit_t *limit = NULL;
+        for (int i = 0; i < NLIMITS; i++) {
+            if (argv[k][0] == '-' && argv[k][1] == limits[i].option && argv[k][2] == '\0') {
+                limit = &limits[i];
+            }
+        }
+        if (limit == NULL) {
+            user_error("Usage: ulimit [-t|-v|-n [N|unlimited]] ...");
+            return;
+        }
+
+        if (argv[k + 1] == NULL || argv[k + 1][0] == '-') {
+            print_limit(limit);
+        } else if (!parse_limit(limit, argv[++k])) {
+            return;
+        }
+    }
+}
+
+/* parse_limit - Set a limit of the jobs from an argument of ulimit, false (and an error) if it is not valid */
+bool parse_limit(struct limit_t *limit, const char *arg) {
+    if (strcmp(arg, "unlimited") == 0) {
+        limit->set = false;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || errno != 0 || arg[0] == '-' || n > RLIM_INFINITY / limit->unit) {
+        sprintf(sbuf, "ulimit: %.100s: invalid number", arg);
+        user_error(sbuf);
+        return false;
+    }
+
+    /* A child can lower its hard limit but only root can raise it */
+    struct rlimit rl;
+    rlim_t value = n * limit->unit;
+    if (getrlimit(limit->resource, &rl) == 0 && rl.rlim_max != RLIM_INFINITY && value > rl.rlim_max && geteuid() != 0) {
+        sprintf(sbuf, "ulimit: %s: cannot be raised above %llu", limit->name, (unsigned long long) (rl.rlim_max / limit->unit));
+        user_error(sbuf);
+        return false;
+    }
+    limit->set = true;
+    limit->value = value;
+    return true;
+}
+
+/* print_limit - Print a limit of the jobs (the shell's own if they have none) */
+void print_limit(struct limit_t *limit) {
+    struct rlimit rl;
+    rlim_t value = limit->value;
+    if (!limit->set) {
+        value = (getrlimit(limit->resource, &rl) == 0) ? rl.rlim_cur : RLIM_INFINITY;
+    }
+    if (value == RLIM_INFINITY) {
+        printf("%-24s (-%c) unlimited\n", limit->name, limit->option);
+    } else {
+        printf("%-24s (-%c) %llu\n", limit->name, limit->option, (unsigned long long) (value / limit->unit));
+    }
+}
+
+/*
+ * do_cgroup - Execute the builtin cgroup command
+ *
+ *     cgroup          show where jobs are put and the limits of their cgroups
+ *     cgroup DIR      put each job in a cgroup of its own under DIR
+ *     cgroup -c MAX   write MAX ("quota period", or max) to the cpu.max of each job's cgroup
+ *     cgroup -m MAX   write MAX (bytes with K, M or G, or max) to memory.max
+ *     cgroup off      leave new jobs in the shell's cgroup
+ */
+void do_cgroup(char **argv) {
+    if (argv[1] == NULL) {
+        printf("cgroup      %s\n", (jobcgroup.parent != NULL) ? jobcgroup.parent : "off");
+        printf("cpu.max     %s\n", (jobcgroup.cpu_max[0] != '\0') ? jobcgroup.cpu_max : "-");
+        printf("memory.max  %s\n", (jobcgroup.memory_max[0] != '\0') ? jobcgroup.memory_max : "-");
+        return;
+    }
+
+    for (int k = 1; argv[k] != NULL; k++) {
+        bool cpu = (strcmp(argv[k], "-c") == 0);
+        if ((cpu || strcmp(argv[k], "-m") == 0) && argv[k + 1] != NULL) {
+            char *value = cpu ? jobcgroup.cpu_max : jobcgroup.memory_max;
+            if (strlen(argv[++k]) >= sizeof(jobcgroup.cpu_max)) {
+                user_error("cgroup: Limit too long.");
+                return;
+            }
+            strcpy(value, argv[k]);
+        } else if (strcmp(argv[k], "off") == 0) {
+            free(jobcgroup.parent);
+            jobcgroup.parent = NULL;
+        } else if (argv[k][0] == '-') {
+            user_error("Usage: cgroup [DIR | off] [-c MAX] [-m MAX]");
+            return;
+        } else if (!set_cgroup_parent(argv[k])) {
             return;
+        }
+    }
+}
+
+/*
+ * set_cgroup_parent - Put the jobs in leaves of the cgroup dir (relative to the shell's directory)
+ *
+ * The cpu and memory controllers are turned on for the leaves, which
+ * cgroup v2 only allows if no process is in dir itself. Returns false
+ * (and an error) if dir is not a cgroup the shell can write to.
+ */
+bool set_cgroup_parent(const char *dir) {
+    char path[PATH_MAX];
+    if (dir[0] == '/') {
+        snprintf(path, sizeof(path), "%s", dir);
+    } else {
+        shell_file(path, dir);
+    }
+
+    char procs[PATH_MAX + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+    if (access(procs, W_OK) < 0) {
+        snprintf(sbuf, sizeof(sbuf), "cgroup: %s: Not a cgroup the shell can write to.", dir);
+        user_error(sbuf);
+        return false;
+    }
+
+    /* A controller that cannot be turned on is reported when a job's limit cannot be written */
+    write_cgroup_file(path, "cgroup.subtree_control", "+cpu");
+    write_cgroup_file(path, "cgroup.subtree_control", "+memory");
+
+    free(jobcgroup.parent);
+    if ((jobcgroup.parent = strdup(path)) == NULL) {
+        reset_state_error("Could not allocate the cgroup path.");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * open_job_cgroup - Make the cgroup leaf of the next job and open its cgroup.procs for the children
+ *
+ * cgroup is set to the path of the leaf, which the job keeps so the
+ * leaf is still found after cgroup off or a new directory, or to NULL
+ * if jobs are not put in cgroups. Returns false (and an error) if the
+ * leaf could not be made, in which case the job is not started.
+ */
+bool open_job_cgroup(char **cgroup) {
+    *cgroup = NULL;
+    if (jobcgroup.parent == NULL) {
+        return true;
+    }
+
+    const size_t size = strlen(jobcgroup.parent) + 32;
+    char *path = malloc(size);
+    if (path == NULL) {
+        reset_state_error("Could not allocate the cgroup path.");
+        return false;
+    }
+    snprintf(path, size, "%s/tsh-%d-%d", jobcgroup.parent, (int) getpid(), ++jobcgroup.seq);
+    if (mkdir(path, 0755) < 0) {
+        snprintf(sbuf, sizeof(sbuf), "Could not create cgroup %s: %s", path, strerror(errno));
+        reset_state_error(sbuf);
+        free(path);
+        return false;
+    }
+
+    const char *failed = NULL; /* the file that could not be written */
+    if (jobcgroup.cpu_max[0] != '\0' && !write_cgroup_file(path, "cpu.max", jobcgroup.cpu_max)) {
+        failed = "cpu.max";
+    } else if (jobcgroup.memory_max[0] != '\0' && !write_cgroup_file(path, "memory.max", jobcgroup.memory_max)) {
+        failed = "memory.max";
+    }
+    char procs[PATH_MAX + 48];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+    if (failed == NULL && (jobcgroup.procs_fd = open(procs, O_WRONLY | O_CLOEXEC)) < 0) {
+        failed = "cgroup.procs";
+    }
+    if (failed != NULL) {
+        snprintf(sbuf, sizeof(sbuf), "Could not write %s of cgroup %s: %s", failed, path, strerror(errno));
+        reset_state_error(sbuf);
+        rmdir(path);
+        free(path);
+        return false;
+    }
+    *cgroup = path;
+    return true;
+}
+
+/* close_job_cgroup - Close the cgroup.procs of a job's leaf once it is launched, removing the leaf unless keep */
+void close_job_cgroup(char *cgroup, bool keep) {
+    if (jobcgroup.procs_fd >= 0) {
+        close(jobcgroup.procs_fd);
+        jobcgroup.procs_fd = -1;
+    }
+    if (cgroup != NULL && !keep) {
+        remove_job_cgroup(cgroup);
+    }
+}
+
+/* remove_job_cgroup - Remove the cgroup leaf of a job (which fails while a process is still in it) and free its path */
+void remove_job_cgroup(char *cgroup) {
+    if (cgroup != NULL) {
+        rmdir(cgroup);
+        free(cgroup);
+    }
+}
+
+/* write_cgroup_file - Write a value to a file of a cgroup */
+bool write_cgroup_file(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = (write(fd, value, strlen(value)) == (ssize_t) strlen(value));
+    close(fd);
+    return ok;
+}
+
+/*****************
+ * End of job limit functions
+ * ****************/
+
+/*****************
+ * Command hash functions
+ * ****************/
+
+/*
+ * The command hash table maps a command name to the path it was found
+ * at in PATH, so the directories in PATH are only searched the first
+ * time a command is run. The table is emptied when PATH changes, and
+ * an entry is dropped when its path can no longer be executed.
+ */
+
+/* str_hash - FNV-1a hash of a string */
+static unsigned int str_hash(const char *str) {
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+    return h;
+}
+
+/* initcmdhash - Initialize the command hash table */
+void initcmdhash(struct cmdhash_t *hash) {
+    hash->count = 0;
+    hash->hits = 0;
+    hash->misses = 0;
+    hash->path = NULL;
+    hash->nbuckets = MINHASH;
+    hash->buckets = calloc(hash->nbuckets, sizeof(struct hashent_t *));
+    if (hash->buckets == NULL) {
+        unix_error("Could not allocate the command hash table");
+    }
+}
+
+/* clearcmdhash - Remove every entry from the command hash table */
+void clearcmdhash(struct cmdhash_t *hash) {
+    for (int i = 0; i < hash->nbuckets; i++) {
+        while (hash->buckets[i] != NULL) {
+            struct hashent_t *ent = hash->buckets[i];
+            hash->buckets[i] = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+        }
+    }
+    hash->count = 0;
+}
+
+/* find_hashed - Find the entry for a command name, NULL if it is not hashed */
+struct hashent_t *find_hashed(struct cmdhash_t *hash, const char *name) {
+    struct hashent_t *ent = hash->buckets[str_hash(name) & (hash->nbuckets - 1)];
+    while (ent != NULL && strcmp(ent->name, name) != 0) {
+        ent = ent->next;
+    }
+    return ent;
+}
+
+/* search_path - Search the directories in dir (a list like PATH) for an executable called name */
+char *search_path(const char *name, const char *dir) {
+    const size_t name_len = strlen(name);
+    while (*dir) {
+        const char *end = strchrnul(dir, ':');
+        const size_t dir_len = end - dir;
+        char *path = malloc(dir_len + name_len + 3);
+        if (path == NULL) {
+            return NULL;
+        }
+
+        /* An empty entry in PATH means the current directory */
+        if (dir_len == 0) {
+            sprintf(path, "./%s", name);
         } else {
-            /* User want to move a job from the background to the foreground */
-            job_to_modify->state = FG;
-            
-            /* Set the foreground pid to 0 to make waitfg wait */
-            fg_pid = 0;
+            sprintf(path, "%.*s/%s", (int) dir_len, dir, name);
+        }
 
-            /* Edit the proc file */
-            edit_proc_entry(job_to_modify->pid, "R+");
+        struct stat sb;
+        if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+        dir = (*end == ':') ? end + 1 : end;
+    }
+    return NULL;
+}
+
+/*
+ * hash_cmd - Return the path to execute for a command name
+ *
+ * Names that contain a / are used as they are. Other names are looked
+ * up in the command hash table and searched for in PATH on a miss.
+ * Returns NULL if the command could not be found.
+ */
+char *hash_cmd(struct cmdhash_t *hash, const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return (char *) name;
+    }
+
+    /* Throw away every entry if PATH has changed since they were found */
+    const char *path_env = get_var("PATH");
+    if (path_env == NULL) {
+        path_env = "";
+    }
+    if (hash->path == NULL || strcmp(hash->path, path_env) != 0) {
+        clearcmdhash(hash);
+        free(hash->path);
+        hash->path = strdup(path_env);
+    }
+
+    struct hashent_t *ent = find_hashed(hash, name);
+    if (ent != NULL) {
+        hash->hits++;
+        ent->hits++;
+        return ent->path;
+    }
+
+    hash->misses++;
+    char *path = search_path(name, path_env);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    /* Keep the chains short */
+    if (hash->count >= hash->nbuckets) {
+        int nbuckets = 2 * hash->nbuckets;
+        struct hashent_t **buckets = calloc(nbuckets, sizeof(struct hashent_t *));
+        if (buckets != NULL) {
+            for (int i = 0; i < hash->nbuckets; i++) {
+                while (hash->buckets[i] != NULL) {
+                    struct hashent_t *c = hash->buckets[i];
+                    hash->buckets[i] = c->next;
+                    unsigned int b = str_hash(c->name) & (nbuckets - 1);
+                    c->next = buckets[b];
+                    buckets[b] = c;
+                }
+            }
+            free(hash->buckets);
+            hash->buckets = buckets;
+            hash->nbuckets = nbuckets;
+        }
+    }
+
+    if ((ent = malloc(sizeof(struct hashent_t))) == NULL) {
+        unix_error("Could not allocate command hash entry");
+    }
+    ent->name = strdup(name);
+    ent->path = path;
+    ent->hits = 0;
+    unsigned int b = str_hash(name) & (hash->nbuckets - 1);
+    ent->next = hash->buckets[b];
+    hash->buckets[b] = ent;
+    hash->count++;
+    return path;
+}
+
+/* unhash_cmd - Drop the entry for a command name from the command hash table */
+void unhash_cmd(struct cmdhash_t *hash, const char *name) {
+    struct hashent_t **link = &hash->buckets[str_hash(name) & (hash->nbuckets - 1)];
+    while (*link != NULL) {
+        struct hashent_t *ent = *link;
+        if (strcmp(ent->name, name) == 0) {
+            *link = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+            hash->count--;
+            return;
+        }
+        link = &ent->next;
+    }
+}
+
+/*
+ * do_hash - Execute the builtin hash command
+ *
+ *     hash            list the hashed commands and the hit/miss counts
+ *     hash -r         forget every hashed command
+ *     hash name ...   look up each name in PATH and hash it
+ */
+void do_hash(char **argv) {
+    if (argv[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < cmdhash.nbuckets; i++) {
+            for (struct hashent_t *ent = cmdhash.buckets[i]; ent != NULL; ent = ent->next) {
+                printf("%4d\t%s\n", ent->hits, ent->path);
+            }
+        }
+        printf("%ld hits, %ld misses\n", cmdhash.hits, cmdhash.misses);
+        return;
+    }
+
+    if (strcmp(argv[1], "-r") == 0) {
+        clearcmdhash(&cmdhash);
+        return;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (hash_cmd(&cmdhash, argv[i]) == NULL) {
+            sprintf(sbuf, "hash: %.100s: not found", argv[i]);
+            user_error(sbuf);
+        }
+    }
+}
+
+/*****************
+ * End of command hash functions
+ * ****************/
+
+/*****************
+ * Variable functions
+ * ****************/
+
+/*
+ * The variable table holds the shell variables, starting with the
+ * environment the shell was started with. Each variable is kept as a
+ * single "name=value" string, so the environment passed to commands is
+ * just an array of pointers to the entries of the exported variables.
+ * That array is only rebuilt when an exported variable has changed since
+ * it was last built; otherwise every command is launched with the same
+ * one. The shell reads its own settings (PATH, HISTSIZE, ...) from the
+ * table too, so export and VAR=value take effect without a new process.
+ */
+
+/* name_hash - FNV-1a hash of the first len characters of a name */
+static unsigned int name_hash(const char *name, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* initvars - Initialize the variable table from the environment of the shell */
+void initvars(struct vartable_t *vars) {
+    vars->count = 0;
+    vars->envp = NULL;
+    vars->envc = 0;
+    vars->env_cap = 0;
+    vars->env_changed = true;
+    vars->nbuckets = MINVARS;
+    vars->buckets = calloc(vars->nbuckets, sizeof(struct var_t *));
+    if (vars->buckets == NULL) {
+        unix_error("Could not allocate the variable table");
+    }
+
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq != NULL && eq != *env && !set_var(vars, *env, eq - *env, eq + 1, true)) {
+            unix_error("Could not copy the environment");
+        }
+    }
+}
+
+/* find_var - Find the variable whose name is the first len characters of name */
+struct var_t *find_var(struct vartable_t *vars, const char *name, size_t len) {
+    struct var_t *var = vars->buckets[name_hash(name, len) & (vars->nbuckets - 1)];
+    while (var != NULL && (var->name_len != len || strncmp(var->entry, name, len) != 0)) {
+        var = var->next;
+    }
+    return var;
+}
+
+/* get_var - Return the value of a variable, NULL if it is not set */
+const char *get_var(const char *name) {
+    struct var_t *var = find_var(&vars, name, strlen(name));
+    return (var != NULL) ? var->entry + var->name_len + 1 : NULL;
+}
+
+/*
+ * set_var - Set the variable named by the first len characters of name
+ *
+ * The variable is exported if export is true; a variable that is
+ * already exported stays exported. Returns false if there was no memory.
+ */
+bool set_var(struct vartable_t *vars, const char *name, size_t len, const char *value, bool export) {
+    /* Build the new entry first, as value may point into the old one */
+    char *entry = malloc(len + strlen(value) + 2);
+    if (entry == NULL) {
+        return false;
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    strcpy(entry + len + 1, value);
+
+    struct var_t *var = find_var(vars, name, len);
+    if (var == NULL) {
+        /* Keep the chains short */
+        if (vars->count >= vars->nbuckets) {
+            int nbuckets = 2 * vars->nbuckets;
+            struct var_t **buckets = calloc(nbuckets, sizeof(struct var_t *));
+            if (buckets != NULL) {
+                for (int i = 0; i < vars->nbuckets; i++) {
+                    while (vars->buckets[i] != NULL) {
+                        struct var_t *v = vars->buckets[i];
+                        vars->buckets[i] = v->next;
+                        unsigned int b = name_hash(v->entry, v->name_len) & (nbuckets - 1);
+                        v->next = buckets[b];
+                        buckets[b] = v;
+                    }
+                }
+                free(vars->buckets);
+                vars->buckets = buckets;
+                vars->nbuckets = nbuckets;
+            }
+        }
+
+        if ((var = malloc(sizeof(struct var_t))) == NULL) {
+            free(entry);
+            return false;
+        }
+        var->name_len = len;
+        var->exported = false;
+        unsigned int b = name_hash(name, len) & (vars->nbuckets - 1);
+        var->next = vars->buckets[b];
+        vars->buckets[b] = var;
+        vars->count++;
+    } else {
+        free(var->entry);
+    }
+
+    var->entry = entry;
+    var->exported |= export;
+    if (var->exported) {
+        vars->env_changed = true;
+    }
+    return true;
+}
+
+/* unset_var - Remove a variable from the variable table */
+void unset_var(struct vartable_t *vars, const char *name) {
+    const size_t len = strlen(name);
+    struct var_t **link = &vars->buckets[name_hash(name, len) & (vars->nbuckets - 1)];
+    while (*link != NULL) {
+        struct var_t *var = *link;
+        if (var->name_len == len && strncmp(var->entry, name, len) == 0) {
+            *link = var->next;
+            if (var->exported) {
+                vars->env_changed = true;
+            }
+            free(var->entry);
+            free(var);
+            vars->count--;
+            return;
+        }
+        link = &var->next;
+    }
+}
+
+/*
+ * env_array - Return the environment for commands, NULL if there was no memory
+ *
+ * The array is owned by the variable table and is only rebuilt when an
+ * exported variable has been set or removed since the last call.
+ */
+char **env_array(struct vartable_t *vars) {
+    if (!vars->env_changed) {
+        return vars->envp;
+    }
+
+    if (vars->count + 1 > vars->env_cap) {
+        int cap = 2 * (vars->count + 1);
+        char **envp = realloc(vars->envp, cap * sizeof(char *));
+        if (envp == NULL) {
+            return NULL;
+        }
+        vars->envp = envp;
+        vars->env_cap = cap;
+    }
+
+    int n = 0;
+    for (int i = 0; i < vars->nbuckets; i++) {
+        for (struct var_t *var = vars->buckets[i]; var != NULL; var = var->next) {
+            if (var->exported) {
+                vars->envp[n++] = var->entry;
+            }
+        }
+    }
+    vars->envp[n] = NULL;
+    vars->envc = n;
+    vars->env_changed = false;
+    return vars->envp;
+}
+
+/* var_name_len - Return the length of the variable name str starts with (0 if none) */
+size_t var_name_len(const char *str) {
+    if (!isalpha((unsigned char) str[0]) && str[0] != '_') {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char) str[len]) || str[len] == '_') {
+        len++;
+    }
+    return len;
+}
+
+/* assignment_len - Return the length of the name if word is NAME=value, 0 otherwise */
+size_t assignment_len(const char *word) {
+    const size_t len = var_name_len(word);
+    return (len > 0 && word[len] == '=') ? len : 0;
+}
+
+/*
+ * cmd_env - Build the environment of a command that has VAR=value words before it
+ *
+ * The entries of the exported variables that are not assigned are
+ * shared with env_array, and the assignments are used as they are, so
+ * only the array itself is allocated (the caller frees it). Returns NULL
+ * if there was no memory.
+ */
+char **cmd_env(char **assigns, int nassigns) {
+    char **base = env_array(&vars);
+    char **envp = (base != NULL) ? malloc((vars.envc + nassigns + 1) * sizeof(char *)) : NULL;
+    if (envp == NULL) {
+        return NULL;
+    }
+
+    int n = 0;
+    for (int i = 0; i < vars.envc; i++) {
+        const size_t len = strchrnul(base[i], '=') - base[i];
+        bool assigned = false;
+        for (int k = 0; k < nassigns && !assigned; k++) {
+            assigned = (assignment_len(assigns[k]) == len && strncmp(assigns[k], base[i], len) == 0);
+        }
+        if (!assigned) {
+            envp[n++] = base[i];
+        }
+    }
+
+    /* The last assignment of a name wins */
+    for (int k = 0; k < nassigns; k++) {
+        const size_t len = assignment_len(assigns[k]);
+        bool later = false;
+        for (int j = k + 1; j < nassigns && !later; j++) {
+            later = (assignment_len(assigns[j]) == len && strncmp(assigns[j], assigns[k], len) == 0);
+        }
+        if (!later) {
+            envp[n++] = assigns[k];
+        }
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+/* cmp_str - qsort comparison of strings */
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *
+ *     export                  list the exported variables
+ *     export NAME[=value] ... export each variable (setting it first if a value is given)
+ */
+void do_export(char **argv) {
+    if (argv[1] == NULL) {
+        char **envp = env_array(&vars);
+        char **sorted = (envp != NULL) ? malloc((vars.envc + 1) * sizeof(char *)) : NULL;
+        if (sorted == NULL) {
+            reset_state_error("Could not list the variables.");
+            return;
+        }
+        memcpy(sorted, envp, (vars.envc + 1) * sizeof(char *));
+        qsort(sorted, vars.envc, sizeof(char *), cmp_str);
+        for (int i = 0; i < vars.envc; i++) {
+            printf("export %s\n", sorted[i]);
+        }
+        free(sorted);
+        return;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        const size_t len = var_name_len(argv[i]);
+        if (len > 0 && argv[i][len] == '=') {
+            if (!set_var(&vars, argv[i], len, argv[i] + len + 1, true)) {
+                reset_state_error("Could not set variable.");
+            }
+        } else if (len > 0 && argv[i][len] == '\0') {
+            struct var_t *var = find_var(&vars, argv[i], len);
+            if (var != NULL && !var->exported) {
+                var->exported = true;
+                vars.env_changed = true;
+            }
+        } else {
+            sprintf(sbuf, "export: %.100s: not a valid name", argv[i]);
+            user_error(sbuf);
+        }
+    }
+}
+
+/* do_unset - Execute the builtin unset command (unset NAME ...) */
+void do_unset(char **argv) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (var_name_len(argv[i]) == strlen(argv[i]) && argv[i][0] != '\0') {
+            unset_var(&vars, argv[i]);
+        } else {
+            sprintf(sbuf, "unset: %.100s: not a valid name", argv[i]);
+            user_error(sbuf);
+        }
+    }
+}
+
+/*****************
+ * End of variable functions
+ * ****************/
+
+/*****************
+ * Expansion functions
+ * ****************/
+
+/*
+ * Words are expanded after parseline has split the line. Variables are
+ * expanded first: $NAME, ${NAME}, $? (the status of the last command)
+ * and $$ (the pid of the shell) are replaced by their values, which are
+ * treated as quoted, so they are neither split nor expanded again.
+ * Braces are expanded next: a{b,c}d becomes abd acd and {1..3} becomes
+ * 1 2 3. Each resulting word with an unquoted *, ? or [ is then matched
+ * against file names one path component at a time, and replaced by the
+ * names it matches in order (or kept as it is if it matches nothing).
+ * Directory listings are kept in the directory cache and only read
+ * again once the directory has changed, so a script that globs the same
+ * directory on every line reads it once.
+ */
+
+/* needs_expansion - Check if any word has an unquoted $, {, *, ? or [ */
+bool needs_expansion(char **argv, char *words, char *quoted) {
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i] == pipe_token || argv[i] == redir_token) {
+            continue;
+        }
+        const char *q = quoted + (argv[i] - words);
+        for (const char *c = argv[i]; *c; c++, q++) {
+            if (!*q && (*c == '$' || *c == '{' || *c == '*' || *c == '?' || *c == '[')) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * expand_argv - Build args from argv with every word expanded
+ *
+ * words and quoted are the buffers parseline wrote the words and their
+ * quote mask to. The VAR=value words typed before the command of each
+ * stage are found before expansion (and counted in args->assigns), and
+ * like the file of a redirection they only have their variables
+ * expanded, so each one stays a single word. Returns false (with args
+ * freed) if there was no memory.
+ */
+bool expand_argv(char **argv, char *words, char *quoted, struct args_t *args) {
+    args->argv = NULL;
+    args->argc = 0;
+    args->cap = 0;
+    args->nomem = false;
+
+    int stage = 0;                  /* stage of the pipeline the word is in */
+    bool before_cmd = true;         /* no command word has been seen in the stage yet */
+    args->assigns[0] = 0;
+    for (int i = 0; argv[i] != NULL && !args->nomem; i++) {
+        if (argv[i] == pipe_token || argv[i] == redir_token) {
+            add_arg(args, argv[i]);
+            if (argv[i] == pipe_token && stage < MAXARGS - 1) {
+                args->assigns[++stage] = 0;
+                before_cmd = true;
+            }
+            continue;
+        }
+
+        const char *q = quoted + (argv[i] - words);
+        const size_t len = strlen(argv[i]);
+        char *word, *word_quoted;
+        if (!expand_vars(argv[i], q, &word, &word_quoted)) {
+            args->nomem = true;
+            break;
+        }
+        const bool redir_op = (i >= 1 && argv[i - 1] == redir_token);
+        const bool redir_file = (i >= 2 && argv[i - 2] == redir_token && strchr(argv[i - 1], '&') == NULL);
+        const size_t name_len = assignment_len(argv[i]);
+        const bool assign = (before_cmd && !redir_op && !redir_file && name_len > 0 && memchr(q, 1, name_len + 1) == NULL);
+        if (before_cmd && !redir_op && !redir_file && !assign && !(i == 0 && strcmp(argv[i], "time") == 0)) {
+            before_cmd = false;
+        }
+
+        if (redir_file || assign) {
+            add_copy(args, word); /* the file of a redirection and an assignment only have their variables expanded */
+            args->assigns[stage] += assign;
+        } else if (word[0] != '\0' || memchr(q, 1, len + 1) != NULL) {
+            expand_braces(word, word_quoted, args);
+        } /* an unquoted word that expanded to nothing is dropped */
+        free(word);
+        free(word_quoted);
+    }
+    add_arg(args, NULL);
+    args->argc--;
+
+    if (args->nomem) {
+        free_args(args);
+        return false;
+    }
+    return true;
+}
+
+/* add_arg - Add an argument to the end of args, which takes ownership of it */
+void add_arg(struct args_t *args, char *arg) {
+    if (args->argc == args->cap) {
+        int cap = (args->cap == 0) ? MAXARGS : 2 * args->cap;
+        char **argv = realloc(args->argv, cap * sizeof(char *));
+        if (argv == NULL) {
+            args->nomem = true;
+            if (arg != pipe_token && arg != redir_token) {
+                free(arg);
+            }
+            return;
+        }
+        args->argv = argv;
+        args->cap = cap;
+    }
+    args->argv[args->argc++] = arg;
+}
+
+/* add_copy - Add a copy of an argument to the end of args */
+void add_copy(struct args_t *args, const char *arg) {
+    char *copy = strdup(arg);
+    if (copy == NULL) {
+        args->nomem = true;
+        return;
+    }
+    add_arg(args, copy);
+}
+
+/* free_args - Free an argument list built by expand_argv */
+void free_args(struct args_t *args) {
+    for (int i = 0; i < args->argc; i++) {
+        /* split_pipeline replaces the pipe tokens with NULL */
+        if (args->argv[i] != NULL && args->argv[i] != pipe_token && args->argv[i] != redir_token) {
+            free(args->argv[i]);
+        }
+    }
+    free(args->argv);
+}
+
+/*
+ * expand_vars - Replace each unquoted $NAME, ${NAME}, $? and $$ in word with its value
+ *
+ * The new word and its quote mask are malloced, with the values marked
+ * as quoted. A $ that is not followed by a name is kept as it is, and a
+ * variable that is not set expands to nothing. Returns false if there
+ * was no memory.
+ */
+bool expand_vars(const char *word, const char *quoted, char **new_word, char **new_quoted) {
+    /* Work out the length first, then copy */
+    char *w = NULL, *q = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t n = 0;
+        for (size_t i = 0; word[i] != '\0';) {
+            const char *value;
+            size_t used = var_ref(word + i, quoted + i, &value);
+            if (used == 0) {
+                if (w != NULL) {
+                    w[n] = word[i];
+                    q[n] = quoted[i];
+                }
+                n++;
+                i++;
+                continue;
+            }
+            const size_t len = strlen(value);
+            if (w != NULL) {
+                memcpy(w + n, value, len);
+                memset(q + n, 1, len);
+            }
+            n += len;
+            i += used;
+        }
+
+        if (w == NULL) {
+            w = malloc(n + 1);
+            q = malloc(n + 1);
+            if (w == NULL || q == NULL) {
+                free(w);
+                free(q);
+                return false;
+            }
+        } else {
+            w[n] = '\0';
+            q[n] = 0;
+        }
+    }
+    *new_word = w;
+    *new_quoted = q;
+    return true;
+}
+
+/* var_ref - Find the value of the variable word starts with, and return the number of characters it takes (0 if none) */
+size_t var_ref(const char *word, const char *quoted, const char **value) {
+    static char shell_pid[16];
+    static char status[16];
+    if (word[0] != '$' || quoted[0]) {
+        return 0;
+    }
+
+    if (word[1] == '?') {
+        sprintf(status, "%d", last_status);
+        *value = status;
+        return 2;
+    }
+    if (word[1] == '$') {
+        if (shell_pid[0] == '\0') {
+            sprintf(shell_pid, "%d", getpid());
+        }
+        *value = shell_pid;
+        return 2;
+    }
+
+    const bool braced = (word[1] == '{');
+    const char *name = word + 1 + braced;
+    const size_t len = var_name_len(name);
+    if (len == 0 || (braced && name[len] != '}')) {
+        return 0;
+    }
+    struct var_t *var = find_var(&vars, name, len);
+    *value = (var != NULL) ? var->entry + var->name_len + 1 : "";
+    return 1 + len + 2 * braced;
+}
+
+/*
+ * expand_braces - Add the words the first unquoted brace of word stands for to args
+ *
+ * Only braces with a comma at their own level or a range of numbers are
+ * expanded, so {} and {a} are kept as they are. Each new word is
+ * expanded again for the braces that are left, and globbed once none
+ * are left.
+ */
+void expand_braces(const char *word, const char *quoted, struct args_t *args) {
+    const size_t len = strlen(word);
+
+    for (size_t open = 0; open < len; open++) {
+        if (word[open] != '{' || quoted[open]) {
+            continue;
+        }
+
+        /* Find the matching } and check for a comma at this level */
+        size_t close;
+        int depth = 0;
+        bool comma = false;
+        for (close = open + 1; close < len; close++) {
+            if (quoted[close]) {
+                continue;
+            }
+            if (word[close] == '{') {
+                depth++;
+            } else if (word[close] == '}' && depth-- == 0) {
+                break;
+            } else if (word[close] == ',' && depth == 0) {
+                comma = true;
+            }
+        }
+        if (close == len) {
+            continue;
+        }
+
+        long from, to;
+        if (comma) {
+            /* One word for each alternative between the commas */
+            size_t start = open + 1;
+            depth = 0;
+            for (size_t i = open + 1; i <= close; i++) {
+                if (quoted[i]) {
+                    continue;
+                }
+                if (word[i] == '{') {
+                    depth++;
+                } else if (word[i] == '}' && depth > 0) {
+                    depth--;
+                } else if ((word[i] == ',' && depth == 0) || i == close) {
+                    brace_word(word, quoted, open, word + start, quoted + start, i - start, close, args);
+                    start = i + 1;
+                }
+            }
+            return;
+        }
+        if (brace_range(word + open + 1, quoted + open + 1, close - open - 1, &from, &to)) {
+            const long step = (from <= to) ? 1 : -1;
+            char num[32];
+            const char unquoted[32] = {0};
+            for (long n = from; !args->nomem; n += step) {
+                int n_len = sprintf(num, "%ld", n);
+                brace_word(word, quoted, open, num, unquoted, n_len, close, args);
+                if (n == to) {
+                    break;
+                }
+            }
+            return;
+        }
+    }
+
+    glob_word(word, quoted, args);
+}
+
+/* brace_word - Expand the word with the braces from open to close replaced by alt */
+void brace_word(const char *word, const char *quoted, size_t open, const char *alt, const char *alt_quoted, size_t alt_len, size_t close, struct args_t *args) {
+    const size_t tail = strlen(word + close + 1);
+    const size_t len = open + alt_len + tail;
+    char *new_word = malloc(len + 1);
+    char *new_quoted = malloc(len + 1);
+    if (new_word == NULL || new_quoted == NULL) {
+        args->nomem = true;
+        free(new_word);
+        free(new_quoted);
+        return;
+    }
+
+    memcpy(new_word, word, open);
+    memcpy(new_word + open, alt, alt_len);
+    memcpy(new_word + open + alt_len, word + close + 1, tail + 1);
+    memcpy(new_quoted, quoted, open);
+    memcpy(new_quoted + open, alt_quoted, alt_len);
+    memcpy(new_quoted + open + alt_len, quoted + close + 1, tail + 1);
+
+    expand_braces(new_word, new_quoted, args);
+    free(new_word);
+    free(new_quoted);
+}
+
+/* brace_range - Parse the unquoted inside of a brace like {1..10} */
+bool brace_range(const char *word, const char *quoted, size_t len, long *from, long *to) {
+    for (size_t i = 0; i < len; i++) {
+        if (quoted[i]) {
+            return false;
+        }
+    }
+
+    char *end;
+    *from = strtol(word, &end, 10);
+    if (end == word || !isdigit((unsigned char) end[-1]) || strncmp(end, "..", 2) != 0) {
+        return false;
+    }
+    const char *second = end + 2;
+    *to = strtol(second, &end, 10);
+    if (end == second || !isdigit((unsigned char) end[-1]) || end != word + len) {
+        return false;
+    }
+    return labs(*to - *from) < MAXBRACE;
+}
+
+/* has_glob - Check if the first len characters of word have an unquoted *, ? or [ */
+bool has_glob(const char *word, const char *quoted, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!quoted[i] && (word[i] == '*' || word[i] == '?' || word[i] == '[')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* glob_word - Add the file names word matches to args, or word itself if there are none */
+void glob_word(const char *word, const char *quoted, struct args_t *args) {
+    const int before = args->argc;
+    if (has_glob(word, quoted, strlen(word))) {
+        char path[PATH_MAX];
+        glob_path(path, 0, word, quoted, args);
+    }
+    if (args->argc == before) {
+        add_copy(args, word);
+    }
+}
+
+/*
+ * glob_path - Match the rest of a pattern against the files under path
+ *
+ * path holds the plen characters matched so far. Components without
+ * wildcards are copied to the path without reading any directory.
+ */
+void glob_path(char *path, size_t plen, const char *pat, const char *quoted, struct args_t *args) {
+    size_t clen;
+    while (1) {
+        while (*pat == '/') {
+            if (plen + 1 >= PATH_MAX) {
+                return;
+            }
+            path[plen++] = '/';
+            pat++;
+            quoted++;
+        }
+
+        clen = strcspn(pat, "/");
+        if (has_glob(pat, quoted, clen)) {
+            break;
+        }
+        if (plen + clen >= PATH_MAX) {
+            return;
+        }
+        memcpy(path + plen, pat, clen);
+        plen += clen;
+        pat += clen;
+        quoted += clen;
+
+        if (*pat == '\0') {
+            /* The rest of the pattern has no wildcards, so it only matches a file that exists */
+            struct stat sb;
+            path[plen] = '\0';
+            if (lstat(path, &sb) == 0) {
+                add_copy(args, path);
+            }
+            return;
+        }
+    }
+
+    path[plen] = '\0';
+    struct dircache_t *dir = read_dir((plen > 0) ? path : ".");
+    if (dir == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < dir->count && !args->nomem; i++) {
+        const char *name = dir->ents[i].name;
+        /* Names starting with . are only matched by a pattern that starts with . */
+        if (name[0] == '.' && pat[0] != '.') {
+            continue;
+        }
+        if (!glob_match(pat, quoted, clen, name)) {
+            continue;
+        }
+        const size_t nlen = strlen(name);
+        if (plen + nlen >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + plen, name, nlen + 1);
+
+        if (pat[clen] == '\0') {
+            add_copy(args, path);
+        } else if (is_dir(&dir->ents[i], path)) {
+            glob_path(path, plen + nlen, pat + clen, quoted + clen, args);
+        }
+    }
+}
+
+/* glob_match - Check if name matches the first len characters of pat */
+bool glob_match(const char *pat, const char *quoted, size_t len, const char *name) {
+    size_t i = 0;
+    size_t star = 0;            /* where the pattern goes on after the last * */
+    const char *retry = NULL;   /* where the last * gave up matching */
+
+    while (*name) {
+        if (i < len && !quoted[i] && pat[i] == '*') {
+            star = ++i;
+            retry = name;
+            continue;
+        }
+        size_t next = match_one(pat, quoted, len, i, *name);
+        if (next > 0) {
+            i = next;
+            name++;
+        } else if (retry != NULL) {
+            /* Let the last * match one more character */
+            i = star;
+            name = ++retry;
+        } else {
+            return false;
+        }
+    }
+
+    while (i < len && !quoted[i] && pat[i] == '*') {
+        i++;
+    }
+    return i == len;
+}
+
+/*
+ * match_one - Match c against the pattern element at pat[i]
+ *
+ * Returns the index of the next element if c matches, otherwise 0.
+ */
+size_t match_one(const char *pat, const char *quoted, size_t len, size_t i, char c) {
+    if (i >= len) {
+        return 0;
+    }
+    if (quoted[i] || (pat[i] != '?' && pat[i] != '[')) {
+        return (pat[i] == c) ? i + 1 : 0;
+    }
+    if (pat[i] == '?') {
+        return i + 1;
+    }
+
+    /* [...] matches one of the characters or ranges in it, [!...] or [^...] any other */
+    size_t j = i + 1;
+    const bool negate = j < len && !quoted[j] && (pat[j] == '!' || pat[j] == '^');
+    if (negate) {
+        j++;
+    }
+    const size_t first = j;
+    bool found = false;
+    while (j < len && (j == first || quoted[j] || pat[j] != ']')) {
+        unsigned char lo = pat[j], hi = pat[j];
+        if (j + 2 < len && !quoted[j + 1] && pat[j + 1] == '-' && (quoted[j + 2] || pat[j + 2] != ']')) {
+            hi = pat[j + 2];
+            j += 2;
+        }
+        if ((unsigned char) c >= lo && (unsigned char) c <= hi) {
+            found = true;
+        }
+        j++;
+    }
+    if (j >= len) {
+        /* No closing ], so the [ is an ordinary character */
+        return (c == '[') ? i + 1 : 0;
+    }
+    return (found != negate) ? j + 1 : 0;
+}
+
+/*
+ * read_dir - Return the listing of a directory, NULL if it cannot be read
+ *
+ * A cached listing is used as long as the directory has the same
+ * device, inode and mtime as when it was read. A listing read within a
+ * second of the directory changing is always read again, since a
+ * second change could have the same mtime.
+ */
+struct dircache_t *read_dir(const char *path) {
+    struct stat sb;
+    if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        return NULL;
+    }
+
+    const unsigned int b = str_hash(path) & (DIRCACHE - 1);
+    struct dircache_t *dir = dircache.buckets[b];
+    while (dir != NULL && strcmp(dir->path, path) != 0) {
+        dir = dir->next;
+    }
+    if (dir != NULL && !dir->racy && dir->dev == sb.st_dev && dir->ino == sb.st_ino
+        && dir->mtime.tv_sec == sb.st_mtim.tv_sec && dir->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        return dir;
+    }
+
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return NULL;
+    }
+    if (dir == NULL) {
+        if ((dir = calloc(1, sizeof(struct dircache_t))) == NULL || (dir->path = strdup(path)) == NULL) {
+            free(dir);
+            closedir(d);
+            return NULL;
+        }
+        dir->next = dircache.buckets[b];
+        dircache.buckets[b] = dir;
+        dircache.count++;
+    }
+    free(dir->ents);
+    free(dir->names);
+    dir->ents = NULL;
+    dir->names = NULL;
+    dir->count = 0;
+
+    /* The names go in one block, so ents hold offsets into it until the end */
+    size_t ents_cap = 0, names_len = 0, names_cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        const size_t nlen = strlen(de->d_name) + 1;
+        if (dir->count == ents_cap) {
+            ents_cap = (ents_cap == 0) ? 64 : 2 * ents_cap;
+            struct dirname_t *ents = realloc(dir->ents, ents_cap * sizeof(struct dirname_t));
+            if (ents == NULL) {
+                break;
+            }
+            dir->ents = ents;
+        }
+        if (names_len + nlen > names_cap) {
+            names_cap = (names_cap == 0) ? 1024 : 2 * names_cap;
+            if (names_cap < names_len + nlen) {
+                names_cap = names_len + nlen;
+            }
+            char *names = realloc(dir->names, names_cap);
+            if (names == NULL) {
+                break;
+            }
+            dir->names = names;
+        }
+        memcpy(dir->names + names_len, de->d_name, nlen);
+        dir->ents[dir->count].name = (char *) names_len;
+        dir->ents[dir->count].type = de->d_type;
+        dir->count++;
+        names_len += nlen;
+    }
+    closedir(d);
+
+    for (int i = 0; i < dir->count; i++) {
+        dir->ents[i].name = dir->names + (size_t) dir->ents[i].name;
+    }
+    qsort(dir->ents, dir->count, sizeof(struct dirname_t), cmp_dirname);
+
+    dir->dev = sb.st_dev;
+    dir->ino = sb.st_ino;
+    dir->mtime = sb.st_mtim;
+    dir->racy = sb.st_mtim.tv_sec >= time(NULL) - 1;
+    return dir;
+}
+
+/* is_dir - Check if a directory entry (found at path) is a directory */
+bool is_dir(struct dirname_t *ent, const char *path) {
+    if (ent->type == DT_DIR) {
+        return true;
+    }
+    if (ent->type != DT_LNK && ent->type != DT_UNKNOWN) {
+        return false;
+    }
+    struct stat sb;
+    return stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/* cmp_dirname - qsort comparison of directory entries by name */
+int cmp_dirname(const void *a, const void *b) {
+    return strcmp(((const struct dirname_t *) a)->name, ((const struct dirname_t *) b)->name);
+}
+
+/* trim_dircache - Forget every listing once more directories than DIRCACHE are cached */
+void trim_dircache() {
+    if (dircache.count <= DIRCACHE) {
+        return;
+    }
+    for (int i = 0; i < DIRCACHE; i++) {
+        while (dircache.buckets[i] != NULL) {
+            struct dircache_t *dir = dircache.buckets[i];
+            dircache.buckets[i] = dir->next;
+            free(dir->path);
+            free(dir->ents);
+            free(dir->names);
+            free(dir);
+        }
+    }
+    dircache.count = 0;
+}
+
+/*****************
+ * End of expansion functions
+ * ****************/
+
+/*****************
+ * Parallel functions
+ * ****************/
+
+/*
+ * do_parallel - Execute the builtin parallel command
+ *
+ *     parallel [-j N] command [arg ...] ::: input ...
+ *
+ * Runs command once for each input, with {} in its arguments replaced
+ * by the input (or the input added as the last argument if there is no
+ * {}). At most N commands run at once, N being the number of online
+ * CPUs by default. Each command is an ordinary background job, and the
+ * next input is started as soon as reap_children reaps one of them.
+ * A command that stops (such as one reading the terminal) is killed and
+ * counted as failed, so it cannot hold up the others. ctrl-c stops
+ * starting new commands and interrupts the running ones.
+ */
+void do_parallel(char **argv) {
+    /* Parse -j N */
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (argv[i] != NULL && strcmp(argv[i], "-j") == 0) {
+        if (argv[i + 1] == NULL || !isnum(argv[i + 1]) || atoi(argv[i + 1]) < 1) {
+            user_error("parallel: -j needs a positive number.");
+            return;
+        }
+        n = atoi(argv[i + 1]);
+        i += 2;
+    }
+    if (n < 1) {
+        n = 1;
+    }
+
+    /* Split the command from the inputs */
+    const int first = i;
+    char **inputs = NULL;
+    for (; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], ":::") == 0) {
+            inputs = &argv[i + 1];
+            break;
+        }
+    }
+    const int ncmd = i - first;
+    if (ncmd == 0 || inputs == NULL) {
+        user_error("usage: parallel [-j N] command [arg ...] ::: input ...");
+        return;
+    }
+
+    /* launch_parallel adds the input and a NULL to the command's words */
+    if (ncmd > MAXARGS - 2) {
+        user_error("parallel: Command too long.");
+        return;
+    }
+
+    /* The command is copied out rather than ended in argv, which expand_argv may have built and frees word by word */
+    char *cmd[MAXARGS];
+    memcpy(cmd, &argv[first], ncmd * sizeof(char *));
+    cmd[ncmd] = NULL;
+
+    parallel.active = true;
+    parallel.interrupted = false;
+    parallel.running = 0;
+    parallel.failed = 0;
+
+    int tried = 0;
+    for (int k = 0; inputs[k] != NULL; k++) {
+        /* Wait for a free worker */
+        while (parallel.running >= n && !parallel.interrupted) {
+            wait_for_signal();
+        }
+        if (parallel.interrupted) {
+            break;
+        }
+        tried++;
+        if (!launch_parallel(cmd, inputs[k])) {
+            parallel.failed++;
+        }
+    }
+
+    /* Wait for the last commands to finish (after ctrl-c, the ones still running are left as background jobs) */
+    while (parallel.running > 0 && !parallel.interrupted) {
+        wait_for_signal();
+    }
+    for (int jid = 1; parallel.running > 0 && jid < nextjid; jid++) {
+        struct job_t *job = jobs.byjid[jid];
+        if (job != NULL && job->in_parallel) {
+            job->in_parallel = false;
+            parallel.running--;
+        }
+    }
+    parallel.active = false;
+
+    if (parallel.failed > 0) {
+        sprintf(sbuf, "parallel: %d of %d commands failed.", parallel.failed, tried);
+        user_error(sbuf);
+    }
+    if (parallel.interrupted) {
+        last_status = 128 + SIGINT;
+    }
+}
+
+/* launch_parallel - Start command for one input as a background job, false if it could not be started */
+bool launch_parallel(char **cmd, char *input) {
+    char *argv[MAXARGS];
+    char args[MAXLINE];         /* the arguments that had {} replaced */
+    char cmdline[MAXLINE];
+    size_t used = 0;
+    bool replaced = false;
+
+    int argc = 0;
+    for (; cmd[argc] != NULL; argc++) {
+        if (strstr(cmd[argc], "{}") == NULL) {
+            argv[argc] = cmd[argc];
+            continue;
+        }
+
+        /* Copy the argument with every {} replaced by the input */
+        argv[argc] = args + used;
+        for (const char *c = cmd[argc]; *c && used < MAXLINE - 1; c++) {
+            if (c[0] == '{' && c[1] == '}') {
+                size_t len = strlen(input);
+                if (used + len >= MAXLINE - 1) {
+                    len = MAXLINE - 1 - used;
+                }
+                memcpy(args + used, input, len);
+                used += len;
+                c++;
+            } else {
+                args[used++] = *c;
+            }
+        }
+        args[used++] = '\0';
+        replaced = true;
+        if (used >= MAXLINE) {
+            user_error("parallel: Command too long.");
+            return false;
+        }
+    }
+    if (!replaced) {
+        argv[argc++] = input;
+    }
+    argv[argc] = NULL;
+
+    /* The command line shown by jobs */
+    size_t len = 0;
+    cmdline[0] = '\0';
+    for (int k = 0; argv[k] != NULL && len < MAXLINE - 1; k++) {
+        len += snprintf(cmdline + len, MAXLINE - len, (k == 0) ? "%s" : " %s", argv[k]);
+    }
+
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    fflush(stdout);
+    char **envp = env_array(&vars);
+    if (envp == NULL) {
+        reset_state_error("Could not build the environment.");
+        return false;
+    }
+    char *cgroup;
+    if (!open_job_cgroup(&cgroup)) {
+        return false;
+    }
+    pid_t pid = launch_cmd(argv, envp, NULL, NULL, 0, 0, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, &child_mask);
+    close_job_cgroup(cgroup, pid > 0);
+    if (pid <= 0) {
+        return false;
+    }
+
+    if (!addjob(&jobs, &pid, 1, BG, cmdline)) {
+        remove_job_cgroup(cgroup);
+        return false;
+    }
+    getjobpid(&jobs, pid)->in_parallel = true;
+    getjobpid(&jobs, pid)->cgroup = cgroup;
+    parallel.running++;
+
+    struct stat_t stat;
+    get_stat(&stat, pid, pid, argv[0], BG);
+    add_stat(&stats, &stat);
+    return true;
+}
+
+/* interrupt_parallel - Stop the running parallel command after ctrl-c */
+void interrupt_parallel() {
+    parallel.interrupted = true;
+    for (int jid = 1; jid < nextjid; jid++) {
+        struct job_t *job = jobs.byjid[jid];
+        if (job != NULL && job->in_parallel) {
+            kill(-job->pid, SIGINT);
+        }
+    }
+}
+
+/*****************
+ * End of parallel functions
+ * ****************/
+
+/*****************
+ * Tracing functions
+ *****************/
+
+/*
+ * With -T (or TSH_TRACE) the shell times each of its stages (see the
+ * TRACE_ constants) with the monotonic clock and counts the times in a
+ * latency histogram per stage. The buckets are log-linear like those
+ * of HdrHistogram: HISTSUB buckets for each power of two, so a
+ * percentile is within about 6% of the real time whatever its size, in
+ * a fixed 8KB per stage. The histograms are printed by the stats
+ * command and when the shell quits. When TSH_TRACE names a file, each
+ * stage is also written to it as a Chrome trace event, which
+ * chrome://tracing and Perfetto can open. With tracing off each stage
+ * only costs a test of trace.on.
+ */
+
+/* init_trace - Start timing the stages, writing the events to events_path if it is not NULL */
+void init_trace(const char *events_path) {
+    trace.on = true;
+    trace.pid = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &trace.epoch);
+    if (events_path == NULL || *events_path == '\0') {
+        return;
+    }
+
+    if ((trace.events = fopen(events_path, "we")) == NULL) {
+        sprintf(sbuf, "Could not open trace file %.100s.", events_path);
+        reset_state_error(sbuf);
+        return;
+    }
+    fprintf(trace.events, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tsh\"}}", trace.pid);
+}
+
+/* close_trace - Print the histograms and finish the trace events when the shell exits */
+void close_trace() {
+    if (!trace.on) {
+        return;
+    }
+    print_trace();
+    if (trace.events != NULL) {
+        fputs("\n]\n", trace.events);
+        fclose(trace.events);
+        trace.events = NULL;
+    }
+    trace.on = false;
+}
+
+/* trace_start - Note when a stage starts */
+void trace_start(struct timespec *start) {
+    if (trace.on) {
+        clock_gettime(CLOCK_MONOTONIC, start);
+    }
+}
+
+/* trace_end - Record a stage that started at start and has just ended */
+void trace_end(int stage, struct timespec *start) {
+    if (!trace.on) {
+        return;
+    }
+    unsigned long long ns = record_latency(stage, start);
+    if (trace.events != NULL) {
+        trace_event(trace_names[stage], start, ns, trace.pid, NULL);
+    }
+}
+
+/* trace_job - Record a job whose last stage has just been reaped (its events are on a thread of their own) */
+void trace_job(struct job_t *job) {
+    if (!trace.on) {
+        return;
+    }
+    unsigned long long ns = record_latency(TRACE_JOB, &job->start);
+    if (trace.events != NULL) {
+        trace_event(trace_names[TRACE_JOB], &job->start, ns, job->pid, job->cmdline);
+    }
+}
+
+/* record_latency - Count the time since start in the histogram of a stage and return it (ns) */
+unsigned long long record_latency(int stage, struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+    unsigned long long ns = (elapsed > 0) ? elapsed : 0;
+
+    struct latency_t *lat = &trace.stages[stage];
+    lat->count++;
+    lat->sum += ns;
+    if (ns > lat->max) {
+        lat->max = ns;
+    }
+    lat->buckets[latency_bucket(ns)]++;
+    return ns;
+}
+
+/* trace_event - Write a Chrome trace event of a stage, with the command of a job if cmd is not NULL */
+void trace_event(const char *name, struct timespec *start, unsigned long long ns, pid_t tid, const char *cmd) {
+    long long ts = (start->tv_sec - trace.epoch.tv_sec) * 1000000000LL + (start->tv_nsec - trace.epoch.tv_nsec);
+    fprintf(trace.events, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+        name, ts / 1e3, ns / 1e3, trace.pid, tid);
+    if (cmd != NULL) {
+        fputs(",\"args\":{\"cmd\":\"", trace.events);
+        for (const unsigned char *c = (const unsigned char *) cmd; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                fprintf(trace.events, "\\%c", *c);
+            } else if (*c < 0x20) {
+                fprintf(trace.events, "\\u%04x", *c);
+            } else {
+                fputc(*c, trace.events);
+            }
+        }
+        fputs("\"}", trace.events);
+    }
+    fputc('}', trace.events);
+}
+
+/*
+ * latency_bucket - Find the bucket of a time (ns) in a latency histogram
+ *
+ * Times below HISTSUB have a bucket each. Above that a time in
+ * [2^e, 2^(e+1)) goes in one of the HISTSUB buckets that split that
+ * range evenly, picked by the bits after its top one.
+ */
+static int latency_bucket(unsigned long long ns) {
+    if (ns < HISTSUB) {
+        return (int) ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    return (e - 3) * HISTSUB + (int) ((ns >> (e - 4)) - HISTSUB);
+}
+
+/* latency_percentile - The time (ns) that a fraction p of the times in a histogram are at most */
+unsigned long long latency_percentile(struct latency_t *lat, double p) {
+    unsigned long rank = (unsigned long) (p * lat->count);
+    if (rank < p * lat->count || rank == 0) {
+        rank++;
+    }
+
+    unsigned long seen = 0;
+    for (int i = 0; i < 64 * HISTSUB; i++) {
+        seen += lat->buckets[i];
+        if (seen >= rank) {
+            /* The highest time that goes in the bucket */
+            unsigned long long high = i;
+            if (i >= HISTSUB) {
+                int e = i / HISTSUB + 3;
+                high = ((unsigned long long) (i % HISTSUB + HISTSUB + 1) << (e - 4)) - 1;
+            }
+            return (high < lat->max) ? high : lat->max;
+        }
+    }
+    return lat->max;
+}
+
+/* format_ns - Write a time (ns) to buf (at least 16 bytes) in the unit that suits it */
+char *format_ns(char *buf, unsigned long long ns) {
+    if (ns < 1000) {
+        sprintf(buf, "%lluns", ns);
+    } else if (ns < 1000000) {
+        sprintf(buf, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        sprintf(buf, "%.2fms", ns / 1e6);
+    } else {
+        sprintf(buf, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+/* print_trace - Print the count, mean, percentiles and maximum of each stage that has been timed */
+void print_trace() {
+    char mean[16], p50[16], p90[16], p99[16], max[16];
+    printf("%-8s %8s %9s %9s %9s %9s %9s\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < NTRACE; i++) {
+        struct latency_t *lat = &trace.stages[i];
+        if (lat->count == 0) {
+            continue;
+        }
+        printf("%-8s %8lu %9s %9s %9s %9s %9s\n", trace_names[i], lat->count,
+            format_ns(mean, lat->sum / lat->count),
+            format_ns(p50, latency_percentile(lat, 0.5)),
+            format_ns(p90, latency_percentile(lat, 0.9)),
+            format_ns(p99, latency_percentile(lat, 0.99)),
+            format_ns(max, lat->max));
+    }
+}
+
+/*
+ * do_stats - Execute the builtin stats command
+ *
+ *     stats      print the latency histogram of each stage
+ *     stats -r   empty the histograms
+ */
+void do_stats(char **argv) {
+    if (!trace.on) {
+        user_error("stats: tracing is off (start the shell with -T or set TSH_TRACE).");
+    } else if (argv[1] == NULL) {
+        print_trace();
+    } else if (strcmp(argv[1], "-r") == 0 && argv[2] == NULL) {
+        memset(trace.stages, 0, sizeof(trace.stages));
+    } else {
+        user_error("Usage: stats [-r]");
+    }
+}
+
+/*****************
+ * End of tracing functions
+ *****************/
+
+/*****************
+ * Resource accounting functions
+ *****************/
+
+/* elapsed_since - Seconds of wall time since start (CLOCK_MONOTONIC) */
+double elapsed_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* add_usage - Add the resources in usage to sum (max RSS is the largest of the two) */
+void add_usage(struct rusage *sum, struct rusage *usage) {
+    timeradd(&sum->ru_utime, &usage->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &usage->ru_stime, &sum->ru_stime);
+    if (usage->ru_maxrss > sum->ru_maxrss) {
+        sum->ru_maxrss = usage->ru_maxrss;
+    }
+    sum->ru_minflt += usage->ru_minflt;
+    sum->ru_majflt += usage->ru_majflt;
+}
+
+/* print_usage - Print the wall time and resources used by a job */
+void print_usage(double real, struct rusage *usage) {
+    printf("real\t%.3fs\n", real);
+    printf("user\t%ld.%03lds\n", (long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec / 1000);
+    printf("sys\t%ld.%03lds\n", (long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec / 1000);
+    printf("maxrss\t%ldKB\n", usage->ru_maxrss);
+    printf("faults\t%ld minor, %ld major\n", usage->ru_minflt, usage->ru_majflt);
+}
+
+/*
+ * time_builtin - Run a built-in command under time
+ *
+ * Built-in commands run inside the shell, so the resources they use are
+ * the difference in the shell's own usage plus that of the children it
+ * reaped meanwhile (for parallel).
+ */
+void time_builtin(char **argv) {
+    struct timespec start;
+    struct rusage before, before_children, after, after_children;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+    getrusage(RUSAGE_CHILDREN, &before_children);
+
+    exec_builtin(argv);
+
+    getrusage(RUSAGE_SELF, &after);
+    getrusage(RUSAGE_CHILDREN, &after_children);
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    after.ru_minflt -= before.ru_minflt;
+    after.ru_majflt -= before.ru_majflt;
+    timersub(&after_children.ru_utime, &before_children.ru_utime, &after_children.ru_utime);
+    timersub(&after_children.ru_stime, &before_children.ru_stime, &after_children.ru_stime);
+    after_children.ru_minflt -= before_children.ru_minflt;
+    after_children.ru_majflt -= before_children.ru_majflt;
+    add_usage(&after, &after_children);
+    print_usage(elapsed_since(&start), &after);
+}
+
+/*****************
+ * End of resource accounting functions
+ *****************/
+
+/*****************
+ * Simple built-in functions
+ * ****************/
+
+/*
+ * The commands most scripts are made of run in the shell itself, so
+ * they cost no process. Like the other built-in commands they can be
+ * redirected (see redirect_shell). The ones that have an exit status
+ * leave it in last_status.
+ */
+
+/*
+ * do_cd - Execute the builtin cd command
+ *
+ *     cd [dir | -]
+ *
+ * With no dir it goes to HOME, and with - to OLDPWD. PWD and OLDPWD
+ * are set afterwards.
+ */
+void do_cd(char **argv) {
+    const char *dir = argv[1];
+    if (dir == NULL || strcmp(dir, "-") == 0) {
+        const char *name = (dir == NULL) ? "HOME" : "OLDPWD";
+        if ((dir = get_var(name)) == NULL) {
+            sprintf(sbuf, "cd: %s not set", name);
+            user_error(sbuf);
+            last_status = 1;
+            return;
+        }
+    }
+
+    char old[PATH_MAX];
+    if (getcwd(old, sizeof(old)) == NULL) {
+        old[0] = '\0';
+    }
+    if (chdir(dir) < 0) {
+        sprintf(sbuf, "cd: %.100s: %s", dir, strerror(errno));
+        user_error(sbuf);
+        last_status = 1;
+        return;
+    }
+
+    char cwd[PATH_MAX];
+    if (argv[1] != NULL && strcmp(argv[1], "-") == 0 && getcwd(cwd, sizeof(cwd)) != NULL) {
+        printf("%s\n", cwd);
+    }
+    if (!set_var(&vars, "OLDPWD", 6, old, false) ||
+        (getcwd(cwd, sizeof(cwd)) != NULL && !set_var(&vars, "PWD", 3, cwd, false))) {
+        reset_state_error("Could not set variable.");
+    }
+    last_status = 0;
+}
+
+/* do_pwd - Execute the builtin pwd command */
+void do_pwd(char **argv) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        sprintf(sbuf, "pwd: %s", strerror(errno));
+        user_error(sbuf);
+        last_status = 1;
+        return;
+    }
+    printf("%s\n", cwd);
+    last_status = 0;
+}
+
+/* do_echo - Execute the builtin echo command (echo [-n] [arg ...]) */
+void do_echo(char **argv) {
+    int i = 1;
+    const bool newline = (argv[1] == NULL || strcmp(argv[1], "-n") != 0);
+    if (!newline) {
+        i++;
+    }
+    for (; argv[i] != NULL; i++) {
+        fputs(argv[i], stdout);
+        if (argv[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    last_status = 0;
+}
+
+/*
+ * do_printf - Execute the builtin printf command
+ *
+ *     printf format [arg ...]
+ *
+ * The format takes the conversions %s, %c, %d, %i, %u, %x, %X, %o and
+ * %%, with flags, a width and a precision, and the escapes \n, \t, \r,
+ * \a, \b, \f, \v and \\. The format is used again while arguments are
+ * left, and missing arguments are taken as empty strings (or 0).
+ */
+void do_printf(char **argv) {
+    if (argv[1] == NULL) {
+        user_error("Usage: printf format [arg ...]");
+        last_status = 1;
+        return;
+    }
+
+    char **args = argv + 2;
+    char **start;
+    do {
+        start = args;
+        for (const char *c = argv[1]; *c; c++) {
+            if (*c == '\\') {
+                c = print_escape(c);
+                continue;
+            }
+            if (*c != '%') {
+                putchar(*c);
+                continue;
+            }
+            if (c[1] == '%') {
+                putchar('%');
+                c++;
+                continue;
+            }
+
+            /* Copy the flags, width and precision of the conversion */
+            char spec[32];
+            size_t n = 0;
+            const char *p = c + 1;
+            spec[n++] = '%';
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 8) {
+                spec[n++] = *p++;
+            }
+            while (isdigit((unsigned char) *p) && n < 16) {
+                spec[n++] = *p++;
+            }
+            if (*p == '.') {
+                spec[n++] = *p++;
+                while (isdigit((unsigned char) *p) && n < 24) {
+                    spec[n++] = *p++;
+                }
+            }
+
+            const char *arg = (*args != NULL) ? *args++ : "";
+            if (*p == 's' || *p == 'c') {
+                char one[2] = {arg[0], '\0'};
+                strcpy(spec + n, "s");
+                printf(spec, (*p == 's') ? arg : one);
+            } else if (*p == 'd' || *p == 'i') {
+                strcpy(spec + n, "lld");
+                printf(spec, strtoll(arg, NULL, 0));
+            } else if (*p != '\0' && strchr("uxXo", *p) != NULL) {
+                sprintf(spec + n, "ll%c", *p);
+                printf(spec, strtoull(arg, NULL, 0));
+            } else {
+                sprintf(sbuf, "printf: %%%c: invalid conversion", (*p != '\0') ? *p : ' ');
+                user_error(sbuf);
+                last_status = 1;
+                return;
+            }
+            c = p;
+        }
+    } while (*args != NULL && args != start);
+    last_status = 0;
+}
+
+/* print_escape - Print the backslash escape at c, and return its last character */
+const char *print_escape(const char *c) {
+    const char *from = "ntrabfv\\";
+    const char *to = "\n\t\r\a\b\f\v\\";
+    const char *e = (c[1] != '\0') ? strchr(from, c[1]) : NULL;
+    if (e == NULL) {
+        putchar('\\');
+        return c;
+    }
+    putchar(to[e - from]);
+    return c + 1;
+}
+
+/*
+ * do_test - Execute the builtin test and [ commands
+ *
+ * The expression is a string (true if it is not empty), ! expression,
+ * -n, -z, -e, -f, -d, -r, -w, -x or -s followed by a string or file, or
+ * two strings or integers compared with =, !=, -eq, -ne, -lt, -le, -gt
+ * or -ge. The status is 0 if it is true, 1 if it is false and 2 if it
+ * is not a valid expression.
+ */
+void do_test(char **argv) {
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            user_error("[: missing ]");
+            last_status = 2;
+            return;
+        }
+        argc--;
+    }
+    last_status = test_expr(argv + 1, argc - 1);
+}
+
+/* test_expr - Evaluate the n words of a test expression (0 true, 1 false, 2 not valid) */
+int test_expr(char **args, int n) {
+    if (n > 0 && strcmp(args[0], "!") == 0) {
+        int status = test_expr(args + 1, n - 1);
+        return (status == 2) ? 2 : !status;
+    }
+
+    if (n == 0) {
+        return 1;
+    }
+    if (n == 1) {
+        return args[0][0] == '\0';
+    }
+
+    if (n == 2) {
+        const char *op = args[0];
+        struct stat sb;
+        if (strcmp(op, "-n") == 0) {
+            return args[1][0] == '\0';
+        } else if (strcmp(op, "-z") == 0) {
+            return args[1][0] != '\0';
+        } else if (strcmp(op, "-r") == 0 || strcmp(op, "-w") == 0 || strcmp(op, "-x") == 0) {
+            int mode = (op[1] == 'r') ? R_OK : (op[1] == 'w') ? W_OK : X_OK;
+            return access(args[1], mode) != 0;
+        } else if (strcmp(op, "-e") == 0 || strcmp(op, "-f") == 0 || strcmp(op, "-d") == 0 || strcmp(op, "-s") == 0) {
+            if (stat(args[1], &sb) < 0) {
+                return 1;
+            }
+            return !((op[1] == 'e') || (op[1] == 'f' && S_ISREG(sb.st_mode)) ||
+                (op[1] == 'd' && S_ISDIR(sb.st_mode)) || (op[1] == 's' && sb.st_size > 0));
+        }
+        sprintf(sbuf, "test: %.100s: unary operator expected", op);
+        user_error(sbuf);
+        return 2;
+    }
+
+    if (n == 3) {
+        const char *op = args[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+            return strcmp(args[0], args[2]) != 0;
+        } else if (strcmp(op, "!=") == 0) {
+            return strcmp(args[0], args[2]) == 0;
+        }
+
+        const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(op, ops[i]) != 0) {
+                continue;
+            }
+            long long a, b;
+            if (!test_int(args[0], &a) || !test_int(args[2], &b)) {
+                return 2;
+            }
+            const bool result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+            return !result[i];
+        }
+        sprintf(sbuf, "test: %.100s: binary operator expected", op);
+        user_error(sbuf);
+        return 2;
+    }
+
+    user_error("test: too many arguments");
+    return 2;
+}
+
+/* test_int - Parse an integer for test, reporting it if it is not one */
+bool test_int(const char *str, long long *n) {
+    char *end;
+    errno = 0;
+    *n = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0) {
+        sprintf(sbuf, "test: %.100s: integer expression expected", str);
+        user_error(sbuf);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * do_sleep - Execute the builtin sleep command (sleep seconds)
+ *
+ * The seconds may have a fraction. The shell keeps reaping children
+ * while it sleeps, and ctrl-c ends the sleep.
+ */
+void do_sleep(char **argv) {
+    char *end;
+    const double seconds = (argv[1] != NULL) ? strtod(argv[1], &end) : -1;
+    if (argv[1] == NULL || end == argv[1] || *end != '\0' || seconds < 0) {
+        user_error("Usage: sleep seconds");
+        last_status = 1;
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last_status = sleep_shell(&start, seconds) ? 0 : 130;
+}
+
+/*****************
+ * End of simple built-in functions
+ * ****************/
+
+/*****************
+ * Process view functions
+ * ****************/
+
+/*
+ * ps and top read the job table and the stat table directly, so they
+ * neither fork nor read any proc/PID/status file. top adds the CPU time
+ * and resident size of each process, read from /proc/<pid>/stat with
+ * one pread per process per refresh (the file is kept open in the stat
+ * table entry while top runs).
+ */
+
+/*
+ * do_ps - Execute the builtin ps command
+ *
+ * Lists the shell and every process of every job, from the stat table.
+ */
+void do_ps(char **argv) {
+    printf("%5s %7s %7s %-4s %-12s %8s %s\n", "JID", "PID", "PGID", "STAT", "USER", "START", "COMMAND");
+
+    struct proc_t *shell = find_stat(&stats, getpid());
+    for (int jid = 0; jid < nextjid; jid++) {
+        struct job_t *job = (jid == 0) ? NULL : jobs.byjid[jid];
+        if (jid > 0 && job == NULL) {
+            continue;
+        }
+
+        const int npids = (job == NULL) ? 1 : job->npids;
+        for (int i = 0; i < npids; i++) {
+            struct proc_t *proc = (job == NULL) ? shell : find_stat(&stats, job->pids[i]);
+            if (proc == NULL || !proc->live) {
+                continue;
+            }
+
+            char start[16];
+            strftime(start, sizeof(start), "%H:%M:%S", localtime(&proc->stat.start.tv_sec));
+            sprintf(sbuf, "%d", jid);
+            printf("%5s %7d %7d %-4s %-12s %8s %s\n", (job == NULL) ? "" : sbuf, proc->stat.pid,
+                proc->stat.pgid, proc->stat.state, proc->stat.uname, start, proc->stat.name);
+        }
+    }
+}
+
+/*
+ * do_top - Execute the builtin top command
+ *
+ *     top [-d seconds] [-n count]
+ *
+ * Shows the CPU use, resident size and elapsed time of every job every
+ * -d seconds (1 by default), count times or until ctrl-c is typed or no
+ * jobs are left.
+ */
+void do_top(char **argv) {
+    double interval = 1;
+    int count = -1;
+    for (int i = 1; argv[i] != NULL; i += 2) {
+        if (strcmp(argv[i], "-d") == 0 && argv[i + 1] != NULL && atof(argv[i + 1]) > 0) {
+            interval = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-n") == 0 && argv[i + 1] != NULL && isnum(argv[i + 1]) && atoi(argv[i + 1]) > 0) {
+            count = atoi(argv[i + 1]);
+        } else {
+            user_error("Usage: top [-d seconds] [-n count]");
+            return;
+        }
+    }
+
+    /* The first refresh shows the CPU use since each process started */
+    for (int jid = 1; jid < nextjid; jid++) {
+        struct job_t *job = jobs.byjid[jid];
+        for (int i = 0; job != NULL && i < job->npids; i++) {
+            struct proc_t *proc = find_stat(&stats, job->pids[i]);
+            if (proc != NULL) {
+                proc->ticks = 0;
+                proc->sampled = false;
+            }
+        }
+    }
+
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    print_top(-1);
+
+    while (count != 1 && are_open_jobs(&jobs)) {
+        /* Reap children and watch for ctrl-c until the next refresh */
+        if (!sleep_shell(&last, interval)) {
+            break;
+        }
+        print_top(elapsed_since(&last));
+        clock_gettime(CLOCK_MONOTONIC, &last);
+        if (count > 0) {
+            count--;
+        }
+    }
+
+    close_samples();
+}
+
+/*
+ * print_top - Print one refresh of top
+ *
+ * The CPU use is over the last interval seconds, or over the life of a
+ * process the first time it is sampled.
+ */
+void print_top(double interval) {
+    static long clk_tck;
+    static long page_kb;
+    if (clk_tck == 0) {
+        clk_tck = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    }
+
+    /* Redraw in place on a terminal, and print one block after another otherwise */
+    if (isatty(STDOUT_FILENO)) {
+        printf("\033[H\033[J");
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now.tv_sec));
+    printf("top - %s, %d jobs, %d processes\n", clock, jobs.count, jobs.npids);
+    printf("%5s %7s %-8s %6s %10s %10s %s\n", "JID", "PGID", "STATE", "%CPU", "RSS", "ELAPSED", "COMMAND");
+
+    for (int jid = 1; jid < nextjid; jid++) {
+        struct job_t *job = jobs.byjid[jid];
+        if (job == NULL) {
+            continue;
+        }
+
+        /*
+         * Add up the processes of the job that are still running. A
+         * process seen for the first time is measured over its lifetime
+         * and the others over the interval, so an idle stage does not
+         * change how the busy ones are measured.
+         */
+        double cpu = 0;
+        long rss = 0;
+        const double elapsed = elapsed_since(&job->start);
+        for (int i = 0; i < job->npids; i++) {
+            struct proc_t *proc = (job->pids[i] != 0) ? find_stat(&stats, job->pids[i]) : NULL;
+            unsigned long ticks;
+            long pages;
+            if (proc == NULL || !proc->live || !sample_proc(proc, &ticks, &pages)) {
+                continue;
+            }
+            const double seconds = (proc->sampled && interval > 0) ? interval : elapsed;
+            if (seconds > 0) {
+                cpu += 100.0 * (ticks - proc->ticks) / clk_tck / seconds;
+            }
+            proc->ticks = ticks;
+            proc->sampled = true;
+            rss += pages * page_kb;
+        }
+
+        sprintf(sbuf, "%ldKB", rss);
+        char clock_buf[32];
+        sprintf(clock_buf, "%d:%04.1f", (int) elapsed / 60, elapsed - 60 * ((int) elapsed / 60));
+        printf("%5d %7d %-8s %6.1f %10s %10s %s\n", job->jid, job->pid,
+            (job->state == ST) ? "Stopped" : "Running", cpu, sbuf, clock_buf, job->cmdline);
+    }
+    fflush(stdout);
+}
+
+/*
+ * sample_proc - Read the CPU time and resident pages of a process
+ *
+ * /proc/<pid>/stat is opened the first time and then read again with
+ * a single pread. The command name in it is in parentheses and may
+ * contain spaces, so the fields are read from after the last ).
+ */
+bool sample_proc(struct proc_t *proc, unsigned long *ticks, long *rss) {
+    if (proc->stat_fd < 0) {
+        char path[64];
+        sprintf(path, "/proc/%d/stat", proc->stat.pid);
+        if ((proc->stat_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            return false;
+        }
+    }
+
+    char buf[1024];
+    ssize_t n = pread(proc->stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return false;
+    }
+    buf[n] = '\0';
+
+    char *fields = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+        "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, rss) != 3) {
+        return false;
+    }
+    *ticks = utime + stime;
+    return true;
+}
+
+/* close_samples - Close the /proc/<pid>/stat files top opened */
+void close_samples() {
+    for (int i = 0; i < stats.nbuckets; i++) {
+        for (struct proc_t *proc = stats.buckets[i]; proc != NULL; proc = proc->next) {
+            if (proc->stat_fd >= 0) {
+                close(proc->stat_fd);
+                proc->stat_fd = -1;
+            }
+        }
+    }
+}
+
+/*****************
+ * End of process view functions
+ * ****************/
+
+/*****************
+ * State manipulation functions
+ * ****************/
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv) {
+    int pid_or_jid = atoi(argv[1]);
+    struct job_t *job_to_modify; 
+    /* Determine whether it is a jid or pid */
+    /* Since jids are small and are handed out from 1 up */
+    /* we check if there is a valid pid to jid conversion */
+    int jid = pid2jid(pid_or_jid);
+    if (jid == 0) {
+        /* It is a pid */
+        job_to_modify = getjobpid(&jobs, pid_or_jid);
+    } else {
+        /* It is a jid */
+        job_to_modify = getjobjid(&jobs, jid);
+    }
+    pid_or_jid = (jid == 0) ? pid_or_jid : jid;
+
+    /* Check if the job exists */
+    if (job_to_modify == NULL) {
+        sprintf(sbuf, "Job (%%%d) does not exist.", pid_or_jid);
+        user_error(sbuf);
+        return;
+    }
+
+    /* 
+    * Jobs states: FG (foreground), BG (background), ST (stopped)
+    * Job state transitions and enabling actions:
+    *     FG -> ST  : ctrl-z
+    *     ST -> FG  : fg command
+    *     ST -> BG  : bg command
+    *     BG -> FG  : fg command
+    * At most 1 job can be in the FG state.
+    */
+
+    /* Check if the job is in the foreground */
+    if (job_to_modify->state == FG) {
+        /* If the job is in the background, the user must first stop the job */
+        if (strcmp(argv[0], "bg") == 0) {
+            sprintf(sbuf, "Job (%%%d) must be stopped before moving it to the background.", pid_or_jid);
+            user_error(sbuf);
+            return;
+        } else {
+            /* If the job is in the foreground, we can't change it */
+            sprintf(sbuf, "Job (%%%d) is already in the foreground.", pid_or_jid);
+            user_error(sbuf);
+            return;
+        }
+        return;
+    }
+
+    /* Check if the job is in the background */
+    if (job_to_modify->state == BG) {
+        if (strcmp(argv[0], "bg") == 0) {
+            /* If the job is in the background and the user wants to put it in the background, we can't change it */
+            sprintf(sbuf, "Job (%%%d) is already in the background.", pid_or_jid);
+            user_error(sbuf);
+            return;
+        } else {
+            /* User want to move a job from the background to the foreground */
+            setjobstate(&jobs, job_to_modify, FG);
+            
+            /* Edit the proc file */
+            edit_job_stats(&stats, job_to_modify, "R+");
+
+            /* Wait for the job to finish */
+            // waitfg(job_to_modify->pid);
+            return;
+        }
+    }
+
+    /* Check if the job is stopped */
+    if (job_to_modify->state == ST) {
+        if (strcmp(argv[0], "bg") == 0) {
+            /* User want to move a job from stopped to the foreground */
+            setjobstate(&jobs, job_to_modify, BG);
+            
+            // Edit the proc file
+            edit_job_stats(&stats, job_to_modify, "R");
+
+            /* Send the job a SIGCONT signal to wake it up */
+            kill(-job_to_modify->pid, SIGCONT);
+            
+            return;
+        } else {
+            /* User want to move a job from stopped to the foreground */
+            setjobstate(&jobs, job_to_modify, FG);
+            
+            /* Edit the proc file */
+            edit_job_stats(&stats, job_to_modify, "R+");
+
+
+            /* Send the job a SIGCONT signal to wake it up */
+            kill(-job_to_modify->pid, SIGCONT);
+
+            /* Wait for the job to finish */
+            // waitfg(job_to_modify->pid);
+            return;
+        }
+    }
+}
+
+/* 
+ * waitfg - Block until the job in process group pgid is no longer the foreground job
+ *
+ * The job leaves the foreground when reap_children sees it exit or stop.
+ */
+void waitfg(pid_t pgid) {
+    struct timespec start;
+    trace_start(&start);
+    while (fgpid(&jobs) == pgid) {
+        wait_for_signal();
+    }
+    trace_end(TRACE_WAIT, &start);
+}
+
+/* bg_to_state - Convert bg indicator flag to BG/FG state code */
+int bg_to_state(int bg) {
+    int process_state;
+    if (bg) {
+        process_state = BG;
+    } else {
+        process_state = FG;
+    }
+    return process_state;
+}
+
+/*****************
+ * End of State manipulation functions
+ * ****************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline = NULL;
+    job->npids = 0;
+    job->nalive = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->status = 0;
+    job->timed = false;
+    job->in_parallel = false;
+    job->cgroup = NULL;
+    job->client = -1;
+    job->capture = NULL;
+}
+
+/*
+ * The job table grows as needed and never scans for a job:
+ *     byjid  - jids are handed out from 1 up, so a job is found by
+ *              indexing this array with its jid
+ *     bypid  - a hash table from pid to job (linear probing); every
+ *              stage of a pipeline has its own entry
+ *     fg     - the foreground job, kept up to date by setjobstate
+ *
+ * Records go back on a free list when a job is deleted and keep their
+ * pids array for the next job; only the job's own copy of its command
+ * line is freed. All allocation happens in addjob.
+ */
+
+/* are_open_jobs - Check if any jobs are left to be completed */
+bool are_open_jobs(struct jobtable_t *jobs) {
+    return jobs->count > 0;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct jobtable_t *jobs) {
+    jobs->count = 0;
+    jobs->npids = 0;
+    jobs->fg = NULL;
+    jobs->nbg = 0;
+    jobs->free = NULL;
+
+    jobs->jid_cap = MINJOBS + 1; /* jid 0 is never used */
+    jobs->byjid = calloc(jobs->jid_cap, sizeof(struct job_t *));
+
+    jobs->pid_cap = 2 * MINJOBS;
+    jobs->bypid = calloc(jobs->pid_cap, sizeof(struct pidslot_t));
+
+    if (jobs->byjid == NULL || jobs->bypid == NULL) {
+        unix_error("Could not allocate the job table");
+    }
+}
+
+/* growjobs - Make room in the job table for one more job with npids stages */
+bool growjobs(struct jobtable_t *jobs, int npids) {
+    /* Grow the jid index so that nextjid is a valid slot */
+    if (nextjid >= jobs->jid_cap) {
+        int new_cap = 2 * jobs->jid_cap;
+        struct job_t **byjid = realloc(jobs->byjid, new_cap * sizeof(struct job_t *));
+        if (byjid == NULL) {
+            return false;
+        }
+        memset(byjid + jobs->jid_cap, 0, (new_cap - jobs->jid_cap) * sizeof(struct job_t *));
+        jobs->byjid = byjid;
+        jobs->jid_cap = new_cap;
+    }
+
+    /* Keep the pid index at most half full */
+    if (2 * (jobs->npids + npids) > jobs->pid_cap) {
+        struct pidslot_t *old = jobs->bypid;
+        int old_cap = jobs->pid_cap;
+        int new_cap = 2 * old_cap;
+        while (2 * (jobs->npids + npids) > new_cap) {
+            new_cap *= 2;
+        }
+        struct pidslot_t *bypid = calloc(new_cap, sizeof(struct pidslot_t));
+        if (bypid == NULL) {
+            return false;
+        }
+        jobs->bypid = bypid;
+        jobs->pid_cap = new_cap;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].pid != 0) {
+                pidslot_insert(jobs, old[i].pid, old[i].job);
+            }
+        }
+        free(old);
+    }
+
+    /* Refill the free list with a new block of records */
+    if (jobs->free == NULL) {
+        int n = (jobs->count > MINJOBS) ? jobs->count : MINJOBS;
+        struct job_t *block = malloc(n * sizeof(struct job_t));
+        if (block == NULL) {
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            block[i].pids = NULL;
+            block[i].pids_cap = 0;
+            block[i].next = jobs->free;
+            jobs->free = &block[i];
+        }
+    }
+
+    /* Make sure the next record can hold every stage */
+    struct job_t *job = jobs->free;
+    if (job->pids_cap < npids) {
+        pid_t *pids = realloc(job->pids, npids * sizeof(pid_t));
+        if (pids == NULL) {
+            return false;
+        }
+        job->pids = pids;
+        job->pids_cap = npids;
+    }
+    return true;
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct jobtable_t *jobs) {
+    /* deletejob keeps nextjid one past the largest jid in use */
+    return nextjid - 1;
+}
+
+/* addjob - Add a job whose stages have the given pids to the job list */
+int addjob(struct jobtable_t *jobs, pid_t *pids, int npids, int state, char *cmdline) {
+    if (npids < 1 || pids[0] < 1) {
+        return 0;
+    }
+
+    if (nextjid > MAXJID || !growjobs(jobs, npids)) {
+        printf("Tried to create too many jobs\n");
+        return 0;
+    }
+
+    /* Take a record off the free list */
+    struct job_t *job = jobs->free;
+    jobs->free = job->next;
+    clearjob(job);
+
+    job->pid = pids[0];
+    job->jid = nextjid++;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    if ((job->cmdline = strdup(cmdline)) == NULL) {
+        job->next = jobs->free;
+        jobs->free = job;
+        nextjid--;
+        reset_state_error("Could not allocate job command line.");
+        return 0;
+    }
+    for (int i = 0; i < npids; i++) {
+        job->pids[i] = pids[i];
+        pidslot_insert(jobs, pids[i], job);
+    }
+    job->npids = npids;
+    job->nalive = npids;
+    jobs->npids += npids;
+
+    jobs->byjid[job->jid] = job;
+    jobs->count++;
+    setjobstate(jobs, job, state);
+
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* deletejob - Delete the job that has a stage with PID=pid from the job list */
+int deletejob(struct jobtable_t *jobs, pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+    if (job == NULL) {
+        return 0;
+    }
+    removejob(jobs, job);
+    return 1;
+}
+
+/* removejob - Remove a job and the pids of its running stages from the job list */
+void removejob(struct jobtable_t *jobs, struct job_t *job) {
+    for (int i = 0; i < job->npids; i++) {
+        int slot;
+        if (job->pids[i] != 0 && (slot = pidslot_find(jobs, job->pids[i])) >= 0) {
+            pidslot_remove(jobs, slot);
+            jobs->npids--;
+        }
+    }
+
+    if (jobs->fg == job) {
+        jobs->fg = NULL;
+    }
+    if (job->state == BG) {
+        jobs->nbg--;
+    }
+    jobs->byjid[job->jid] = NULL;
+    jobs->count--;
+
+    /* Every process of the job has been reaped, so its cgroup leaf is empty */
+    remove_job_cgroup(job->cgroup);
+    job->cgroup = NULL;
+
+    /* Step nextjid back over the jids freed at the top */
+    while (nextjid > 1 && jobs->byjid[nextjid - 1] == NULL) {
+        nextjid--;
+    }
+
+    free(job->cmdline);
+    free_capture(job->capture);
+    clearjob(job);
+    job->next = jobs->free;
+    jobs->free = job;
+}
+
+/*
+ * stage_exited - Record that the stage of a job with PID=pid has exited
+ *
+ * Returns the number of stages of the job that are still running.
+ */
+int stage_exited(struct jobtable_t *jobs, struct job_t *job, pid_t pid) {
+    for (int i = 0; i < job->npids; i++) {
+        if (job->pids[i] == pid) {
+            int slot = pidslot_find(jobs, pid);
+            if (slot >= 0) {
+                pidslot_remove(jobs, slot);
+                jobs->npids--;
+            }
+            job->pids[i] = 0;
+            job->nalive--;
+            break;
+        }
+    }
+    return job->nalive;
+}
+
+/* setjobstate - Change the state of a job, tracking the foreground job */
+void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state) {
+    if (jobs->fg == job) {
+        jobs->fg = NULL;
+    }
+    if (job->state == BG) {
+        jobs->nbg--;
+    }
+    job->state = state;
+    if (state == FG) {
+        jobs->fg = job;
+    } else if (state == BG) {
+        jobs->nbg++;
+    }
+    if (job->capture != NULL) {
+        echo_capture(job->capture, state == FG);
+    }
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobtable_t *jobs) {
+    return (jobs->fg != NULL) ? jobs->fg->pid : 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid) {
+    if (pid < 1) {
+        return NULL;
+    }
+
+    int slot = pidslot_find(jobs, pid);
+    return (slot < 0) ? NULL : jobs->bypid[slot].job;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobtable_t *jobs, int jid) {
+    if (jid < 1 || jid >= nextjid) {
+        return NULL;
+    }
+
+    return jobs->byjid[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+    return (job != NULL) ? job->jid : 0;
+}
+
+/*
+ * listjobs - Print the job list
+ *
+ * With details (jobs -l) each job is followed by the pids of its running
+ * stages and the resources used so far: the wall time since it started
+ * and the CPU time, max RSS and page faults of the stages that have
+ * already exited.
+ */
+void listjobs(struct jobtable_t *jobs, bool details) {
+    for (int jid = 1; jid < nextjid; jid++) {
+        struct job_t *job = jobs->byjid[jid];
+        if (job != NULL) {
+            printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+            case BG:
+                printf("Running ");
+                break;
+            case FG:
+                printf("Foreground ");
+                break;
+            case ST:
+                printf("Stopped ");
+                break;
+            default:
+                printf("listjobs: Internal error: job[%d].state=%d ",
+                jid, job->state);
+            }
+            printf("%s\n", job->cmdline);
+
+            if (details) {
+                struct rusage *usage = &job->usage;
+                printf("    pids:");
+                for (int i = 0; i < job->npids; i++) {
+                    if (job->pids[i] != 0) {
+                        printf(" %d", job->pids[i]);
+                    }
+                }
+                printf("  real %.3fs user %ld.%03lds sys %ld.%03lds maxrss %ldKB faults %ld/%ld\n",
+                elapsed_since(&job->start),
+                (long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec / 1000,
+                (long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec / 1000,
+                usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt);
+            }
+        }
+    }
+}
+
+/* pid_hash - Home slot of a pid in a pid index with cap slots */
+static unsigned int pid_hash(pid_t pid, int cap) {
+    return ((unsigned int) pid * 2654435761u) & (cap - 1);
+}
+
+/* pidslot_find - Slot holding pid in the pid index, -1 if it is not there */
+int pidslot_find(struct jobtable_t *jobs, pid_t pid) {
+    unsigned int i = pid_hash(pid, jobs->pid_cap);
+    while (jobs->bypid[i].pid != 0) {
+        if (jobs->bypid[i].pid == pid) {
+            return i;
+        }
+        i = (i + 1) & (jobs->pid_cap - 1);
+    }
+    return -1;
+}
+
+/* pidslot_insert - Add pid to the pid index (the caller makes sure there is room) */
+void pidslot_insert(struct jobtable_t *jobs, pid_t pid, struct job_t *job) {
+    unsigned int i = pid_hash(pid, jobs->pid_cap);
+    while (jobs->bypid[i].pid != 0) {
+        i = (i + 1) & (jobs->pid_cap - 1);
+    }
+    jobs->bypid[i].pid = pid;
+    jobs->bypid[i].job = job;
+}
+
+/*
+ * pidslot_remove - Empty a slot of the pid index
+ *
+ * Later entries of the same probe run are shifted back into the hole,
+ * so lookups never need tombstones.
+ */
+void pidslot_remove(struct jobtable_t *jobs, int slot) {
+    unsigned int mask = jobs->pid_cap - 1;
+    unsigned int hole = slot;
+    unsigned int i = (hole + 1) & mask;
+
+    while (jobs->bypid[i].pid != 0) {
+        unsigned int home = pid_hash(jobs->bypid[i].pid, jobs->pid_cap);
+        /* Move the entry if its home slot is not between the hole and i */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            jobs->bypid[hole] = jobs->bypid[i];
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+    jobs->bypid[hole].pid = 0;
+    jobs->bypid[hole].job = NULL;
+}
+
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/*****************
+ * Job completion functions
+ * ****************/
+
+/*
+ * reap_children puts every background job that finishes on the
+ * completion queue as it reaps the batch, so wait and the NOTIFY
+ * messages only ever look at the queue, never at the job table. The
+ * queue is a ring of the last MAXDONE completions: a status nobody
+ * waits for is overwritten after MAXDONE more jobs have finished.
+ * Foreground jobs, the jobs of parallel and those of server requests
+ * report their status elsewhere and are not queued (apart from captured
+ * jobs brought to the foreground, which are queued for their output).
+ */
+
+/*
+ * queue_done - Add a background job that has finished to the completion queue
+ *
+ * A captured job that finished in the foreground is only queued to keep
+ * its output, so it is queued as already waited for.
+ */
+void queue_done(struct job_t *job) {
+    struct done_t *d = &done.ring[done.total % MAXDONE];
+    if (done.total >= MAXDONE) {
+        if (!d->waited) {
+            done.unwaited--;
+        }
+        free(d->cmdline);
+        free_capture(d->capture);
+    }
+    d->pid = job->pid;
+    d->jid = job->jid;
+    d->status = job->status;
+    d->cmdline = strdup(job->cmdline);
+    d->waited = (job->state == FG);
+    d->capture = job->capture;
+    job->capture = NULL;
+    done.unwaited += !d->waited;
+    done.total++;
+}
+
+/*
+ * find_done - Find the latest completion of a job (by PID, or JID if pid is 0), NULL if there is none
+ *
+ * Completions whose status wait has returned are skipped unless waited is true.
+ */
+struct done_t *find_done(pid_t pid, int jid, bool waited) {
+    const unsigned long first = (done.total > MAXDONE) ? done.total - MAXDONE : 0;
+    for (unsigned long n = done.total; (waited || done.unwaited > 0) && n > first; n--) {
+        struct done_t *d = &done.ring[(n - 1) % MAXDONE];
+        if ((waited || !d->waited) && ((pid > 0) ? d->pid == pid : d->jid == jid)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/* next_done - Find the oldest completion not waited for yet of any of npids jobs (of any job if npids is 0) */
+struct done_t *next_done(pid_t *pids, int npids) {
+    const unsigned long first = (done.total > MAXDONE) ? done.total - MAXDONE : 0;
+    for (unsigned long n = first; done.unwaited > 0 && n < done.total; n++) {
+        struct done_t *d = &done.ring[n % MAXDONE];
+        if (d->waited) {
+            continue;
+        }
+        if (npids == 0) {
+            return d;
+        }
+        for (int i = 0; i < npids; i++) {
+            if (pids[i] > 0 && pids[i] == d->pid) {
+                return d;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* take_done - Mark a completion as waited for and return its status ($?) */
+int take_done(struct done_t *d) {
+    d->waited = true;
+    done.unwaited--;
+    return exit_status(d->status);
+}
+
+/*
+ * notify_done - Print the background jobs that have finished since the last prompt
+ *
+ * Only when the NOTIFY variable is set (and not empty). The jobs that
+ * wait has already returned are not printed.
+ */
+void notify_done() {
+    const char *notify = get_var("NOTIFY");
+    if (notify != NULL && *notify != '\0') {
+        unsigned long n = (done.total - done.notified > MAXDONE) ? done.total - MAXDONE : done.notified;
+        for (; n < done.total; n++) {
+            if (!done.ring[n % MAXDONE].waited) {
+                print_done(&done.ring[n % MAXDONE]);
+            }
+        }
+    }
+    done.notified = done.total;
+}
+
+/* print_done - Print how a background job finished */
+void print_done(struct done_t *d) {
+    printf("[%d] (%d) ", d->jid, d->pid);
+    if (WIFSIGNALED(d->status)) {
+        printf("Terminated by signal %d ", WTERMSIG(d->status));
+    } else if (WEXITSTATUS(d->status) != 0) {
+        printf("Exit %d ", WEXITSTATUS(d->status));
+    } else {
+        printf("Done ");
+    }
+    printf("%s\n", (d->cmdline != NULL) ? d->cmdline : "");
+}
+
+/*
+ * do_wait - Execute the builtin wait command
+ *
+ *     wait               wait for every running background job
+ *     wait id ...        wait for each job and give the status of the last one
+ *     wait -n [id ...]   wait for the first of the jobs (or of the background jobs) to finish
+ *
+ * An id is %jid, or a number taken as a pid or jid like bg and fg do.
+ * A job that has already finished is found on the completion queue, so
+ * wait also gives the status of a job that finished before it was run,
+ * once. The status is 127 if there is no such job or nothing left to
+ * wait for, and 130 if ctrl-c ends the wait.
+ */
+void do_wait(char **argv) {
+    const bool first = (argv[1] != NULL && strcmp(argv[1], "-n") == 0);
+    char **ids = argv + 1 + first;
+    int nids = 0;
+    while (ids[nids] != NULL) {
+        nids++;
+    }
+
+    /* Find every job before waiting, since a job that finishes loses its jid */
+    pid_t *pids = malloc((nids + 1) * sizeof(pid_t));
+    if (pids == NULL) {
+        reset_state_error("Could not allocate the jobs to wait for.");
+        return;
+    }
+    int status = 0;
+    for (int i = 0; i < nids; i++) {
+        if (!job_target("wait", ids[i], false, &pids[i])) {
+            pids[i] = 0;
+            status = 127;
+        }
+    }
+
+    sleeping.active = true;
+    sleeping.interrupted = false;
+    if (first) {
+        /* Wait until one of the jobs is on the queue, while any of them is still running */
+        struct done_t *d;
+        while ((d = next_done(pids, nids)) == NULL && !sleeping.interrupted) {
+            bool running = (nids == 0 && jobs.nbg > 0);
+            for (int i = 0; i < nids && !running; i++) {
+                running = (pids[i] > 0 && getjobpid(&jobs, pids[i]) != NULL);
+            }
+            if (!running) {
+                break;
+            }
+            wait_for_signal();
+        }
+        status = (d != NULL) ? take_done(d) : (sleeping.interrupted ? 130 : 127);
+    } else if (nids == 0) {
+        /* Wait for every running background job, and forget their statuses */
+        while (jobs.nbg > 0 && !sleeping.interrupted) {
+            wait_for_signal();
+        }
+        struct done_t *d;
+        while ((d = next_done(NULL, 0)) != NULL) {
+            take_done(d);
+        }
+        status = sleeping.interrupted ? 130 : 0;
+    } else {
+        for (int i = 0; i < nids && !sleeping.interrupted; i++) {
+            if (pids[i] == 0) {
+                status = 127;
+                continue;
+            }
+            while (getjobpid(&jobs, pids[i]) != NULL && !sleeping.interrupted) {
+                wait_for_signal();
+            }
+            struct done_t *d = find_done(pids[i], 0, false);
+            status = sleeping.interrupted ? 130 : (d != NULL) ? take_done(d) : 127;
+        }
+    }
+    sleeping.active = false;
+
+    free(pids);
+    last_status = status;
+}
+
+/*
+ * job_target - Find the pid of the job (running or finished) an argument of cmd names
+ *
+ * Finished jobs whose status wait has returned are only found if waited
+ * is true. Returns false (after an error) if there is no such job.
+ */
+bool job_target(const char *cmd, const char *arg, bool waited, pid_t *pid) {
+    const char *num = (arg[0] == '%') ? arg + 1 : arg;
+    if (*num == '\0' || !isnum((char *) num)) {
+        sprintf(sbuf, "%s: %.100s: not a pid or valid job spec", cmd, arg);
+        user_error(sbuf);
+        return false;
+    }
+
+    const int n = atoi(num);
+    struct job_t *job = (arg[0] == '%') ? NULL : getjobpid(&jobs, n);
+    if (job == NULL) {
+        job = getjobjid(&jobs, n);
+    }
+    struct done_t *d = NULL;
+    if (job == NULL && ((arg[0] == '%') || (d = find_done(n, 0, waited)) == NULL)) {
+        d = find_done(0, n, waited);
+    }
+
+    if (job != NULL) {
+        *pid = job->pid;
+    } else if (d != NULL) {
+        *pid = d->pid;
+    } else {
+        sprintf(sbuf, "%s: %.100s: no such job", cmd, arg);
+        user_error(sbuf);
+        return false;
+    }
+    return true;
+}
+
+/*****************
+ * End of job completion functions
+ * ****************/
+
+/*****************
+ * Output capture functions
+ * ****************/
+
+/*
+ * When the CAPTURE variable is set, each job started with & writes its
+ * stdout and stderr (of every stage) to a pipe instead of the terminal.
+ * The read end is nonblocking and asks for a SIGIO when output arrives,
+ * so the signal pipe wakes up the shell wherever it waits, and
+ * handle_signals reads whatever is waiting (the pipes that have output
+ * are found with epoll, not by looking at every job). The output goes
+ * into a ring of at most CAPTURESIZE bytes per job. Once the ring is
+ * full the oldest bytes make room: they are dropped, or with
+ * CAPTURE=spill first written to an unlinked temporary file. A capture
+ * moves to the completion queue with its job and is freed with its
+ * entry, so the memory used stays bounded however much the jobs print.
+ * While a captured job is in the foreground (after fg) its output is
+ * copied to the terminal as well, starting with what it has printed
+ * that was not shown yet.
+ */
+
+/*
+ * open_capture - Create the pipe the output of a background job is captured through
+ *
+ * The write end for the job is returned in out. Returns NULL (after an
+ * error) if the pipe could not be set up.
+ */
+struct capture_t *open_capture(bool spill, int *out) {
+    if (capture_epfd < 0 && (capture_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        reset_state_error("Could not create the capture epoll set.");
+        return NULL;
+    }
+
+    struct capture_t *capture = calloc(1, sizeof(struct capture_t));
+    int fds[2];
+    if (capture == NULL || pipe2(fds, O_CLOEXEC) < 0) {
+        reset_state_error("Could not create the capture pipe.");
+        free(capture);
+        return NULL;
+    }
+    capture->fd = fds[0];
+    capture->spill = -1;
+
+    struct epoll_event ev = {EPOLLIN, {.ptr = capture}};
+    if (fcntl(capture->fd, F_SETOWN, getpid()) < 0 || fcntl(capture->fd, F_SETFL, O_NONBLOCK | O_ASYNC) < 0
+            || epoll_ctl(capture_epfd, EPOLL_CTL_ADD, capture->fd, &ev) < 0) {
+        reset_state_error("Could not set up the capture pipe.");
+        close(fds[0]);
+        close(fds[1]);
+        free(capture);
+        return NULL;
+    }
+
+    /* The spill file has no name, so it goes away with the capture (or the shell) */
+    if (spill) {
+        const char *dir = get_var("TMPDIR");
+        capture->spill = open((dir != NULL && *dir != '\0') ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (capture->spill < 0) {
+            reset_state_error("Could not create the capture spill file, keeping only the last output.");
+        }
+        capture->spilling = (capture->spill >= 0);
+    }
+
+    *out = fds[1];
+    return capture;
+}
+
+/* free_capture - Close the pipe and the spill file of a capture and free it */
+void free_capture(struct capture_t *capture) {
+    if (capture == NULL) {
+        return;
+    }
+    if (capture->fd >= 0) {
+        epoll_ctl(capture_epfd, EPOLL_CTL_DEL, capture->fd, NULL);
+        close(capture->fd);
+    }
+    if (capture->spill >= 0) {
+        close(capture->spill);
+    }
+    free(capture->buf);
+    free(capture);
+}
+
+/* drain_captures - Read the output waiting in the pipes of the captured jobs */
+void drain_captures() {
+    if (capture_epfd < 0) {
+        return;
+    }
+
+    struct epoll_event events[64];
+    int n = epoll_wait(capture_epfd, events, 64, 0);
+    for (int i = 0; i < n; i++) {
+        drain_capture(events[i].data.ptr);
+    }
+
+    /* Come back for the rest after the other signals have been handled */
+    if (n == 64) {
+        notify_signal(&got_sigio);
+    }
+}
+
+/*
+ * drain_capture - Read the output waiting in the pipe of a capture
+ *
+ * The pipe is closed once every process that could write to it has
+ * exited. A job that keeps the pipe full only gets a few reads before
+ * the shell moves on, and the rest is read on the next wake-up.
+ */
+void drain_capture(struct capture_t *capture) {
+    char chunk[INPUTBUF];
+    int reads = 0;
+    while (capture->fd >= 0) {
+        if (reads++ == 16) {
+            notify_signal(&got_sigio);
+            return;
+        }
+        ssize_t n = read(capture->fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            append_capture(capture, chunk, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return;
+        } else {
+            /* The end of the output */
+            epoll_ctl(capture_epfd, EPOLL_CTL_DEL, capture->fd, NULL);
+            close(capture->fd);
+            capture->fd = -1;
+        }
+    }
+}
+
+/* append_capture - Add output to the ring of a capture, dropping (or spilling) the oldest bytes that do not fit */
+void append_capture(struct capture_t *capture, const char *data, size_t len) {
+    capture->total += len;
+    if (capture->echo) {
+        fwrite(data, 1, len, stdout);
+        fflush(stdout);
+        capture->shown = capture->total;
+    }
+
+    /* Grow the ring (up to CAPTURESIZE) so a job that prints a little only takes a little */
+    if (capture->len + len > capture->cap && capture->cap < CAPTURESIZE) {
+        size_t cap = (capture->cap == 0) ? 4096 : capture->cap;
+        while (cap < capture->len + len && cap < CAPTURESIZE) {
+            cap *= 2;
+        }
+        cap = (cap < CAPTURESIZE) ? cap : CAPTURESIZE;
+        char *buf = malloc(cap);
+        if (buf != NULL) {
+            for (size_t i = 0; i < capture->len; i++) {
+                buf[i] = capture->buf[(capture->start + i) % capture->cap];
+            }
+            free(capture->buf);
+            capture->buf = buf;
+            capture->cap = cap;
+            capture->start = 0;
+        }
+    }
+
+    /* Make room, oldest bytes first */
+    if (capture->len + len > capture->cap) {
+        size_t drop = capture->len + len - capture->cap;
+        size_t from_ring = (drop < capture->len) ? drop : capture->len;
+        size_t first = capture->cap - capture->start; /* bytes before the ring wraps around */
+        spill_capture(capture, capture->buf + capture->start, (from_ring < first) ? from_ring : first);
+        if (from_ring > first) {
+            spill_capture(capture, capture->buf, from_ring - first);
+        }
+        capture->start = (capture->cap > 0) ? (capture->start + from_ring) % capture->cap : 0;
+        capture->len -= from_ring;
+        spill_capture(capture, data, drop - from_ring);
+        data += drop - from_ring;
+        len -= drop - from_ring;
+    }
+
+    /* Copy the rest in after the newest byte */
+    for (size_t i = 0; i < len; i++) {
+        capture->buf[(capture->start + capture->len + i) % capture->cap] = data[i];
+    }
+    capture->len += len;
+}
+
+/* spill_capture - Write bytes that leave the ring of a capture to its spill file (if it has one) */
+void spill_capture(struct capture_t *capture, const char *data, size_t len) {
+    if (len == 0 || !capture->spilling) {
+        return;
+    }
+    if (write_all(capture->spill, data, len)) {
+        capture->spilled += len;
+    } else {
+        capture->spilling = false; /* the bytes from here until the ring are dropped */
+    }
+}
+
+/* print_capture - Print the output of a capture from byte from (counted from the start of the output) onwards */
+void print_capture(struct capture_t *capture, unsigned long long from) {
+    const unsigned long long oldest = capture->total - capture->len;
+    if (from < oldest) {
+        printf("[%llu bytes dropped]\n", oldest - from);
+        from = oldest;
+    }
+    for (unsigned long long off = from; off < capture->total; ) {
+        size_t i = (capture->start + (off - oldest)) % capture->cap;
+        size_t n = capture->cap - i; /* bytes before the ring wraps around */
+        if (n > capture->total - off) {
+            n = capture->total - off;
+        }
+        fwrite(capture->buf + i, 1, n, stdout);
+        off += n;
+    }
+}
+
+/*
+ * echo_capture - Start or stop copying the output of a capture to the terminal
+ *
+ * On starting, the output printed since the terminal last saw it is
+ * printed first.
+ */
+void echo_capture(struct capture_t *capture, bool on) {
+    if (on && !capture->echo) {
+        print_capture(capture, capture->shown);
+        fflush(stdout);
+        capture->shown = capture->total;
+    }
+    capture->echo = on;
+}
+
+/* find_capture - Find the capture of a running or finished job (by PID), NULL if it has none */
+struct capture_t *find_capture(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+    if (job != NULL) {
+        return job->capture;
+    }
+    struct done_t *d = find_done(pid, 0, true);
+    return (d != NULL) ? d->capture : NULL;
+}
+
+/* capture_arg - Find the capture of the job an argument of cmd names, NULL (after an error) if there is none */
+struct capture_t *capture_arg(const char *cmd, const char *arg, pid_t *pid) {
+    if (!job_target(cmd, arg, true, pid)) {
+        return NULL;
+    }
+    drain_captures();
+    struct capture_t *capture = find_capture(*pid);
+    if (capture == NULL) {
+        sprintf(sbuf, "%s: %.100s: the output of this job was not captured", cmd, arg);
+        user_error(sbuf);
+    }
+    return capture;
+}
+
+/*
+ * do_output - Execute the builtin output command (output %jid | pid)
+ *
+ * Prints everything the job has printed that is still kept: the spill
+ * file, and then the ring.
+ */
+void do_output(char **argv) {
+    if (argv[1] == NULL || argv[2] != NULL) {
+        user_error("Usage: output %jid | pid");
+        return;
+    }
+    pid_t pid;
+    struct capture_t *capture = capture_arg("output", argv[1], &pid);
+    if (capture == NULL) {
+        return;
+    }
+
+    char chunk[INPUTBUF];
+    for (off_t off = 0; off < capture->spilled; ) {
+        size_t want = (capture->spilled - off < (off_t) sizeof(chunk)) ? capture->spilled - off : sizeof(chunk);
+        ssize_t n = pread(capture->spill, chunk, want, off);
+        if (n <= 0) {
+            break;
+        }
+        fwrite(chunk, 1, n, stdout);
+        off += n;
+    }
+    print_capture(capture, capture->spilled);
+    last_status = 0;
+}
+
+/*
+ * do_tail - Execute the builtin tail command (tail [-f] %jid)
+ *
+ * Prints the last 10 lines of the output of a captured job. With -f it
+ * then prints the job's output as it arrives, until the job and every
+ * process it started have closed the pipe or ctrl-c is typed. tail is
+ * only built in when its argument is a job; otherwise the program runs.
+ */
+void do_tail(char **argv) {
+    const bool follow = (argv[1] != NULL && strcmp(argv[1], "-f") == 0);
+    const char *arg = argv[1 + follow];
+    if (arg == NULL || argv[2 + follow] != NULL) {
+        user_error("Usage: tail [-f] %jid");
+        return;
+    }
+    pid_t pid;
+    struct capture_t *capture = capture_arg("tail", arg, &pid);
+    if (capture == NULL) {
+        return;
+    }
+
+    /* Start at the last 10 lines (a newline at the very end does not start a line) */
+    const unsigned long long oldest = capture->total - capture->len;
+    unsigned long long from = capture->total;
+    int lines = 0;
+    for (; from > oldest; from--) {
+        const char c = capture->buf[(capture->start + (from - 1 - oldest)) % capture->cap];
+        if (c == '\n' && from < capture->total && ++lines == 10) {
+            break;
+        }
+    }
+    print_capture(capture, from);
+    from = capture->total;
+    fflush(stdout);
+
+    /* The capture is looked up again after each wait, since it may move to the completion queue */
+    sleeping.active = true;
+    sleeping.interrupted = false;
+    while (follow && capture != NULL && capture->fd >= 0 && !sleeping.interrupted) {
+        wait_for_signal();
+        if ((capture = find_capture(pid)) != NULL && capture->total > from) {
+            print_capture(capture, from);
+            from = capture->total;
+            fflush(stdout);
+        }
+    }
+    sleeping.active = false;
+    last_status = sleeping.interrupted ? 130 : 0;
+}
+
+/*****************
+ * End of output capture functions
+ * ****************/
+
+/*****************
+ * History functions
+ * ****************/
+
+/*
+ * init_history - Initialize the history list with the user's previous commands
+ *
+ * The history file is mapped into memory and scanned backwards for
+ * newlines with memrchr, so only the last HISTSIZE lines are ever
+ * looked at and the time taken does not depend on the size of the file.
+ */
+void init_history() {
+    /* The ring holds HISTSIZE entries */
+    const char *histsize = get_var("HISTSIZE");
+    alloc_history((histsize != NULL && atoi(histsize) > 0) ? atoi(histsize) : MAXHISTORY);
+
+    /* Get the file details */
+    const size_t history_file_size = strlen(shell_dir) + 1 + strlen(home) + 1 + 12; /* Does not include the null terminator */
+    histfile.path = malloc(sizeof(char) * (history_file_size + 1));
+    sprintf(histfile.path, "%s/%s/.tsh_history", shell_dir, home);
+
+    /* Keep the file open for the new commands of this session */
+    open_history_file();
+
+    /* Start with the last commands of the earlier sessions */
+    load_history();
+}
+
+/* load_history - Add the last HISTSIZE commands of the history file (of every session) to the history list */
+void load_history() {
+    int fd = open(histfile.path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    const char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        sprintf(sbuf, "Could not map %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+        return;
+    }
+
+    /* Add the last HISTSIZE non-empty lines oldest first */
+    const char *line = history_tail(data, sb.st_size, history.size);
+    const char *end = data + sb.st_size;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        const char *line_end = (nl != NULL) ? nl : end;
+        if (line_end > line) {
+            append_history(line, line_end - line);
+        }
+        line = line_end + 1;
+    }
+
+    munmap((void *) data, sb.st_size);
+}
+
+/*
+ * reload_history - Replace the history list with the last commands of the history file
+ *
+ * Every session appends its commands to the same file, so this merges
+ * in the commands other sessions of the user have run since this one
+ * started, in the order they were written.
+ */
+void reload_history() {
+    flush_history_file();
+    history.head = 0;
+    history.count = 0;
+    history.tail = 0;
+    load_history();
+}
+
+/* history_tail - Find the start of the last n non-empty lines of the data of a history file */
+const char *history_tail(const char *data, size_t size, int n) {
+    const char *start = data + size;
+    const char *end = data + size;      /* end of the line being looked at */
+    int found = 0;
+    while (end > data && found < n) {
+        const char *nl = memrchr(data, '\n', end - data);
+        const char *line = (nl != NULL) ? nl + 1 : data;
+        if (line < end) {
+            found++;
+            start = line;
+        }
+        end = (nl != NULL) ? nl : data;
+    }
+    return start;
+}
+
+/*
+ * The history list is a ring of HISTSIZE entries. The commands
+ * themselves are kept back to back in a circular string arena, so each
+ * one takes only its own length. Appending a command and finding the
+ * Nth one are both O(1); the arena only grows (and is compacted) when
+ * the commands in it do not leave room for the next one.
+ */
+
+/* alloc_history - Allocate an empty history list of the given size */
+void alloc_history(int size) {
+    history.ents = malloc(size * sizeof(struct histent_t));
+    history.buf = malloc(MINHISTBUF);
+    if (history.ents == NULL || history.buf == NULL) {
+        unix_error("Could not allocate the history list");
+    }
+    history.size = size;
+    history.head = 0;
+    history.count = 0;
+    history.buf_size = MINHISTBUF;
+    history.tail = 0;
+}
+
+/* grow_history - Move the commands into a bigger arena with room for need more bytes */
+bool grow_history(size_t need) {
+    size_t used = 0;
+    for (int i = 0; i < history.count; i++) {
+        used += history.ents[(history.head + i) % history.size].len + 1;
+    }
+
+    size_t new_size = 2 * history.buf_size;
+    while (new_size < 2 * (used + need)) {
+        new_size *= 2;
+    }
+    char *buf = malloc(new_size);
+    if (buf == NULL) {
+        return false;
+    }
+
+    /* Copy the commands from oldest to newest to the start of the new arena */
+    size_t off = 0;
+    for (int i = 0; i < history.count; i++) {
+        struct histent_t *ent = &history.ents[(history.head + i) % history.size];
+        memcpy(buf + off, history.buf + ent->off, ent->len + 1);
+        ent->off = off;
+        off += ent->len + 1;
+    }
+
+    free(history.buf);
+    history.buf = buf;
+    history.buf_size = new_size;
+    history.tail = off;
+    return true;
+}
+
+/* show_history - Print the last n commands of the history from least to most recent */
+void show_history(int n) {
+    const int count = history_length();
+    if (n > count || n < 0) {
+        n = count;
+    }
+
+    /* Most recent command is last, numbered so that !N runs it */
+    printf("History (last %d commands used from least to most recent):\n", n);
+    for (int i = count - n + 1; i <= count; i++) {
+        printf("%d. %s\n", i, history_entry(i));
+    }
+}
+
+/* history_length - Number of commands present in the history */
+int history_length() {
+    return history.count;
+}
+
+/* history_entry - The Nth command in the history (1 is the oldest), NULL if there is none */
+char *history_entry(int n) {
+    if (n < 1 || n > history.count) {
+        return NULL;
+    }
+    return history.buf + history.ents[(history.head + n - 1) % history.size].off;
+}
+
+/*
+ * write_to_history - Write command to history file
+ *
+ * The command is only added to the buffer of the history file here. The
+ * buffer is written once HISTFLUSH seconds have passed since the last
+ * write, when the shell is idle at the prompt and when it exits.
+ */
+void write_to_history(char *cmd) {
+    /* Check for ! since it should not be written */
+    if (cmd[0] == '!') {
+        return;
+    }
+
+    /* Add the command to the buffer as a new line */
+    const size_t need = strlen(cmd) + 1;
+    if (histfile.len + need > histfile.cap) {
+        flush_history_file();
+    }
+    if (need > histfile.cap) {
+        char *buf = realloc(histfile.buf, need);
+        if (buf == NULL) {
+            reset_state_error("Could not write to history file.");
+            return;
+        }
+        histfile.buf = buf;
+        histfile.cap = need;
+    }
+    memcpy(histfile.buf + histfile.len, cmd, need - 1);
+    histfile.buf[histfile.len + need - 1] = '\n';
+    histfile.len += need;
+
+    if (time(NULL) - histfile.last_flush >= histfile.interval) {
+        flush_history_file();
+    }
+    
+    /* Add to history */
+    add_to_history(cmd);
+
+    /* Keep the search index up to date once it has been built */
+    if (histindex.built && !index_command(cmd, need - 1)) {
+        reset_state_error("Could not add command to the history index.");
+    }
+}
+
+/*
+ * The history file is opened once per session with O_APPEND and every
+ * flush hands the whole buffer to a single write(). The kernel moves to
+ * the end of the file and writes the lines in one step, so the lines of
+ * several sessions of the same user never interleave or overwrite each
+ * other. The buffer only ever holds whole lines.
+ */
+
+/* open_history_file - Open the history file for appending and set up its buffer */
+void open_history_file() {
+    const char *interval = get_var("HISTFLUSH");
+    histfile.interval = (interval != NULL && isnum((char *) interval)) ? atoi(interval) : HISTFLUSH;
+
+    const char *mode = get_var("HISTFSYNC");
+    if (mode == NULL || strcmp(mode, "never") == 0) {
+        histfile.fsync_mode = HISTFSYNC_NEVER;
+    } else if (strcmp(mode, "flush") == 0) {
+        histfile.fsync_mode = HISTFSYNC_FLUSH;
+    } else if (strcmp(mode, "exit") == 0) {
+        histfile.fsync_mode = HISTFSYNC_EXIT;
+    } else {
+        user_error("HISTFSYNC must be never, flush or exit.");
+        histfile.fsync_mode = HISTFSYNC_NEVER;
+    }
+
+    histfile.len = 0;
+    histfile.cap = MINHISTBUF;
+    histfile.last_flush = time(NULL);
+    if ((histfile.buf = malloc(histfile.cap)) == NULL) {
+        unix_error("Could not allocate the history file buffer");
+    }
+
+    histfile.fd = open(histfile.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (histfile.fd < 0) {
+        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+    }
+}
+
+/* flush_history_file - Write the buffered commands to the history file */
+void flush_history_file() {
+    histfile.last_flush = time(NULL);
+    if (histfile.len == 0) {
+        return;
+    }
+    if (histfile.fd < 0) {
+        histfile.len = 0; /* the error was reported when opening the file */
+        return;
+    }
+
+    struct timespec start;
+    trace_start(&start);
+    lock_history_file();
+    if (histfile.fd < 0 || !write_all(histfile.fd, histfile.buf, histfile.len)) {
+        reset_state_error("Could not write to history file.");
+    }
+    histfile.len = 0;
+
+    if (histfile.fd >= 0) {
+        if (histfile.fsync_mode == HISTFSYNC_FLUSH) {
+            fsync(histfile.fd);
+        }
+        flock(histfile.fd, LOCK_UN);
+    }
+    trace_end(TRACE_HISTORY, &start);
+}
+
+/*
+ * lock_history_file - Take a shared lock on the history file before appending to it
+ *
+ * Sessions that append only share the lock, so they never wait for
+ * each other. reset_history holds it exclusively while it replaces the
+ * file with a trimmed copy, so once the lock is held the file is
+ * reopened if it has been replaced in the meantime.
+ */
+void lock_history_file() {
+    struct stat held, cur;
+    while (histfile.fd >= 0 && flock(histfile.fd, LOCK_SH) == 0 && fstat(histfile.fd, &held) == 0
+            && stat(histfile.path, &cur) == 0 && (held.st_ino != cur.st_ino || held.st_dev != cur.st_dev)) {
+        close(histfile.fd);
+        histfile.fd = open(histfile.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+}
+
+/* idle_history_file - Flush the history file unless more input is already waiting */
+void idle_history_file() {
+    if (histfile.len != 0 && !((server.fd >= 0) ? request_pending() : input_pending(&input))) {
+        flush_history_file();
+    }
+}
+
+/* close_history_file - Flush and close the history file when the shell exits */
+void close_history_file() {
+    if (histfile.path == NULL) {
+        return; /* nobody logged in */
+    }
+    flush_history_file();
+    if (histfile.fd >= 0) {
+        if (histfile.fsync_mode != HISTFSYNC_NEVER) {
+            fsync(histfile.fd);
+        }
+        close(histfile.fd);
+        histfile.fd = -1;
+    }
+}
+
+/* run_nth_history - Run the Nth command in the history file */
+void run_nth_history(char *cmd) {
+    /* Get the number of the command to run (subtract 1 for 0 indexing) */
+    int n;
+    sscanf(cmd, "!%d", &n);
+    const int h_length = history_length();
+    if (n > h_length) {
+        sprintf(sbuf, "Called command %d from history, however only %d commands present in history.", n, h_length);
+        reset_state_error(sbuf);
+        return;
+    } else if (n < 1) {
+        sprintf(sbuf, "Called command %d from history, however the number must be greater than 0.", n);
+        reset_state_error(sbuf);
+        return;
+    }
+
+    /* Copy the command since running it adds to the history */
+    char *command = strdup(history_entry(n));
+    if (command == NULL) {
+        reset_state_error("Could not copy command from history.");
+        return;
+    }
+    eval(command);
+    free(command);
+    return;
+}
+
+/* add_to_history - Add command to the history list */
+void add_to_history(char *cmd) {
+    append_history(cmd, strlen(cmd));
+}
+
+/* append_history - Add the len bytes at cmd to the history list as one command */
+void append_history(const char *cmd, size_t len) {
+    const size_t need = len + 1;
+
+    /* Once the ring is full the oldest command makes way for the new one */
+    if (history.count == history.size) {
+        history.head = (history.head + 1) % history.size;
+        history.count--;
+    }
+    if (history.count == 0) {
+        history.tail = 0;
+    }
+
+    /* Find room in the arena after the newest command, before the oldest one */
+    size_t first = (history.count > 0) ? history.ents[history.head].off : 0;
+    size_t off;
+    if (history.count == 0 || first < history.tail) {
+        if (history.tail + need <= history.buf_size) {
+            off = history.tail;
+        } else if (need <= first) {
+            off = 0; /* wrap around */
+        } else if (grow_history(need)) {
+            off = history.tail;
+        } else {
+            reset_state_error("Could not add command to history.");
+            return;
+        }
+    } else if (history.tail + need <= first) {
+        off = history.tail;
+    } else if (grow_history(need)) {
+        off = history.tail;
+    } else {
+        reset_state_error("Could not add command to history.");
+        return;
+    }
+
+    memcpy(history.buf + off, cmd, len);
+    history.buf[off + len] = '\0';
+    struct histent_t *ent = &history.ents[(history.head + history.count) % history.size];
+    ent->off = off;
+    ent->len = len;
+    history.count++;
+    history.tail = off + need;
+}
+
+/*
+ * reset_history - Trim the .tsh_history file to its last HISTFILESIZE commands
+ *
+ * HISTFILESIZE is kept apart from HISTSIZE, so a small history list
+ * does not throw away the commands the search index and the other
+ * sessions use. If it is not set the file keeps the whole lines in its
+ * last MAXHISTFILE/2 bytes.
+ *
+ * The file is shared by every session of the user, so the commands are
+ * taken from the file rather than from this session's history list. The
+ * copy is written next to the file and renamed over it while holding
+ * the lock, so a session appending at the same time either writes to
+ * the old file before the copy is made or reopens the new one.
+ */
+void reset_history() {
+    /* Lock the file, unless another session has just trimmed it */
+    int fd = open(histfile.path, O_RDONLY | O_CLOEXEC);
+    struct stat sb, cur;
+    if (fd < 0 || flock(fd, LOCK_EX) < 0 || fstat(fd, &sb) < 0) {
+        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (stat(histfile.path, &cur) < 0 || cur.st_ino != sb.st_ino || sb.st_size <= MAXHISTFILE) {
+        close(fd);
+        return;
+    }
+    const char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        sprintf(sbuf, "Could not map %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+        close(fd);
+        return;
+    }
+
+    /* Write the last commands of every session to a new file and rename it over the old one */
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", histfile.path, (int) getpid());
+    const char *tail;
+    const char *filesize = get_var("HISTFILESIZE");
+    int lines = (filesize != NULL) ? atoi(filesize) : 0;
+    if (lines > 0) {
+        tail = history_tail(data, sb.st_size, lines);
+    } else {
+        tail = data + sb.st_size - MAXHISTFILE / 2;
+        const char *nl = memchr(tail, '\n', data + sb.st_size - tail);
+        tail = (nl != NULL) ? nl + 1 : data + sb.st_size;
+    }
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = (out >= 0 && write_all(out, tail, data + sb.st_size - tail));
+    if (ok && histfile.fsync_mode != HISTFSYNC_NEVER) {
+        ok = (fsync(out) == 0);
+    }
+    if (out >= 0 && close(out) < 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, histfile.path) < 0) {
+        reset_state_error("Could not write to history file.");
+        unlink(tmp);
+    }
+
+    munmap((void *) data, sb.st_size);
+    close(fd); /* the other sessions now see the new file */
+}
+
+
+/*****************
+ * End of history functions
+ * ****************/
+
+/*****************
+ * History search functions
+ * ****************/
+
+/*
+ * The history search index holds every command of the history file
+ * together with a trigram index: for each three bytes that appear in a
+ * command, the list of commands they appear in, in order. It is built
+ * from the file the first time it is searched, so logging in never pays
+ * for it, and write_to_history adds each new command to it after that.
+ *
+ * A search for text of three or more bytes only looks at the commands
+ * in the shortest list among the trigrams of the text and checks each
+ * one, so finding a rare command in millions of lines only touches the
+ * few commands that can contain it. Shorter text is looked for in every
+ * command, newest first.
+ */
+
+/*
+ * do_history - Execute the builtin history command
+ *
+ *     history          list the commands in the history list
+ *     history N        list the last N of them
+ *     history grep T   list every command of the history file that contains T
+ */
+void do_history(char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        reload_history();
+        return;
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "grep") == 0) {
+        if (argv[2] == NULL || argv[2][0] == '\0') {
+            user_error("Usage: history grep <text>");
+            return;
+        }
+        grep_history(argv[2]);
+        return;
+    }
+    show_history((argv[1] != NULL) ? atoi(argv[1]) : history_length());
+}
+
+/* build_history_index - Read the history file into the search index */
+bool build_history_index() {
+    if (histindex.built) {
+        return true;
+    }
+
+    histindex.grams_cap = MINGRAMS;
+    if ((histindex.grams = calloc(histindex.grams_cap, sizeof(struct posting_t))) == NULL) {
+        reset_state_error("Could not allocate the history index.");
+        return false;
+    }
+    histindex.built = true;
+
+    /* The commands of this session that are still buffered belong at the end */
+    flush_history_file();
+
+    int fd = open(histfile.path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0 || sb.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return true;
+    }
+    const char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        sprintf(sbuf, "Could not map %s/.tsh_history file.", home);
+        reset_state_error(sbuf);
+        return true;
+    }
+
+    const char *line = data;
+    const char *end = data + sb.st_size;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        const char *line_end = (nl != NULL) ? nl : end;
+        if (line_end > line && !index_command(line, line_end - line)) {
+            reset_state_error("Could not add command to the history index.");
+            break;
+        }
+        line = line_end + 1;
+    }
+
+    munmap((void *) data, sb.st_size);
+    return true;
+}
+
+/* index_command - Add the len bytes at cmd to the search index as the newest command */
+bool index_command(const char *cmd, size_t len) {
+    if (histindex.len + len + 1 > histindex.cap) {
+        size_t cap = (histindex.cap == 0) ? MINHISTBUF : 2 * histindex.cap;
+        while (cap < histindex.len + len + 1) {
+            cap *= 2;
+        }
+        char *text = realloc(histindex.text, cap);
+        if (text == NULL) {
+            return false;
+        }
+        histindex.text = text;
+        histindex.cap = cap;
+    }
+    if (histindex.nlines == histindex.lines_cap) {
+        int cap = (histindex.lines_cap == 0) ? MINHISTBUF : 2 * histindex.lines_cap;
+        size_t *lines = realloc(histindex.lines, cap * sizeof(size_t));
+        if (lines == NULL) {
+            return false;
+        }
+        histindex.lines = lines;
+        histindex.lines_cap = cap;
+    }
+
+    const int line = histindex.nlines++;
+    histindex.lines[line] = histindex.len;
+    memcpy(histindex.text + histindex.len, cmd, len);
+    histindex.text[histindex.len + len] = '\0';
+    histindex.len += len + 1;
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        const unsigned char *c = (const unsigned char *) cmd + i;
+        if (!add_posting((c[0] << 16) | (c[1] << 8) | c[2], line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* gram_hash - Slot of a trigram in the index */
+static unsigned int gram_hash(unsigned int gram, int cap) {
+    return (gram * 2654435761u) & (cap - 1);
+}
+
+/* add_posting - Record that a trigram appears in a command */
+bool add_posting(unsigned int gram, int line) {
+    /* Keep the table at most half full */
+    if (2 * (histindex.ngrams + 1) > histindex.grams_cap) {
+        int cap = 2 * histindex.grams_cap;
+        struct posting_t *grams = calloc(cap, sizeof(struct posting_t));
+        if (grams == NULL) {
+            return false;
+        }
+        for (int i = 0; i < histindex.grams_cap; i++) {
+            if (histindex.grams[i].gram != 0) {
+                unsigned int b = gram_hash(histindex.grams[i].gram, cap);
+                while (grams[b].gram != 0) {
+                    b = (b + 1) & (cap - 1);
+                }
+                grams[b] = histindex.grams[i];
+            }
+        }
+        free(histindex.grams);
+        histindex.grams = grams;
+        histindex.grams_cap = cap;
+    }
+
+    unsigned int b = gram_hash(gram, histindex.grams_cap);
+    while (histindex.grams[b].gram != 0 && histindex.grams[b].gram != gram) {
+        b = (b + 1) & (histindex.grams_cap - 1);
+    }
+    struct posting_t *post = &histindex.grams[b];
+    if (post->gram == 0) {
+        post->gram = gram;
+        histindex.ngrams++;
+    }
+
+    /* A trigram that appears twice in a command is only listed once */
+    if (post->count > 0 && post->lines[post->count - 1] == line) {
+        return true;
+    }
+    if (post->count == post->cap) {
+        int cap = (post->cap == 0) ? 4 : 2 * post->cap;
+        int *lines = realloc(post->lines, cap * sizeof(int));
+        if (lines == NULL) {
+            return false;
+        }
+        post->lines = lines;
+        post->cap = cap;
+    }
+    post->lines[post->count++] = line;
+    return true;
+}
+
+/* find_posting - The list of commands a trigram appears in, NULL if it appears in none */
+struct posting_t *find_posting(unsigned int gram) {
+    unsigned int b = gram_hash(gram, histindex.grams_cap);
+    while (histindex.grams[b].gram != 0) {
+        if (histindex.grams[b].gram == gram) {
+            return &histindex.grams[b];
+        }
+        b = (b + 1) & (histindex.grams_cap - 1);
+    }
+    return NULL;
+}
+
+/*
+ * rarest_posting - The shortest list among the trigrams of text
+ *
+ * Returns NULL if text is shorter than a trigram, and sets absent if
+ * one of its trigrams appears in no command (so nothing can match).
+ */
+struct posting_t *rarest_posting(const char *text, size_t len, bool *absent) {
+    struct posting_t *rarest = NULL;
+    *absent = false;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        const unsigned char *c = (const unsigned char *) text + i;
+        struct posting_t *post = find_posting((c[0] << 16) | (c[1] << 8) | c[2]);
+        if (post == NULL) {
+            *absent = true;
+            return NULL;
+        }
+        if (rarest == NULL || post->count < rarest->count) {
+            rarest = post;
+        }
+    }
+    return rarest;
+}
+
+/* history_matches - Check if a command starts with (prefix) or contains the len bytes of text */
+bool history_matches(int line, const char *text, size_t len, bool prefix) {
+    const char *cmd = histindex.text + histindex.lines[line];
+    return prefix ? strncmp(cmd, text, len) == 0 : strstr(cmd, text) != NULL;
+}
+
+/* find_history - The newest command before line before that matches text, -1 if there is none */
+int find_history(const char *text, bool prefix, int before) {
+    const size_t len = strlen(text);
+    bool absent;
+    struct posting_t *post = rarest_posting(text, len, &absent);
+    if (absent) {
+        return -1;
+    }
+
+    if (post == NULL) {
+        for (int line = before - 1; line >= 0; line--) {
+            if (history_matches(line, text, len, prefix)) {
+                return line;
+            }
+        }
+        return -1;
+    }
+
+    /* Binary search for the last listed command before before */
+    int lo = 0, hi = post->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (post->lines[mid] < before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        if (history_matches(post->lines[i], text, len, prefix)) {
+            return post->lines[i];
+        }
+    }
+    return -1;
+}
+
+/* grep_history - Print every command of the history file that contains text, oldest first */
+void grep_history(const char *text) {
+    if (!build_history_index()) {
+        return;
+    }
+
+    const size_t len = strlen(text);
+    bool absent;
+    struct posting_t *post = rarest_posting(text, len, &absent);
+    if (absent) {
+        return;
+    }
+    const int count = (post != NULL) ? post->count : histindex.nlines;
+    for (int i = 0; i < count; i++) {
+        const int line = (post != NULL) ? post->lines[i] : i;
+        if (history_matches(line, text, len, false)) {
+            printf("%7d  %s\n", line + 1, histindex.text + histindex.lines[line]);
+        }
+    }
+}
+
+/*
+ * run_history_search - Run the newest command that matches !prefix or !?text
+ *
+ * A trailing ? after the text of !?text is left out, as in other shells.
+ */
+void run_history_search(char *cmd) {
+    const bool contains = (cmd[1] == '?');
+    char text[MAXLINE];
+    snprintf(text, sizeof(text), "%s", cmd + 1 + contains);
+    const size_t len = strlen(text);
+    if (contains && len > 0 && text[len - 1] == '?') {
+        text[len - 1] = '\0';
+    }
+    if (text[0] == '\0' || !build_history_index()) {
+        sprintf(sbuf, "%.100s: event not found", cmd);
+        user_error(sbuf);
+        return;
+    }
+
+    int line = find_history(text, !contains, histindex.nlines);
+    if (line < 0) {
+        sprintf(sbuf, "%.100s: event not found", cmd);
+        user_error(sbuf);
+        return;
+    }
+
+    /* Copy the command since running it adds to the history (and can move the index) */
+    char *command = strdup(histindex.text + histindex.lines[line]);
+    if (command == NULL) {
+        reset_state_error("Could not copy command from history.");
+        return;
+    }
+    eval(command);
+    free(command);
+}
+
+/*****************
+ * End of history search functions
+ * ****************/
+
+/*****************
+ * Stat functions
+ * ****************/
+
+/* shell_stat - Create shell stat struct */
+void shell_stat(struct stat_t *stat) {
+    strcpy(stat->name, "tsh");
+    stat->pid = getpid();
+    stat->ppid = getppid();
+    stat->pgid = stat->pid;
+    stat->sid = stat->pid;
+    strcpy(stat->state, "Ss");
+    snprintf(stat->uname, sizeof stat->uname, "%s", username);
+    clock_gettime(CLOCK_REALTIME, &stat->start);
+    memset(&stat->usage, 0, sizeof(stat->usage));
+
+    session_id = stat->sid;
+}
+
+/* get_stat - Create stat struct for process */
+void get_stat(struct stat_t *stat, pid_t pid, pid_t pgid, char *cmd, int process_state) {
+    /* Get the process details */
+    snprintf(stat->name, sizeof stat->name, "%s", cmd);
+    stat->pid = pid;
+    stat->ppid = getpid();  /* called by the shell, which is the parent */
+    stat->pgid = pgid;      /* every stage of a job shares one process group */
+    stat->sid = session_id;
+    /* Determine the state */
+    determine_stat_state(stat, process_state);
+    snprintf(stat->uname, sizeof stat->uname, "%s", username);
+    clock_gettime(CLOCK_REALTIME, &stat->start);
+    memset(&stat->usage, 0, sizeof(stat->usage));
+}
+
+/* determine_stat_state - Determine the state of the stat struct based on background/foreground */
+void determine_stat_state(struct stat_t *stat, int process_state) {
+    char first_char;
+    
+    if (stat->pid == stat->sid) {
+        first_char = 'S';
+    } else {
+        switch (process_state) {
+            case FG:
+                first_char = 'R';
+                break;
+            case BG:
+                first_char = 'R';
+                break;
+            case ST:
+                first_char = 'T';
+                break;
+            case UNDEF:
+                first_char = '!'; /* Should never happen */
+                unix_error("Undefined process state.");
+                break;
+            default:
+                first_char = '?'; /* Should never happen */
+                unix_error("Unknown process state.");
+                break;
+        }
+    }
+
+    char second_char;
+    if (stat->pid == stat->sid) {
+        second_char = 's';
+    } else if (process_state == FG) {
+        second_char = '+';
+    } else {
+        second_char = '\0';
+    }
+
+    sprintf(stat->state, "%c%c", first_char, second_char);
+}
+
+/*****************
+ * End of stat functions
+ * ****************/
+
+/*****************
+ * Stat table functions
+ * ****************/
+
+/*
+ * The stat table holds the stat struct of every process the shell
+ * knows about and is the source of truth for proc/PID/status. Changing
+ * an entry only updates it in memory and puts it on the dirty list;
+ * flush_stats writes the dirty entries in one batch before the next
+ * prompt. A job that starts and ends between two prompts therefore
+ * never touches the disk.
+ */
+
+/* initstats - Initialize the stat table */
+void initstats(struct stattable_t *stats) {
+    stats->count = 0;
+    stats->dirty = NULL;
+    stats->nbuckets = MINSTATS;
+    stats->buckets = calloc(stats->nbuckets, sizeof(struct proc_t *));
+    if (stats->buckets == NULL) {
+        unix_error("Could not allocate the stat table");
+    }
+}
+
+/* find_stat - Find the entry of a process (by PID) in the stat table */
+struct proc_t *find_stat(struct stattable_t *stats, pid_t pid) {
+    struct proc_t *proc = stats->buckets[pid_hash(pid, stats->nbuckets)];
+    while (proc != NULL && proc->stat.pid != pid) {
+        proc = proc->next;
+    }
+    return proc;
+}
+
+/* add_stat - Add the stat struct of a new process to the stat table */
+void add_stat(struct stattable_t *stats, struct stat_t *stat) {
+    /* Reuse the entry of a reaped process with the same pid that has not been flushed yet */
+    struct proc_t *proc = find_stat(stats, stat->pid);
+    if (proc == NULL) {
+        /* Keep the chains short */
+        if (stats->count >= stats->nbuckets) {
+            int nbuckets = 2 * stats->nbuckets;
+            struct proc_t **buckets = calloc(nbuckets, sizeof(struct proc_t *));
+            if (buckets != NULL) {
+                for (int i = 0; i < stats->nbuckets; i++) {
+                    while (stats->buckets[i] != NULL) {
+                        struct proc_t *p = stats->buckets[i];
+                        stats->buckets[i] = p->next;
+                        unsigned int b = pid_hash(p->stat.pid, nbuckets);
+                        p->next = buckets[b];
+                        buckets[b] = p;
+                    }
+                }
+                free(stats->buckets);
+                stats->buckets = buckets;
+                stats->nbuckets = nbuckets;
+            }
+        }
+
+        if ((proc = malloc(sizeof(struct proc_t))) == NULL) {
+            reset_state_error("Could not allocate stat table entry.");
+            return;
+        }
+        proc->on_disk = false;
+        proc->dirty = false;
+        proc->stat_fd = -1;
+        unsigned int b = pid_hash(stat->pid, stats->nbuckets);
+        proc->next = stats->buckets[b];
+        stats->buckets[b] = proc;
+        stats->count++;
+    }
+
+    if (proc->stat_fd >= 0) {
+        /* The fd was for the reaped process that had this pid */
+        close(proc->stat_fd);
+        proc->stat_fd = -1;
+    }
+    proc->stat = *stat;
+    proc->live = true;
+    proc->ticks = 0;
+    proc->sampled = false;
+    mark_dirty(stats, proc);
+}
+
+/* edit_stat - Change the state of a process in the stat table */
+void edit_stat(struct stattable_t *stats, pid_t pid, char *new_state) {
+    struct proc_t *proc = find_stat(stats, pid);
+    if (proc != NULL && proc->live) {
+        strcpy(proc->stat.state, new_state);
+        mark_dirty(stats, proc);
+    }
+}
+
+/* edit_stat_usage - Record the resources a process has used in the stat table */
+void edit_stat_usage(struct stattable_t *stats, pid_t pid, struct rusage *usage) {
+    struct proc_t *proc = find_stat(stats, pid);
+    if (proc != NULL && proc->live) {
+        proc->stat.usage = *usage;
+        mark_dirty(stats, proc);
+    }
+}
+
+/* remove_stat - Mark a process as gone so the next flush removes its proc entry */
+void remove_stat(struct stattable_t *stats, pid_t pid) {
+    struct proc_t *proc = find_stat(stats, pid);
+    if (proc != NULL && proc->live) {
+        proc->live = false;
+        mark_dirty(stats, proc);
+    }
+}
+
+/* edit_job_stats - Change the state of every running stage of a job */
+void edit_job_stats(struct stattable_t *stats, struct job_t *job, char *new_state) {
+    for (int i = 0; i < job->npids; i++) {
+        if (job->pids[i] != 0) {
+            edit_stat(stats, job->pids[i], new_state);
+        }
+    }
+}
+
+/* remove_job_stats - Mark every running stage of a job as gone */
+void remove_job_stats(struct stattable_t *stats, struct job_t *job) {
+    for (int i = 0; i < job->npids; i++) {
+        if (job->pids[i] != 0) {
+            remove_stat(stats, job->pids[i]);
+        }
+    }
+}
+
+/* mark_dirty - Put an entry on the dirty list */
+void mark_dirty(struct stattable_t *stats, struct proc_t *proc) {
+    if (!proc->dirty) {
+        proc->dirty = true;
+        proc->next_dirty = stats->dirty;
+        stats->dirty = proc;
+    }
+}
+
+/*
+ * flush_stats - Bring proc/ up to date with the dirty entries of the stat table
+ *
+ * Entries of processes that have been reaped are freed here. With
+ * -P shm the records of the shared proc table are written instead, and
+ * with -P none nothing is written at all.
+ */
+void flush_stats(struct stattable_t *stats) {
+    struct timespec start;
+    trace_start(&start);
+    struct proc_t *proc = stats->dirty;
+    const bool flushed = (proc != NULL);
+    stats->dirty = NULL;
+
+    while (proc != NULL) {
+        struct proc_t *next = proc->next_dirty;
+        proc->dirty = false;
+
+        if (proc_mode == PROC_FILES) {
+            if (proc->live && !proc->on_disk) {
+                create_proc_entry(&proc->stat);
+                proc->on_disk = true;
+            } else if (proc->live) {
+                write_proc_entry(&proc->stat);
+            } else if (proc->on_disk) {
+                remove_proc_entry(proc->stat.pid);
+                proc->on_disk = false;
+            }
+        } else if (proc_mode == PROC_SHM) {
+            if (proc->live && !proc->on_disk) {
+                proc->slot = shm_add(&proc->stat);
+                proc->on_disk = (proc->slot >= 0);
+            } else if (proc->live) {
+                shm_write(proc->slot, &proc->stat);
+            } else if (proc->on_disk) {
+                shm_remove(proc->slot);
+                proc->on_disk = false;
+            }
+        }
+
+        if (!proc->live) {
+            /* Unlink the entry from its bucket and free it */
+            struct proc_t **link = &stats->buckets[pid_hash(proc->stat.pid, stats->nbuckets)];
+            while (*link != proc) {
+                link = &(*link)->next;
+            }
+            *link = proc->next;
+            stats->count--;
+            if (proc->stat_fd >= 0) {
+                close(proc->stat_fd);
+            }
+            free(proc);
+        }
+        proc = next;
+    }
+    if (flushed) {
+        trace_end(TRACE_FLUSH, &start);
+    }
+}
+
+/*****************
+ * End of stat table functions
+ * ****************/
+
+/*****************
+ * Proc functions
+ * ****************/
+
+/* write_to_proc - Write to proc/PID/status */
+void create_proc_entry(struct stat_t *stat) {
+    /* Get the folder details */
+    char proc_dir[PATH_MAX];
+    sprintf(proc_dir, "proc/%d", stat->pid);
+    shell_file(proc_dir, proc_dir);
+
+    /* Create the folder (a stale one may be left by an earlier process with this pid) */
+    if (mkdir(proc_dir, MKDIR_MODE) == -1 && errno != EEXIST) {
+        sprintf(sbuf, "Could not create folder proc/%d.", stat->pid);
+        reset_state_error(sbuf);
+        return;
+    }
+    
+    /* Write to the file */
+    write_proc_entry(stat);
+}
+
+/*
+ * write_proc_entry - Write to proc/PID/status
+ *
+ * The entry is written to proc/PID/.status.tmp and renamed over the
+ * status file, so ps and top in other sessions never read half an entry.
+ */
+void write_proc_entry(struct stat_t *stat) {
+    /* Get the file details */
+    char proc_file[PATH_MAX], tmp_file[PATH_MAX];
+    sprintf(proc_file, "proc/%d/status", stat->pid);
+    shell_file(proc_file, proc_file);
+    sprintf(tmp_file, "proc/%d/.status.tmp", stat->pid);
+    shell_file(tmp_file, tmp_file);
+
+    /* Open the file */
+    FILE *fp;
+    fp = fopen(tmp_file, "w");
+    if (fp == NULL) {
+        sprintf(sbuf, "Could not open proc/%d/status file.", stat->pid);
+        reset_state_error(sbuf);
+        return;
+    }
+
+    /* Written straight to the file, since the name, state and user name can each fill sbuf */
+    const int written = fprintf(fp, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s\n"
+    "Start: %ld.%03ld\nUtime: %ld.%06ld\nStime: %ld.%06ld\nMaxRSS: %ld\nMinFlt: %ld\nMajFlt: %ld\n", 
+    stat->name, stat->pid, stat->ppid, stat->pgid, stat->sid, stat->state, stat->uname,
+    (long) stat->start.tv_sec, stat->start.tv_nsec / 1000000,
+    (long) stat->usage.ru_utime.tv_sec, (long) stat->usage.ru_utime.tv_usec,
+    (long) stat->usage.ru_stime.tv_sec, (long) stat->usage.ru_stime.tv_usec,
+    stat->usage.ru_maxrss, stat->usage.ru_minflt, stat->usage.ru_majflt);
+
+    if (fclose(fp) != 0 || written < 0 || rename(tmp_file, proc_file) == -1) {
+        reset_state_error("Could not write to proc/PID/status file.");
+        unlink(tmp_file);
+    }
+}
+    
+/* read_proc_entry - Read proc entrt in proc/PID/status */
+void read_proc_entry(struct stat_t *stat, pid_t pid) {
+    /* Get the file details */
+    char proc_file[PATH_MAX];
+    sprintf(proc_file, "proc/%d/status", pid);
+    shell_file(proc_file, proc_file);
+
+    /* Open the file */
+    FILE *fp;
+    fp = fopen(proc_file, "r");
+    if (fp == NULL) {
+        sprintf(sbuf, "Could not open proc/%d/status file.", pid);
+        reset_state_error(sbuf);
+        fclose(fp);
+        return;
+    }
+
+    /* Read the file */
+    fscanf(fp, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s\n", 
+    stat->name, &stat->pid, &stat->ppid, &stat->pgid, &stat->sid, stat->state, stat->uname);
+
+    fclose(fp);
+}
+
+/* remove_proc_entry - Remove a specific proc entry in proc/PID/status */
+void remove_proc_entry(pid_t pid) {
+    /* Get the file details */
+    char proc_file[PATH_MAX];
+    sprintf(proc_file, "proc/%d/status", pid);
+    shell_file(proc_file, proc_file);
+
+    /* Remove the file */
+    if (remove(proc_file) == -1) {
+        sprintf(sbuf, "Could not remove proc/%d/status file.", pid);
+        reset_state_error(sbuf);
+        return;
+    }
 
-            /* Wait for the job to finish */
-            sigset_t prev_one;
-            sigemptyset(&prev_one); /* Create empty set */
-            sigaddset(&prev_one, SIGCHLD); /* Add SIGCHLD to wait for */
+    /* Remove the folder */
+    char proc_dir[PATH_MAX];
+    sprintf(proc_dir, "proc/%d", pid);
+    shell_file(proc_dir, proc_dir);
+    if (rmdir(proc_dir) == -1) {
+        sprintf(sbuf, "Could not remove proc/%d folder.", pid);
+        reset_state_error(sbuf);
+        return;
+    }
+}
 
-            /* Wait for the job to finish */
-            // waitfg(job_to_modify->pid, &prev_one);
-            return;
+/*
+ * remove_proc_entries - Remove the proc entries of this session in proc/PID/status
+ *
+ * proc/ is shared by every session started in the same directory, so
+ * only the entries this shell has written are removed.
+ */
+void remove_proc_entries() {
+    for (int i = 0; i < stats.nbuckets; i++) {
+        for (struct proc_t *proc = stats.buckets[i]; proc != NULL; proc = proc->next) {
+            if (proc->on_disk) {
+                remove_proc_entry(proc->stat.pid);
+                proc->on_disk = false;
+            }
         }
     }
+}
 
-    /* Check if the job is stopped */
-    if (job_to_modify->state == ST) {
-        if (strcmp(argv[0], "bg") == 0) {
-            /* User want to move a job from stopped to the foreground */
-            job_to_modify->state = BG;
-            
-            // Edit the proc file
-            edit_proc_entry(job_to_modify->pid, "R");
-
-            /* Send the job a SIGCONT signal to wake it up */
-            kill(-job_to_modify->pid, SIGCONT);
-            
-            return;
-        } else {
-            /* User want to move a job from stopped to the foreground */
-            job_to_modify->state = FG;
-            
-            /* Set the fg_pid to 0 to make waitfg wait */
-            fg_pid = 0;
+/*
+ * remove_stale_proc_entries - Remove the proc entries left by sessions that are gone
+ *
+ * A session that was killed cannot remove its own entries. An entry is
+ * stale when the session leader in its Sid field no longer exists.
+ * Entries another session removes at the same time are not errors.
+ */
+void remove_stale_proc_entries() {
+    /* Get the folder details */
+    char proc_dir[PATH_MAX];
+    shell_file(proc_dir, "proc");
 
-            /* Edit the proc file */
-            edit_proc_entry(job_to_modify->pid, "R+");
+    /* Get all pids in proc/ */
+    struct dirent *de;
+    DIR *dr = opendir(proc_dir);
+    if (dr == NULL) {
+        return;
+    }
 
+    while ((de = readdir(dr)) != NULL) {
+        if (de->d_type != DT_DIR || !isnum(de->d_name)) {
+            continue;
+        }
 
-            /* Send the job a SIGCONT signal to wake it up */
-            kill(-job_to_modify->pid, SIGCONT);
+        char path[PATH_MAX];
+        if ((size_t) snprintf(path, sizeof(path), "%s/%s/status", proc_dir, de->d_name) >= sizeof(path)) {
+            continue;
+        }
 
-            /* Wait for the job to finish */
-            sigset_t prev_one;
-            sigemptyset(&prev_one); /* Create empty set */
-            sigaddset(&prev_one, SIGCHLD); /* Add SIGCHLD to wait for */
+        /* The Sid line is looked for line by line, since the command name before it can have spaces */
+        FILE *fp = fopen(path, "r");
+        int sid = 0;
+        if (fp != NULL) {
+            char line[MAXLINE];
+            while (fgets(line, sizeof(line), fp) != NULL) {
+                if (sscanf(line, "Sid: %d", &sid) == 1) {
+                    break;
+                }
+            }
+            fclose(fp);
+        }
+        if (sid <= 0 || kill(sid, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
 
-            /* Wait for the job to finish */
-            // waitfg(job_to_modify->pid, &prev_one);
-            return;
+        /* Remove the proc entry (the paths are shorter than the one above) */
+        unlink(path);
+        char tmp[PATH_MAX];
+        if ((size_t) snprintf(tmp, sizeof(tmp), "%s/%s/.status.tmp", proc_dir, de->d_name) < sizeof(tmp)) {
+            unlink(tmp);
         }
+        path[strlen(path) - strlen("/status")] = '\0';
+        rmdir(path);
     }
-}
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
- */
-void waitfg(pid_t pid, sigset_t *block_set) {
-    while (pid != fg_pid) {
-        sigsuspend(block_set);
-    }
-    fg_pid = 0;
+    closedir(dr);
 }
 
-/* bg_to_state - Convert bg indicator flag to BG/FG state code */
-int bg_to_state(int bg) {
-    int process_state;
-    if (bg) {
-        process_state = BG;
-    } else {
-        process_state = FG;
-    }
-    return process_state;
-}
 
 /*****************
- * End of State manipulation functions
+ * End of proc functions
  * ****************/
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*****************
+ * Shared proc table functions
+ * ****************/
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
-}
+/*
+ * With -P shm the stat table is written to a table of fixed size
+ * records in the POSIX shared memory object /tsh.<shell pid> instead of
+ * proc/PID/status, so a job costs no file system operations at all.
+ * Each record has a sequence number that the shell makes odd while it
+ * writes the record and even again when it is done. A reader copies the
+ * record and keeps it only if the number was the same even value before
+ * and after, so readers never lock anything and never hold up the
+ * shell. tsh-ps (this program run under that name) lists the tables.
+ */
 
-/* are_open_jobs - Check if any jobs are left to be completed */
-bool are_open_jobs(struct job_t *jobs) {
-    for (int i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].state != UNDEF) {
-            return true;
-        }
+/* open_shm_table - Create the shared proc table of this shell */
+void open_shm_table() {
+    sprintf(shmtable.name, "/tsh.%d", getpid());
+    shmtable.fd = shm_open(shmtable.name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const size_t size = sizeof(struct shmhead_t) + MINSHM * sizeof(struct shmrec_t);
+    if (shmtable.fd < 0 || ftruncate(shmtable.fd, size) < 0) {
+        unix_error("Could not create the shared proc table");
+    }
+    shmtable.head = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmtable.fd, 0);
+    shmtable.free = malloc(MINSHM * sizeof(int));
+    if (shmtable.head == MAP_FAILED || shmtable.free == NULL) {
+        unix_error("Could not map the shared proc table");
     }
-    return false;
-}
-
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+    shmtable.head->recsize = sizeof(struct shmrec_t);
+    shmtable.head->capacity = MINSHM;
+    shmtable.head->shell = getpid();
+    shmtable.used = 0;
+    shmtable.nfree = 0;
+    /* Readers ignore the table until the magic number is there */
+    __atomic_store_n(&shmtable.head->magic, SHM_MAGIC, __ATOMIC_RELEASE);
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) {
-    int i, max=0;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+/* close_shm_table - Remove the shared proc table of this shell */
+void close_shm_table() {
+    shm_unlink(shmtable.name);
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1) {
-        return 0;
-    }
+/* shm_record - Return a record of a shared proc table */
+struct shmrec_t *shm_record(struct shmhead_t *head, int slot) {
+    return (struct shmrec_t *) (head + 1) + slot;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS) {
-                nextjid = 1;
+/*
+ * shm_add - Write a new process to a free record of the shared proc table
+ *
+ * The table is doubled when it is full. Readers see the new size the
+ * next time they map it. Returns the record, or -1 if there is no room.
+ */
+int shm_add(struct stat_t *stat) {
+    int slot;
+    if (shmtable.nfree > 0) {
+        slot = shmtable.free[--shmtable.nfree];
+    } else {
+        const int capacity = shmtable.head->capacity;
+        if (shmtable.used == capacity) {
+            const size_t old_size = sizeof(struct shmhead_t) + capacity * sizeof(struct shmrec_t);
+            const size_t size = sizeof(struct shmhead_t) + 2 * capacity * sizeof(struct shmrec_t);
+            int *free_slots = realloc(shmtable.free, 2 * capacity * sizeof(int));
+            if (free_slots == NULL || ftruncate(shmtable.fd, size) < 0) {
+                reset_state_error("Could not grow the shared proc table.");
+                return -1;
             }
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            shmtable.free = free_slots;
+
+            struct shmhead_t *head = mremap(shmtable.head, old_size, size, MREMAP_MAYMOVE);
+            if (head == MAP_FAILED) {
+                reset_state_error("Could not grow the shared proc table.");
+                return -1;
             }
-            return 1;
+            shmtable.head = head;
+            shmtable.head->capacity = 2 * capacity;
         }
+        slot = shmtable.used++;
     }
 
-    printf("Tried to create too many jobs\n");
-    return 0;
+    shm_write(slot, stat);
+    return slot;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
-
-    if (pid < 1)
-	return 0;
-
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
-    }
-    return 0;
+/* shm_write - Write the stat struct of a process to its record */
+void shm_write(int slot, struct stat_t *stat) {
+    struct shmrec_t *rec = shm_record(shmtable.head, slot);
+    const unsigned int seq = rec->seq;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&rec->stat, stat, sizeof(struct stat_t));
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+/* shm_remove - Free the record of a process that is gone */
+void shm_remove(int slot) {
+    struct shmrec_t *rec = shm_record(shmtable.head, slot);
+    const unsigned int seq = rec->seq;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->stat.pid = 0;
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+    shmtable.free[shmtable.nfree++] = slot;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
-
-    if (pid < 1) {
-        return NULL;
-    }
-
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            return &jobs[i];
+/*
+ * shm_read - Copy a record that is not being written, false if it is free
+ *
+ * A shell killed while writing a record leaves its sequence number odd,
+ * so after SHMRETRIES tries the record is skipped as stale instead of
+ * waiting for a writer that is gone.
+ */
+bool shm_read(struct shmrec_t *rec, struct stat_t *stat) {
+    for (int tries = 0; ; tries++) {
+        if (tries == SHMRETRIES) {
+            return false;
+        }
+        const unsigned int seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(stat, &rec->stat, sizeof(struct stat_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+            break;
         }
     }
 
-    return NULL;
+    stat->name[MAXLINE - 1] = '\0';
+    stat->state[MAXLINE - 1] = '\0';
+    stat->uname[MAXLINE - 1] = '\0';
+    return stat->pid != 0;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) {
-    int i;
+/*
+ * ps_main - List the processes in the shared proc tables (run as tsh-ps)
+ *
+ *     tsh-ps              every table in /dev/shm
+ *     tsh-ps pid ...      the tables of the given shells
+ */
+void ps_main(int argc, char **argv) {
+    printf("%7s %7s %7s %7s %-4s %-12s %9s %s\n", "PID", "PPID", "PGID", "SID", "STAT", "USER", "TIME", "COMMAND");
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            ps_table(atoi(argv[i]));
+        }
+        exit(EXIT_SUCCESS);
+    }
 
-    if (jid < 1) {
-        return NULL;
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        unix_error("Could not open /dev/shm");
     }
- 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].jid == jid) {
-            return &jobs[i];
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "tsh.", 4) == 0 && isnum(de->d_name + 4)) {
+            ps_table(atoi(de->d_name + 4));
         }
     }
-
-    return NULL;
+    closedir(dir);
+    exit(EXIT_SUCCESS);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
-    int i;
-
-    if (pid < 1) {
-        return 0;
+/* ps_table - Print the processes in the shared proc table of a shell */
+void ps_table(pid_t shell) {
+    char name[32];
+    sprintf(name, "/tsh.%d", shell);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return;
     }
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
+    /* Map the table as it is now; records added after this are not shown */
+    struct stat sb;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && (size_t) sb.st_size >= sizeof(struct shmhead_t)) {
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
     }
 
-    return 0;
-}
+    struct shmhead_t *head = map;
+    /* Skip tables that are not ready, from another build, or left behind by a shell that died */
+    if (__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && head->recsize == sizeof(struct shmrec_t)
+        && (kill(head->shell, 0) == 0 || errno != ESRCH)) {
+        int n = (sb.st_size - sizeof(struct shmhead_t)) / sizeof(struct shmrec_t);
+        if (head->capacity < n) {
+            n = head->capacity;
+        }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-            case BG: 
-                printf("Running ");
-                break;
-            case FG: 
-                printf("Foreground ");
-                break;
-            case ST: 
-                printf("Stopped ");
-                break;
-            default:
-                printf("listjobs: Internal error: job[%d].state=%d ", 
-                i, jobs[i].state);
+        struct stat_t stat;
+        for (int i = 0; i < n; i++) {
+            if (shm_read(shm_record(head, i), &stat)) {
+                const long cpu = stat.usage.ru_utime.tv_sec + stat.usage.ru_stime.tv_sec;
+                printf("%7d %7d %7d %7d %-4s %-12s %3ld:%02ld:%02ld %s\n", stat.pid, stat.ppid, stat.pgid,
+                    stat.sid, stat.state, stat.uname, cpu / 3600, cpu / 60 % 60, cpu % 60, stat.name);
             }
-            printf("%s", jobs[i].cmdline);
         }
     }
+    munmap(map, sb.st_size);
 }
 
-/******************************
- * end job list helper routines
- ******************************/
-
 /*****************
- * History functions
+ * End of shared proc table functions
  * ****************/
 
-/* init_history - Initialize the history array with the user's previous commands */
-void init_history() {
-    /* Get the file details */
-    const size_t history_file_size = strlen(home) + 1 + 12; /* Does not include the null terminator */
-    char *history_file = malloc(sizeof(char) * (history_file_size + 1));
-    sprintf(history_file, "%s/.tsh_history", home);
+/*****************
+ * Server functions
+ *****************/
 
-    /* Open the file */
-    FILE *fp;
-    fp = fopen(history_file, "r");
-    free(history_file);
-    if (fp == NULL) {
-        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
-        reset_state_error(sbuf);
-        fclose(fp);
-        return;
-    }
+/*
+ * With -S the shell logs in once and then serves command lines sent to
+ * a Unix domain socket instead of reading them, so a new session costs
+ * a connection rather than a login, a scan of etc/passwd, init_history
+ * and a proc entry for a new shell. The user table, the history and
+ * the command hash table stay warm in the server. Each request is one
+ * SOCK_SEQPACKET message holding the command line, with the client's
+ * stdin, stdout and stderr attached as SCM_RIGHTS. While the request
+ * runs they replace the server's own, so its jobs (and the built-in
+ * commands it runs) read and write the client's files directly and no
+ * output passes through the server. A request that is a single command
+ * runs as a background job and is answered with its exit status when
+ * the job is reaped, so many of them run at once (sleep is run as the
+ * program for this). A list, or parallel, could block for as long as
+ * its commands run, so it runs in a forked copy of the server, which is
+ * a job of the server in the same way. Any other built-in command is
+ * run to the end before the next request, like a line typed at the
+ * prompt, and wait and top, which would wait on the jobs of every
+ * client, are refused. Only processes of the user the
+ * server runs as may connect, and the socket is only accessible to
+ * them. tsh -C is the client.
+ */
 
-    /* Read the file in reverse */
-    fseek(fp, 0, SEEK_END);
-    long pos = ftell(fp);
-    int i = 0;
-    
-    /* Store the commands */
-    char commands[MAXHISTORY][MAXLINE];
-    int command_count = 0;
-    char command[MAXLINE];
-    int command_length = 0;
-
-    /* Add each line to the list of commands */
-    while (i < pos && command_count < MAXHISTORY) {
-        i++;
-        fseek(fp, -i, SEEK_END);
-        char c = fgetc(fp);
-        if (c == '\n' && command_length > 0) {
-            command[command_length] = '\0';
-            strrevr(command, command_length);
-            if (command_count == 0) {
-                command[command_length - 1] = '\0';
-            }
-            strcpy(commands[command_count], command);
-            command_count++;
-            command_length = 0;
-        } else {
-            command[command_length] = c;
-            command_length++;
-        }
+/* open_server - Listen for requests on a Unix domain socket at path */
+void open_server(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        app_error("The server socket path is too long");
     }
-    if (command_count >= MAXHISTORY) {
-        command_count = MAXHISTORY;
-    } else {
-        command[command_length] = '\0';
-        strrevr(command, command_length);
-        strcpy(commands[command_count], command);
-        command_count++;
+    strcpy(addr.sun_path, path);
+
+    /* A socket left behind by a server that is gone is replaced, one that is in use is not */
+    struct stat sb;
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) && probe >= 0 &&
+            connect(probe, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno == ECONNREFUSED) {
+        unlink(path);
     }
-
-    /* Free memory not used after this */
-    fclose(fp);
-
-    /* Add the commands to the history array */
-    for (int j = command_count - 1; j >= 0; j--) {
-        add_to_history(commands[j]);
+    if (probe >= 0) {
+        close(probe);
     }
-}
 
-/* show_history - Print the history of commands (Max number of commands printed is set to MAXHISTORY = 10)*/
-void show_history() {
-    /* Most recent command is last */
-    printf("History (last 10 commands used from least to most recent):\n");
-    for (int i = 0; i < MAXHISTORY; i++) {
-        if (strlen(history[i]) != 0) {
-            printf("%d. %s\n", i + 1, history[i]);
-        }
+    if ((server.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+        unix_error("Could not create the server socket");
+    }
+    mode_t mask = umask(077);
+    if (bind(server.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        sprintf(sbuf, "Could not bind the server socket %s", path);
+        unix_error(sbuf);
+    }
+    umask(mask);
+    if (listen(server.fd, SOMAXCONN) < 0) {
+        unix_error("Could not listen on the server socket");
+    }
+    if ((server.path = strdup(path)) == NULL) {
+        unix_error("Could not allocate the server socket path");
     }
-}
 
-/* history_length - Number of commands present in the history */
-int history_length() {
-    int count = 0;
-    for (int i = 0; i < MAXHISTORY; i++) {
-        if (strlen(history[i]) == 0) {
-            break;
+    /* Keep the shell's own stdin, stdout and stderr to put back after each request */
+    for (int i = 0; i < 3; i++) {
+        if ((server.saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3)) < 0) {
+            unix_error("Could not save the shell's stdio");
         }
-        count += 1;
     }
-    return count;
 }
 
-/* write_to_history - Write command to history file */
-void write_to_history(char *cmd) {
-    /* Preprocess the command */
-    if (cmd[strlen(cmd) - 1] == '\n') {
-        cmd[strlen(cmd) - 1] = '\0';
-    }
-    
-    /* Check for ! since it should not be written */
-    if (cmd[0] == '!') {
-        return;
+/*
+ * fork_request - Run the request being served in a copy of the server
+ *
+ * The copy is put in a process group of its own and added to the job
+ * table as a background job that answers the request when it ends. It
+ * starts with an empty job table and a signal pipe of its own, so it
+ * only waits for its own children, and it never takes requests or
+ * writes out the server's history. Returns the pid of the copy in the
+ * server (-1 if it could not be started), and 0 in the copy, which
+ * runs the request and exits (see run_request).
+ */
+pid_t fork_request(char *cmdline) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        reset_state_error("Could not fork the request.");
+        last_status = 1;
+        return -1;
     }
 
-    /* Get the file details */
-    const size_t history_file_size = strlen(home) + 1 + 12; /* Does not include the null terminator */
-    char *history_file = malloc(sizeof(char) * (history_file_size + 1));
-    sprintf(history_file, "%s/.tsh_history", home);
-
-    /* Open the file */
-    FILE *fp;
-    fp = fopen(history_file, "a");
-
-    /* Free up memory not used */
-    free(history_file);
-
-    if (fp == NULL) {
-        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
-        reset_state_error(sbuf);
-        fclose(fp);
-        return;
+    if (pid == 0) {
+        setpgid(0, 0);
+        server.subshell = true;
+        close(server.fd);
+        server.fd = -1;
+        close(sig_pipe[0]);
+        close(sig_pipe[1]);
+        init_signal_pipe();
+        if (capture_epfd >= 0) {
+            close(capture_epfd);
+            capture_epfd = -1;
+        }
+        initjobs(&jobs);
+        nextjid = 1;
+        histfile.len = 0; /* the server writes out its own buffered history */
+        return 0;
     }
 
-    /* Write the command to the file as a new line */
-    const size_t written = fprintf(fp, "%s\n", cmd);
-    if (written != strlen(cmd) + 1) {
-        reset_state_error("Could not write to history file.");
+    setpgid(pid, pid);
+    if (addjob(&jobs, &pid, 1, BG, cmdline)) {
+        getjobpid(&jobs, pid)->client = server.client;
+        server.client = -1;
     }
-    fclose(fp);
-    
-    /* Add to history */
-    add_to_history(cmd);
+    struct stat_t stat;
+    get_stat(&stat, pid, pid, "tsh", BG);
+    add_stat(&stats, &stat);
+    last_status = 0;
+    return pid;
 }
 
-/* run_nth_history - Run the Nth command in the history file */
-void run_nth_history(char *cmd) {
-    /* Get the number of the command to run (subtract 1 for 0 indexing) */
-    int n;
-    sscanf(cmd, "!%d", &n);
-    const int h_length = history_length();
-    if (n > h_length) {
-        sprintf(sbuf, "Called command %d from history, however only %d commands present in history.", n, h_length);
-        reset_state_error(sbuf);
-        return;
-    } else if (n < 1) {
-        sprintf(sbuf, "Called command %d from history, however the number must be greater than 0.", n);
-        reset_state_error(sbuf);
+/* close_server - Stop listening and remove the socket when the shell exits */
+void close_server() {
+    if (server.fd < 0) {
         return;
     }
-    n -= 1;
-
-    char command[MAXLINE];
-    strcpy(command, history[n]);
-    /* Add newline to simulate entry by user */
-    strcat(command, "\n");
-    eval(command);
-    return;
+    close(server.fd);
+    server.fd = -1;
+    unlink(server.path);
+    free(server.path);
+    server.path = NULL;
 }
 
-/* add_to_history - Add command to history file */
-void add_to_history(char *cmd) {
-    /* Add to history */
-    bool added = false;
-    for (int i = 0; i < MAXHISTORY; i++) {
-        if (strlen(history[i]) == 0) {
-            strcpy(history[i], cmd);
-            added = true;
-            break;
-        }
+/* serve_next - Handle signals until a request arrives, and run it */
+void serve_next() {
+    handle_signals();
+    struct pollfd pfds[2] = {{server.fd, POLLIN, 0}, {sig_pipe[0], POLLIN, 0}};
+    if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+        unix_error("poll error");
     }
-
-    /* If the history is full, shift the history down and add the command */
-    if (!added) {
-        for (int i = 0; i < MAXHISTORY - 1; i++) {
-            strcpy(history[i], history[i + 1]);
-        }
-        strcpy(history[MAXHISTORY - 1], cmd);
+    if (pfds[1].revents & POLLIN) {
+        handle_signals();
+    }
+    if (pfds[0].revents & POLLIN) {
+        accept_request();
     }
 }
 
-/* reset_history - Reset the .tsh_history file */
-void reset_history() {
-    /* Get the file details */
-    const size_t history_file_size = strlen(home) + 1 + 12; /* Does not include the null terminator */
-    char *history_file = malloc(sizeof(char) * (history_file_size + 1));
-    sprintf(history_file, "%s/.tsh_history", home);
+/* request_pending - Check if a client is waiting to connect */
+bool request_pending() {
+    struct pollfd pfd = {server.fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
 
-    /* Open the file */
-    FILE *fp;
-    fp = fopen(history_file, "w");
+/* accept_request - Accept a connection and run the request it sends */
+void accept_request() {
+    int fd = accept4(server.fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return; /* the client has gone already */
+    }
 
-    /* Free up memory not used */
-    free(history_file);
+    /* Only the user the server runs as may use it */
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+        close(fd);
+        return;
+    }
 
-    if (fp == NULL) {
-        sprintf(sbuf, "Could not open %s/.tsh_history file.", home);
-        reset_state_error(sbuf);
-        fclose(fp);
+    /* A client that connects and sends nothing does not hold up the server */
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char line[MAXLINE];
+    int fds[3];
+    if (!recv_request(fd, line, fds)) {
+        close(fd);
         return;
     }
+    run_request(fd, line, fds);
+}
 
-    /* Write all history commands to the file as a new line */
-    size_t written;
-    for (int i = 0; i < MAXHISTORY; i++) {
-        if (strlen(history[i]) != 0) {
-            written = fprintf(fp, "%s\n", history[i]);
-            if (written != strlen(history[i]) + 1) {
-                reset_state_error("Could not write to history file.");
+/*
+ * recv_request - Read the command line and the three fds of a request
+ *
+ * Returns false (closing any fds that came with it) unless the message
+ * is one line of less than MAXLINE bytes with exactly three fds.
+ */
+bool recv_request(int fd, char *line, int *fds) {
+    union {                     /* room for the fds, aligned for a cmsghdr */
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {line, MAXLINE - 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (nfds < 3) {
+                    fds[nfds++] = received;
+                } else {
+                    close(received);
+                }
             }
         }
     }
-    fclose(fp);
+
+    if (n > 0 && nfds == 3 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && memchr(line, '\n', n) == NULL) {
+        line[n] = '\0';
+        return true;
+    }
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    return false;
 }
 
+/* run_request - Run the command line of a request with the client's stdin, stdout and stderr */
+void run_request(int fd, char *line, int *fds) {
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
 
-/*****************
- * End of history functions
- * ****************/
+    server.client = fd;
+    struct timespec start;
+    trace_start(&start);
+    eval(line);
+    trace_end(TRACE_EVAL, &start);
+    server.defer = false;
 
-/*****************
- * Stat functions
- * ****************/
+    /* A copy of the server that ran the request is done (its job in the server answers it) */
+    if (server.subshell) {
+        fflush(stdout);
+        _exit(last_status);
+    }
 
-/* shell_stat - Create shell stat struct */
-void shell_stat(struct stat_t *stat) {
-    strcpy(stat->name, "tsh");
-    stat->pid = getpid();
-    stat->ppid = getppid();
-    stat->pgid = stat->pid;
-    stat->sid = stat->pid;
-    strcpy(stat->state, "Ss");
-    strcpy(stat->uname, username);
+    /* What the request printed goes to the client, and the rest to the shell's own stdout */
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        dup2(server.saved[i], i);
+    }
 
-    session_id = stat->sid;
+    /* A request that did not leave a job to answer it is answered now */
+    if (server.client >= 0) {
+        reply_request(server.client, last_status);
+        server.client = -1;
+    }
 }
 
-/* get_stat - Create stat struct for process */
-void get_stat(struct stat_t *stat, pid_t pid, char *cmd, int process_state) {
-    /* Get the process details */
-    strcpy(stat->name, cmd);
-    stat->pid = pid;
-    stat->ppid = getppid();
-    stat->pgid = getpgid(pid);
-    stat->sid = session_id;
-    /* Determine the state */
-    determine_stat_state(stat, process_state);
-    strcpy(stat->uname, username);
+/* reply_request - Send the exit status of a request to its client and close the connection */
+void reply_request(int fd, int status) {
+    char reply[16];
+    int len = sprintf(reply, "%d", status);
+    if (send(fd, reply, len, MSG_NOSIGNAL) < 0) {
+        /* The client has gone, so there is nobody to tell */
+    }
+    close(fd);
 }
 
-/* determine_stat_state - Determine the state of the stat struct based on background/foreground */
-void determine_stat_state(struct stat_t *stat, int process_state) {
-    char first_char;
-    
-    if (stat->pid == stat->sid) {
-        first_char = 'S';
-    } else {
-        switch (process_state) {
-            case FG:
-                first_char = 'R';
-                break;
-            case BG:
-                first_char = 'R';
-                break;
-            case ST:
-                first_char = 'T';
-                break;
-            case UNDEF:
-                first_char = '!'; /* Should never happen */
-                unix_error("Undefined process state.");
-                break;
-            default:
-                first_char = '?'; /* Should never happen */
-                unix_error("Unknown process state.");
-                break;
+/*
+ * client_main - Run as the client of a server (tsh -C socket command [arg ...])
+ *
+ * The arguments are joined into one command line, which is sent with
+ * the client's stdin, stdout and stderr. The client exits with the
+ * status the server answers with.
+ */
+void client_main(int argc, char **argv) {
+    if (argc < 4) {
+        app_error("Usage: tsh -C socket command [arg ...]");
+    }
+
+    char line[MAXLINE];
+    size_t len = 0;
+    for (int i = 3; i < argc; i++) {
+        size_t n = strlen(argv[i]);
+        if (len + n + 1 >= MAXLINE) {
+            app_error("Command line is too long.");
+        }
+        if (i > 3) {
+            line[len++] = ' ';
         }
+        memcpy(line + len, argv[i], n);
+        len += n;
     }
 
-    char second_char;
-    if (stat->pid == stat->sid) {
-        second_char = 's';
-    } else if (process_state == FG) {
-        second_char = '+';
-    } else {
-        second_char = '\0';
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        app_error("The server socket path is too long");
+    }
+    strcpy(addr.sun_path, argv[2]);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        sprintf(sbuf, "Could not connect to %s", argv[2]);
+        unix_error(sbuf);
     }
 
-    sprintf(stat->state, "%c%c", first_char, second_char);
+    /* Send the line with stdin, stdout and stderr */
+    union {                     /* room for the fds, aligned for a cmsghdr */
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    struct iovec iov = {line, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        unix_error("Could not send the command line");
+    }
+
+    /* Wait for the exit status */
+    char reply[16];
+    ssize_t n;
+    while ((n = recv(fd, reply, sizeof(reply) - 1, 0)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        app_error("The server did not answer");
+    }
+    reply[n] = '\0';
+    exit(atoi(reply));
 }
 
 /*****************
- * End of stat functions
- * ****************/
+ * End of server functions
+ *****************/
 
 /*****************
- * Proc functions
- * ****************/
+ * Event loop functions
+ *****************/
 
-/* write_to_proc - Write to proc/PID/status */
-void create_proc_entry(struct stat_t *stat) {
-    /* Get the folder details */
-    char proc_dir[MAXLINE];
-    sprintf(proc_dir, "proc/%d", stat->pid);
+/*
+ * The signal handlers do no work of their own. Each one sets its flag
+ * and writes a byte to a self-pipe. The main loop polls the pipe along
+ * with its input (wait_for_input), and waitfg polls it while a
+ * foreground job runs (wait_for_signal). handle_signals then does the
+ * work outside of any handler: it forwards ctrl-c and ctrl-z to the
+ * foreground job and reaps every child that has changed state in one
+ * batch. The job table and the stat table are therefore only ever
+ * changed from the main flow of the shell, and nothing needs to block
+ * signals to protect them.
+ */
 
-    /* Create the folder */
-    if (mkdir(proc_dir, MKDIR_MODE) == -1) {
-        sprintf(sbuf, "Could not create folder %s.", proc_dir);
-        reset_state_error(sbuf);
-        return;
+/* init_signal_pipe - Create the self-pipe the signal handlers write to */
+void init_signal_pipe() {
+    if (pipe2(sig_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        unix_error("Could not create the signal pipe");
     }
-    
-    /* Write to the file */
-    write_proc_entry(stat);
 }
 
-/* write_proc_entry - Write to proc/PID/status */
-void write_proc_entry(struct stat_t *stat) {
-    /* Get the file details */
-    char proc_file[MAXLINE];
-    sprintf(proc_file, "proc/%d/status", stat->pid);
-
-    /* Open the file */
-    FILE *fp;
-    fp = fopen(proc_file, "w");
-    if (fp == NULL) {
-        sprintf(sbuf, "Could not open %s file.", proc_file);
-        reset_state_error(sbuf);
-        fclose(fp);
-        return;
+/* notify_signal - Set a flag and wake up the main loop (async-signal-safe) */
+void notify_signal(volatile sig_atomic_t *flag) {
+    int olderrno = errno;
+    *flag = 1;
+    char byte = 0;
+    if (write(sig_pipe[1], &byte, 1) < 0) {
+        /* The pipe is full, so the main loop has a wake-up pending already */
     }
+    errno = olderrno;
+}
 
-    sprintf(sbuf, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s\n", 
-    stat->name, stat->pid, stat->ppid, stat->pgid, stat->sid, stat->state, stat->uname);
-
-    const size_t written = fprintf(fp, "%s", sbuf);
-    if (written != strlen(sbuf)) {
-        reset_state_error("Could not write to proc/PID/status file.");
+/* wait_for_input - Handle signals until a line of input can be read */
+void wait_for_input(struct input_t *in) {
+    handle_signals();
+    while (!input_pending(in)) {
+        struct pollfd pfds[2] = {{in->fd, POLLIN, 0}, {sig_pipe[0], POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+            unix_error("poll error");
+        }
+        if (pfds[1].revents & POLLIN) {
+            handle_signals();
+            flush_stats(&stats);
+        }
+        if (pfds[0].revents) {
+            return;
+        }
     }
-    fclose(fp);
 }
-    
-/* read_proc_entry - Read proc entrt in proc/PID/status */
-void read_proc_entry(struct stat_t *stat, pid_t pid) {
-    /* Get the file details */
-    char proc_file[MAXLINE];
-    sprintf(proc_file, "proc/%d/status", pid);
 
-    /* Open the file */
-    FILE *fp;
-    fp = fopen(proc_file, "r");
-    if (fp == NULL) {
-        sprintf(sbuf, "Could not open %s file.", proc_file);
-        reset_state_error(sbuf);
-        fclose(fp);
-        return;
+/* wait_for_signal - Sleep until a signal arrives and handle it */
+void wait_for_signal() {
+    struct pollfd pfd = {sig_pipe[0], POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        unix_error("poll error");
     }
-
-    /* Read the file */
-    fscanf(fp, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s\n", 
-    stat->name, &stat->pid, &stat->ppid, &stat->pgid, &stat->sid, stat->state, stat->uname);
-
-    fclose(fp);
+    handle_signals();
 }
 
-/* edit_proc_entry - Edit proc entry in proc/PID/status */
-void edit_proc_entry(pid_t pid, char *new_state) {
-    /* Get the file details */
-    char proc_file[MAXLINE];
-    sprintf(proc_file, "proc/%d/status", pid);
-
-    /* Read the current files contents into a stat struct */
-    struct stat_t stat;
-    read_proc_entry(&stat, pid);
+/*
+ * sleep_shell - Wait until seconds have passed since start, handling signals meanwhile
+ *
+ * Used by the built-in commands that wait in the shell (sleep and top),
+ * so children are still reaped while they wait. Returns false if ctrl-c
+ * cut the wait short.
+ */
+bool sleep_shell(struct timespec *start, double seconds) {
+    sleeping.active = true;
+    sleeping.interrupted = false;
+    double left;
+    while ((left = seconds - elapsed_since(start)) > 0 && !sleeping.interrupted) {
+        struct pollfd pfd = {sig_pipe[0], POLLIN, 0};
+        int timeout = (left >= INT_MAX / 1000) ? INT_MAX : (int) (left * 1000) + 1;
+        if (poll(&pfd, 1, timeout) > 0) {
+            handle_signals();
+        }
+    }
+    sleeping.active = false;
+    return !sleeping.interrupted;
+}
 
-    /* Edit the state */
-    strcpy(stat.state, new_state);
+/* handle_signals - Do the work for the signals that have arrived since the last call */
+void handle_signals() {
+    /* Empty the pipe before looking at the flags so no wake-up is lost */
+    char drain[64];
+    while (read(sig_pipe[0], drain, sizeof(drain)) > 0) {
+    }
 
-    /* Write the new state to the file */
-    write_proc_entry(&stat);
-}
+    if (got_sigint) {
+        got_sigint = 0;
+        /* Send the signal to the foreground job, which is reaped below */
+        pid_t pid = fgpid(&jobs);
+        if (pid != 0 && kill(-pid, SIGINT) < 0) {
+            reset_state_error("kill error");
+        } else if (pid == 0 && parallel.active) {
+            interrupt_parallel();
+        } else if (pid == 0 && sleeping.active) {
+            sleeping.interrupted = true;
+        }
+    }
 
-/* remove_proc_entry - Remove a specific proc entry in proc/PID/status */
-void remove_proc_entry(pid_t pid) {
-    /* Get the file details */
-    char proc_file[MAXLINE];
-    sprintf(proc_file, "proc/%d/status", pid);
+    if (got_sigtstp) {
+        got_sigtstp = 0;
+        /* Send the signal to the foreground job, which is marked stopped below */
+        pid_t pid = fgpid(&jobs);
+        if (pid != 0 && kill(-pid, SIGTSTP) < 0) {
+            reset_state_error("kill error");
+        }
+    }
 
-    /* Remove the file */
-    if (remove(proc_file) == -1) {
-        sprintf(sbuf, "Could not remove %s file.", proc_file);
-        reset_state_error(sbuf);
-        return;
+    /* Read the output of the captured jobs before reaping, so a job's output is all there when it is done */
+    if (got_sigio) {
+        got_sigio = 0;
+        drain_captures();
     }
 
-    /* Remove the folder */
-    char proc_dir[MAXLINE];
-    sprintf(proc_dir, "proc/%d", pid);
-    if (rmdir(proc_dir) == -1) {
-        sprintf(sbuf, "Could not remove %s folder.", proc_dir);
-        reset_state_error(sbuf);
-        return;
+    if (got_sigchld) {
+        /* sigchld_handler only sets sigchld_at while got_sigchld is 0 */
+        trace_end(TRACE_WAKEUP, &sigchld_at);
+        got_sigchld = 0;
+        struct timespec start;
+        trace_start(&start);
+        reap_children();
+        trace_end(TRACE_REAP, &start);
     }
 }
 
-/* remove_proc_entries - Remove all proc entries in proc/PID/status */
-void remove_proc_entries() {
-    /* Get the folder details */
-    char proc_dir[MAXLINE];
-    sprintf(proc_dir, "proc");
+/*
+ * reap_children - Reap every child that has exited or stopped
+ *
+ * wait4 also gives the resources the child used. Those of an exited
+ * stage are added to its job; those of a stopped one go to its proc
+ * entry.
+ */
+void reap_children() {
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+        /* Get the job that this child is a stage of */
+        struct job_t *job = getjobpid(&jobs, pid);
+        if (job == NULL) {
+            continue;
+        }
 
-    /* Get all pids in proc/ */
-    struct dirent *de;
-    DIR *dr = opendir(proc_dir);
-    if (dr == NULL) {
-        sprintf(sbuf, "Could not open %s folder.", proc_dir);
-        reset_state_error(sbuf);
-        return;
-    }
+        /* Check if the child terminated normally or there was some error */
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            /* Remove the proc entry of this stage */
+            remove_stat(&stats, pid);
 
-    while ((de = readdir(dr)) != NULL) {
-        /* Check if the file is a directory */
-        if (de->d_type == DT_DIR) {
-            /* Check if the directory is a pid */
-            if (isnum(de->d_name)) {
-                /* Remove the proc entry */
-                remove_proc_entry(atoi(de->d_name));
+            /* The job's status is that of the last stage of the pipeline */
+            add_usage(&job->usage, &usage);
+            if (pid == job->pids[job->npids - 1]) {
+                job->status = status;
+            }
+
+            /* The job is done once the last stage of the pipeline has exited */
+            if (stage_exited(&jobs, job, pid) == 0) {
+                if (job->state == FG) {
+                    last_status = exit_status(job->status);
+                }
+                if (job->timed) {
+                    print_usage(elapsed_since(&job->start), &job->usage);
+                }
+                trace_job(job);
+                if (job->capture != NULL) {
+                    drain_capture(job->capture);
+                }
+                if (job->client >= 0) {
+                    reply_request(job->client, exit_status(job->status));
+                } else if ((job->state != FG || job->capture != NULL) && !job->in_parallel) {
+                    queue_done(job); /* a captured job is queued from the foreground too, for output */
+                }
+                if (job->in_parallel) {
+                    parallel.running--;
+                    if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+                        parallel.failed++;
+                    }
+                }
+                removejob(&jobs, job);
+            }
+        } else if (WIFSTOPPED(status) && job->in_parallel) {
+            /* A stopped command of parallel would never free its worker, so it is killed (and fails) */
+            kill(-job->pid, SIGKILL);
+        } else if (WIFSTOPPED(status)) { /* Check if the child stopped */
+            /* Edit the proc entries and the job state */
+            edit_stat_usage(&stats, pid, &usage);
+            if (job->state == FG) {
+                last_status = 128 + WSTOPSIG(status);
+            }
+            if (job->state != ST) {
+                setjobstate(&jobs, job, ST);
+                edit_job_stats(&stats, job, "T");
             }
         }
     }
-
-    closedir(dr);
 }
 
-
 /*****************
- * End of proc functions
- * ****************/
+ * End of event loop functions
+ *****************/
 
 /*****************
  * Signal handlers
@@ -1443,151 +8234,48 @@ void remove_proc_entries() {
 /* 
  * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
  *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     received a SIGSTOP or SIGTSTP signal. The children are reaped
+ *     later by reap_children in the main loop.
  */
 void sigchld_handler(int sig) {
     if (sig == SIGCHLD) {
-        int olderrno = errno;
-        sigset_t mask_all, prev_all;
-        sigfillset(&mask_all);
-
-        /* Determine how the child process stopped */
-        int status;
-
-        /* Reap all available zombie children */
-        while ((pid_buf = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-            /* Block all signals */
-            sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-            /* Check if the child terminated normally or there was some error */
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                /* Get the job */
-                struct job_t *job = getjobpid(jobs, pid_buf);
-                if (job == NULL) {
-                    /* Unblock */
-                    sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                    errno = olderrno;
-                    return;
-                }
-
-                /* Set the foreground pid to let waitfg know to exit */
-                if (job->state == FG) {
-                    fg_pid = pid_buf;
-                }
-
-                /* Remove the proc entry and delete job */
-                remove_proc_entry(pid_buf);
-                deletejob(jobs, pid_buf);
-            } else if (WIFSTOPPED(status)) { /* Check if the child stopped */
-                /* Get the job */
-                struct job_t *job = getjobpid(jobs, pid_buf);
-                if (job == NULL) {
-                    /* Unblock */
-                    sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                    errno = olderrno;
-                    return;
-                }
-                /* Edit the proc entry and the job state */
-                job->state = ST;
-                edit_proc_entry(pid_buf, "T");
-                /* Reset the foreground process to let waitfg know to exit */
-                fg_pid = pid_buf;
-                /* This section is handled by the SIGSTP handler and is repeated for clarity */
-            }
-
-            /* Unblock all signals */
-            sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        /* clock_gettime is async-signal-safe */
+        if (trace.on && !got_sigchld) {
+            clock_gettime(CLOCK_MONOTONIC, &sigchld_at);
         }
-
-
-        // if (errno != ECHILD) {
-        //     sigsafe_error("SIGCHLD error");
-        // }
-
-        errno = olderrno;
+        notify_signal(&got_sigchld);
     }
-    return;
 }
 
 /* 
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    user types ctrl-c at the keyboard.  handle_signals sends it along
  *    to the foreground job.  
  */
 void sigint_handler(int sig) {
     if (sig == SIGINT) {
-        int olderrno = errno;
-
-        sigset_t mask_all, prev_all;
-        sigfillset(&mask_all);
-        /* Block all signals */
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        
-        pid_buf = fgpid(jobs);
-
-        if (pid_buf != 0) {
-            /* Delete the job and proc entry */
-            deletejob(jobs, pid_buf);
-            remove_proc_entry(pid_buf);
-
-            /* Set the fg_pid to pid_buf to tell waitfg to exit */
-            fg_pid = pid_buf;
-
-            /* Send the signal to the foreground job */
-            if (kill(-pid_buf, SIGINT) < 0) {
-                sigsafe_error("kill error");
-            }
-        }
-
-        /* Unblock all signals */
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
-
-        // if (errno != ECHILD) {
-        //     sigsafe_error("SIGINT error");
-        // }
-
-        errno = olderrno;
+        notify_signal(&got_sigint);
     }
 }
 
 /*
  * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ *     the user types ctrl-z at the keyboard. handle_signals suspends
+ *     the foreground job by sending it a SIGTSTP.  
  */
 void sigtstp_handler(int sig) {
     if (sig == SIGTSTP) {
-        int olderrno = errno;
-
-        sigset_t mask_all, prev_all;
-        sigfillset(&mask_all);
-        /* Block all signals */
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        
-        pid_buf = fgpid(jobs);
-        
-        /* Edit job state and proc entry stat field */
-        getjobpid(jobs, pid_buf)->state = ST;
-        edit_proc_entry(pid_buf, "T");
-
-
-        if (pid_buf != 0) {
-            /* Send the signal to the foreground job */
-            if (kill(-pid_buf, SIGTSTP) < 0) {
-                sigsafe_error("kill error");
-            }
-        }
-
-        /* Unblock all signals */
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
-
-        // if (errno != ECHILD) {
-        //     sigsafe_error("SIGTSTP error");
-        // }
-
-        errno = olderrno;
+        notify_signal(&got_sigtstp);
+    }
+}
 
+/*
+ * sigio_handler - The kernel sends a SIGIO to the shell whenever output
+ *     arrives on the pipe of a captured job. handle_signals reads it.
+ */
+void sigio_handler(int sig) {
+    if (sig == SIGIO) {
+        notify_signal(&got_sigio);
     }
 }
 
@@ -1674,11 +8362,18 @@ void app_error(char *msg) {
 */
 void reset_state_error(char *msg) {
     fprintf(stdout, "Error: %s\n", msg);
+    last_status = 1;
 }
 
 /* user_error - Raised when user makes error */
 void user_error(char *msg) {
     fprintf(stdout, "%s\n", msg);
+    last_status = 1;
+}
+
+/* exit_status - The status ($?) of a process from its wait status */
+int exit_status(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
 /* sigsafe_error - Signal safe error */
@@ -1706,24 +8401,56 @@ bool isnum(char *str) {
     return true;
 }
 
-/* strrev - Reverse a string (in-place) */
-void strrevr(char *str, const int length) {
-    char c;
-    for (int i = 0; i < length / 2; i++) {  
-        c = str[i];  
-        str[i] = str[length - i - 1];  
-        str[length - i - 1] = c;  
-    }  
-} 
+/*
+ * shell_file - Build the path of name in the directory the shell was started in
+ *
+ * etc/passwd, home/ and proc/ are found through here, so they are still
+ * found after cd. path needs room for PATH_MAX bytes and may be name.
+ */
+char *shell_file(char *path, const char *name) {
+    const size_t dir_len = strlen(shell_dir);
+    const size_t name_len = strlen(name);
+    if (dir_len + 1 + name_len >= PATH_MAX) {
+        path[0] = '\0'; /* too long, so opening it fails */
+        return path;
+    }
+    memmove(path + dir_len + 1, name, name_len + 1);
+    memcpy(path, shell_dir, dir_len);
+    path[dir_len] = '/';
+    return path;
+}
+
+/* write_all - Write len bytes of buf to fd, returns false on an error */
+bool write_all(int fd, const char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
 
 /*
  * usage - print a help message
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpfT] [-P files|shm|none] [-c commands | script | -S socket]\n");
+    printf("       shell -C socket command [arg ...]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -f   launch commands with fork() instead of posix_spawn()\n");
+    printf("   -T   time the stages of the shell (see the stats command)\n");
+    printf("   -P   where to write proc entries: files (default), shm or none\n");
+    printf("   -c   run the given commands instead of reading them from stdin\n");
+    printf("   -S   log in once and run the command lines sent to the socket\n");
+    printf("   -C   send a command line to the server at the socket and exit with its status\n");
     exit(EXIT_SUCCESS);
 }
 